@@ -33,6 +33,7 @@ while [ $# -gt 0 ] ; do
     case $1 in
     --without-curses)   WITHOUT_CURSES=1 ;;
     --with-large-file)  WITH_LARGE_FILE=1 ;;
+    --with-piece-table) WITH_PIECE_TABLE=1 ;;
     --help)             CONFIG_HELP=1 ;;
 
     --mingw32-prefix=*)     MINGW32_PREFIX=`echo $1 | sed -e 's/--mingw32-prefix=//'`
@@ -61,6 +62,7 @@ if [ "$CONFIG_HELP" = "1" ] ; then
     echo "Available options:"
     echo "--without-curses      Disable curses (text) interface detection."
     echo "--with-large-file     Include Large File support (>2GB)."
+    echo "--with-piece-table    Use the piece table buffer engine by default."
     echo "--prefix=PREFIX       Installation prefix ($PREFIX)."
     echo "--docdir=DOCDIR       Instalation directory for documentation."
     echo "--mingw32             Build using the mingw32 compiler."
@@ -115,6 +117,10 @@ if [ "$WITH_LARGE_FILE" = 1 ] ; then
     echo "#define _FILE_OFFSET_BITS 64" >> config.h
 fi
 
+if [ "$WITH_PIECE_TABLE" = 1 ] ; then
+    echo "#define CONFOPT_PIECE_TABLE 1" >> config.h
+fi
+
 #########################################################
 
 # configuration directives
@@ -142,6 +148,126 @@ echo "CFLAGS=$CFLAGS" >> makefile.opts
 CC="$CC $CFLAGS"
 
 
+# mmap
+echo -n "Testing for mmap()... "
+echo "#include <sys/mman.h>" > .tmp.c
+echo "int main(void) { mmap(0, 0, PROT_READ, MAP_PRIVATE, 0, 0); return 0; }" >> .tmp.c
+
+$CC .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "#define CONFOPT_MMAP 1" >> config.h
+    echo "OK"
+else
+    echo "No"
+fi
+
+# memrchr
+echo -n "Testing for memrchr()... "
+echo "#define _GNU_SOURCE" > .tmp.c
+echo "#include <string.h>" >> .tmp.c
+echo "int main(void) { return memrchr(\"x\", 'x', 1) == 0; }" >> .tmp.c
+
+$CC .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "#define CONFOPT_MEMRCHR 1" >> config.h
+    echo "OK"
+else
+    echo "No"
+fi
+
+
+# memmem
+echo -n "Testing for memmem()... "
+echo "#define _GNU_SOURCE" > .tmp.c
+echo "#include <string.h>" >> .tmp.c
+echo "int main(void) { return memmem(\"x\", 1, \"x\", 1) == 0; }" >> .tmp.c
+
+$CC .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "#define CONFOPT_MEMMEM 1" >> config.h
+    echo "OK"
+else
+    echo "No"
+fi
+
+
+# writev
+echo -n "Testing for writev()... "
+echo "#include <sys/uio.h>" > .tmp.c
+echo "int main(void) { struct iovec v; writev(1, &v, 0); return 0; }" >> .tmp.c
+
+$CC .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "#define CONFOPT_WRITEV 1" >> config.h
+    echo "OK"
+else
+    echo "No"
+fi
+
+
+# realpath
+echo -n "Testing for realpath()... "
+echo "#include <stdlib.h>" > .tmp.c
+echo "int main(void) { return realpath(\".\", 0) == 0; }" >> .tmp.c
+
+$CC .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "#define CONFOPT_REALPATH 1" >> config.h
+    echo "OK"
+else
+    echo "No"
+fi
+
+
+# fchown
+echo -n "Testing for fchown()... "
+echo "#include <unistd.h>" > .tmp.c
+echo "int main(void) { return fchown(1, -1, -1); }" >> .tmp.c
+
+$CC .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "#define CONFOPT_FCHOWN 1" >> config.h
+    echo "OK"
+else
+    echo "No"
+fi
+
+
+# fdatasync
+echo -n "Testing for fdatasync()... "
+echo "#include <unistd.h>" > .tmp.c
+echo "int main(void) { fdatasync(1); return 0; }" >> .tmp.c
+
+$CC .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "#define CONFOPT_FDATASYNC 1" >> config.h
+    echo "OK"
+else
+    echo "No"
+
+    # fsync
+    echo -n "Testing for fsync()... "
+    echo "#include <unistd.h>" > .tmp.c
+    echo "int main(void) { fsync(1); return 0; }" >> .tmp.c
+
+    $CC .tmp.c -o .tmp.o 2>> .config.log
+
+    if [ $? = 0 ] ; then
+        echo "#define CONFOPT_FSYNC 1" >> config.h
+        echo "OK"
+    else
+        echo "No"
+    fi
+fi
+
+
 # Win32
 echo -n "Testing for windows... "
 if [ "$WITHOUT_WINDOWS" = "1" ] ; then
@@ -12,16 +12,108 @@ extern "C" {
 
 #define QW_BLOCK_SIZE 4096
 
+/* size of the pooled slots for small journal payloads */
+#define QW_JOURNAL_SLOT 256
+
+/* initial value of content hashes */
+#define QW_BLOCK_HASH_INIT 0xcbf29ce484222325ULL
+
+typedef struct qw_pool qw_pool;
+
+struct qw_pool {
+    int size;                   /* size of elements */
+    int count;                  /* elements per slab */
+    void *free;                 /* list of freed elements */
+    void *slabs;                /* list of slabs (newest first) */
+    int left;                   /* unused elements in newest slab */
+    int used;                   /* number of allocated elements */
+};
+
+void qw_pool_init(qw_pool *p, int size, int count);
+void *qw_pool_alloc(qw_pool *p);
+void qw_pool_free(qw_pool *p, void *e);
+void qw_pool_release(qw_pool *p);
+
 typedef struct qw_block qw_block;
+typedef struct qw_chain qw_chain;
+typedef struct qw_addbuf qw_addbuf;
+typedef struct qw_payload qw_payload;
+typedef struct qw_wal qw_wal;
+typedef struct qw_rows qw_rows;
+typedef struct qw_lex qw_lex;
+typedef struct qw_cursor qw_cursor;
 
 struct qw_block {
     qw_block *prev;             /* previous block in chain */
     qw_block *next;             /* next block in chain */
     int used;                   /* number of used bytes */
-    char data[QW_BLOCK_SIZE];   /* data block */
+    qw_chain *chain;            /* chain this block belongs to */
+    qw_block *up;               /* parent in the index tree */
+    qw_block *left;             /* left child in the index tree */
+    qw_block *right;            /* right child in the index tree */
+    unsigned int prio;          /* priority in the index tree */
+    int total;                  /* used bytes in this index subtree */
+    int lines;                  /* newlines in data (-1: unknown) */
+    int tlines;                 /* newlines in this index subtree (-1: unknown) */
+    int size;                   /* allocated size of data (0: read-only) */
+    int raw;                    /* size of the CR/LF data still pointed to (0: none) */
+    char *data;                 /* data block */
+};
+
+struct qw_chain {
+    qw_block *root;             /* root of the index tree */
+    qw_block *first;            /* first block in chain */
+    qw_block *last;             /* last block in chain */
+    unsigned int seed;          /* seed for index tree priorities */
+    char *base;                 /* read-only base data (file content) */
+    int base_size;              /* size of base data */
+    int mapped;                 /* base data is memory-mapped */
+    int pieces;                 /* blocks are pieces (piece table engine) */
+    qw_addbuf *add;             /* append-only add buffers (newest first) */
+    int dirty;                  /* changed since last compaction pass */
+    int dirty_s;                /* start of the range changed since then */
+    int dirty_e;                /* end of the range changed since then */
+    int compacting;             /* compaction pass in progress */
+    int compact_pos;            /* where the compaction pass continues */
+    int compact_end;            /* where the compaction pass ends */
+    int mem_used;               /* used bytes of the allocated memory */
+    int mem_size;               /* allocated memory of blocks and add buffers */
+    qw_pool headers;            /* pool of block headers (pieces, read-only) */
+    qw_pool blocks;             /* pool of blocks with inline data */
+    qw_pool buffers;            /* pool of data buffers of owned blocks */
+    qw_pool journals;           /* pool of journal entries */
+    qw_pool slots;              /* pool of small journal payloads */
+    int gen;                    /* last journal entry generation */
+    int clean_gen;              /* generation of the clean journal entry */
+    qw_payload *oldest;         /* oldest journal payload in memory */
+    qw_payload *newest;         /* newest journal payload in memory */
+    long undo_mem;              /* memory used by journal payloads */
+    FILE *undo_log;             /* on-disk log of spilled payloads */
+    qw_wal *wal;                /* write-ahead log of changes (NULL: none) */
+    qw_rows *rows;              /* cache of view rows (NULL: none) */
+    qw_lex *lex;                /* cache of lexer checkpoints (NULL: none) */
+    qw_cursor *cur;             /* cursor kept valid on changes (NULL: none) */
+};
+
+struct qw_wal {
+    int fd;                     /* log file (-1: not yet created) */
+    char *buf;                  /* records not yet written */
+    int used;                   /* used bytes in buf */
+    int size;                   /* allocated size of buf */
+    long stamp;                 /* time of the last sync (milliseconds) */
+};
+
+struct qw_addbuf {
+    qw_addbuf *prev;            /* previous (older) add buffer */
+    int used;                   /* number of used bytes */
+    int size;                   /* allocated size of data */
+    char data[];                /* data */
 };
 
+extern int qw_block_pieces;
+
 qw_block *qw_block_new(qw_block *prev, qw_block *next);
+qw_block *qw_block_new_base(char *base, int size, int mapped, int crlf);
 qw_block *qw_block_destroy(qw_block *b);
 qw_block *qw_block_insert_str(qw_block *b, int pos, const char *str, int size);
 qw_block *qw_block_insert_str_and_move(qw_block *b, int *pos, const char *str, int size);
@@ -36,6 +128,14 @@ qw_block *qw_block_here(qw_block *b, int pos, const char *str, int size);
 qw_block *qw_block_search(qw_block *b, int *pos, const char *str, int size, int inc);
 qw_block *qw_block_move_bol(qw_block *b, int *pos);
 qw_block *qw_block_move_eol(qw_block *b, int *pos);
+int qw_block_line(qw_block *b, int pos);
+qw_block *qw_block_line_to_rel(qw_block *b, int line, int *rpos);
+qw_block *qw_block_compact(qw_block *b, int steps);
+int qw_block_util(qw_block *b);
+uint64_t qw_block_hash_str(uint64_t h, const char *str, int size);
+uint64_t qw_block_hash(qw_block *b);
+char *qw_block_stash(qw_block *b, const char *str, int size);
+const char *qw_block_ptr(qw_block *b, int pos, int size);
 void qw_block_dump(qw_block *b, FILE *f);
 
 typedef struct qw_journal qw_journal;
@@ -46,16 +146,36 @@ struct qw_journal {
     int op;             /* operation: 0, delete; 1, insert */
     int apos;           /* absolute position */
     int size;           /* size of data */
-    int clean;          /* clean (saved to disk) at this point */
-    char data[];        /* data block */
+    int gen;            /* generation (unique in the chain) */
+    const char *data;   /* data (in the add buffers of the chain) */
+    qw_chain *chain;    /* chain this entry is allocated from */
+    long stamp;         /* creation time (milliseconds) */
+    qw_payload *own;    /* own data, kept apart (NULL: shared or spilled) */
+    int slot;           /* data is in a slot of the chain pool */
+    long spill;         /* offset in the undo log (-1: not spilled) */
+};
+
+struct qw_payload {
+    qw_payload *prev;   /* previous (older) payload */
+    qw_payload *next;   /* next (newer) payload */
+    qw_journal *j;      /* journal entry this belongs to */
+    char data[];        /* data */
 };
 
+extern long qw_journal_budget;
+
 qw_journal *qw_journal_first(qw_journal *j);
 qw_journal *qw_journal_destroy(qw_journal *j);
 qw_journal *qw_journal_new(int op, qw_block *b, int pos,
                             const char *str, int size, qw_journal *prev);
+qw_block *qw_journal_apply_at(qw_block *b, int rpos, qw_journal *j, int dir);
 qw_block *qw_journal_apply(qw_block *b, qw_journal *j, int dir);
+qw_journal *qw_journal_merge(qw_journal *j);
 void qw_journal_mark_clean(qw_journal *j);
+int qw_journal_is_clean(qw_journal *j);
+void qw_journal_release(qw_chain *c);
+int qw_journal_save(qw_journal *from, qw_journal *j, FILE *f);
+int qw_journal_load(qw_journal *j, const char *data, int size, int count, int length);
 
 qw_block *qw_utf8_move(qw_block *b, int *pos, int inc);
 int qw_unicode_width(uint32_t cpoint);
@@ -72,13 +192,38 @@ struct qw_view {
     int size;       /* content size in data and attr */
     char *data;     /* data */
     char *attr;     /* attributes */
+    int alloc;      /* allocated size of data and attr */
+};
+
+/* number of physical lines in the row cache */
+#define QW_ROWS_LINES 64
+
+typedef struct qw_rowline qw_rowline;
+
+struct qw_rowline {
+    int bol;        /* absolute position of the line (-1: unused) */
+    int n;          /* number of known rows */
+    int size;       /* allocated size of end */
+    int done;       /* all rows of the line are known */
+    int eol;        /* size of the line, if done */
+    int *end;       /* end of each row, relative to bol */
+    int stamp;      /* last use */
+};
+
+struct qw_rows {
+    int width;      /* width the rows were calculated for */
+    int clock;      /* use counter */
+    qw_rowline line[QW_ROWS_LINES];
 };
 
 int qw_view_row_size(qw_block *b, int pos, int width);
 int qw_view_get_col_0(qw_block *b, int apos, int width, int *size);
 int qw_view_width_diff(qw_block *b, int apos0, int apos1);
 int qw_view_set_col(qw_block *b, int ac0, int col, int width);
+int qw_view_move_rows(qw_block *b, int apos, int rows, int width);
 int qw_view_fix_vpos(qw_block *b, int vpos, int cpos, int wdth, int hght);
+void qw_view_changed(qw_chain *c, int apos, int size);
+void qw_view_release(qw_chain *c);
 
 typedef enum {
 #define X(attrid, attrname) attrid,
@@ -95,6 +240,7 @@ typedef struct qw_token qw_token;
 struct qw_token {
     const char *token;      /* token */
     qw_attr attr;           /* attribute */
+    int size;               /* length of token */
 };
 
 typedef struct qw_section qw_section;
@@ -104,6 +250,9 @@ struct qw_section {
     const char *end;        /* end of section */
     const char *escaped;    /* escaped mark (can be NULL) */
     qw_attr attr;           /* attribute */
+    int begin_size;         /* size of begin */
+    int end_size;           /* size of end */
+    int escaped_size;       /* size of escaped */
 };
 
 typedef struct qw_synhi qw_synhi;
@@ -119,7 +268,32 @@ struct qw_synhi {
     qw_token *tokens;           /* tokens */
     int n_sections;             /* number of sections */
     qw_section *sections;       /* sections */
-    int sorted;                 /* are tokens sorted? */
+    int sorted;                 /* are tokens sorted and the lexer built? */
+    int *hash;                  /* hash table of token indexes (-1: empty) */
+    int hash_size;              /* size of hash (a power of 2) */
+    int line_sections;          /* number of sections matched at line starts */
+    unsigned char lex[256];     /* lexer table of bytes starting delimiters */
+};
+
+typedef struct qw_lexstate qw_lexstate;
+
+struct qw_lexstate {
+    int from;       /* position where its next delimiter may start */
+    int inside;     /* is it looking for the end? */
+    int cov_s;      /* start of the range it attributes */
+    int cov_e;      /* end of the range it attributes */
+};
+
+struct qw_lex {
+    qw_synhi *sh;           /* synhi the checkpoints are for */
+    int n_sections;         /* number of sections in each state */
+    int count;              /* number of checkpoints */
+    int valid;              /* number of checkpoints known to be right */
+    int alloc;              /* number of allocated checkpoints */
+    int *apos;              /* absolute positions of the checkpoints */
+    qw_lexstate *state;     /* states of the sections at the checkpoints */
+    char *data;             /* buffer for the lexed data */
+    char *attr;             /* buffer for its attributes */
 };
 
 qw_synhi *qw_synhi_find_by_name(const char *name, qw_synhi *list);
@@ -134,7 +308,22 @@ void qw_synhi_add_section(qw_synhi *sh, const char *begin,
 void qw_synhi_add_signature(qw_synhi *sh, const char *signature);
 void qw_synhi_optimize(qw_synhi *sh);
 qw_attr qw_synhi_find_token(qw_synhi *sh, const char *token);
+qw_attr qw_synhi_find_token_n(qw_synhi *sh, const char *token, int size);
 void qw_synhi_apply_to_view(qw_view *view, qw_synhi *sh);
+void qw_synhi_apply_passes(qw_view *view, qw_synhi *sh);
+int qw_synhi_apply_at(qw_view *view, qw_synhi *sh, qw_block *b, int vpos);
+int qw_synhi_lex_ahead(qw_synhi *sh, qw_block *b, int size);
+int qw_synhi_ready(qw_synhi *sh, qw_block *b, int apos);
+void qw_synhi_changed(qw_chain *c, int apos, int size);
+void qw_synhi_release(qw_chain *c);
+
+struct qw_cursor {
+    qw_block *b;        /* block (NULL: to be taken again) */
+    int i;              /* relative position in b */
+    int apos;           /* absolute position */
+    int line;           /* line of apos (-1: not known yet) */
+    int col;            /* column of apos */
+};
 
 typedef struct qw_doc qw_doc;
 
@@ -151,11 +340,33 @@ struct qw_doc {
     qw_block *b;        /* block of chains */
     qw_journal *j;      /* journal */
     qw_synhi *sh;       /* syntax highlight definition */
+    double save_bps;    /* throughput of last save (bytes/s) */
+    int util_before;    /* memory utilisation before last compaction (%) */
+    int util_after;     /* memory utilisation after last compaction (%) */
+    char *undo;         /* undo history of the previous session (sidecar) */
+    int undo_size;      /* size of the undo history */
+    int undo_mapped;    /* undo history is memory-mapped */
+    int undo_loaded;    /* undo history is loaded into the journal */
+    int undo_gen;       /* journal entry the sidecar was written up to (0: none) */
+    qw_wal wal;         /* write-ahead log of unsaved changes */
+    int recover;        /* changes left by a crash can be recovered */
+    qw_cursor cur;      /* block and relative position of cpos */
+    int lex_pending;    /* view painted before its sections were known */
 };
 
+extern int qw_doc_undo_file;
+
 qw_block *qw_file_load(const char *fname, int *crlf);
 int qw_file_save(qw_block *b, const char *fname, int crlf);
 qw_doc *qw_doc_new(qw_doc *d, const char *fname);
+int qw_doc_save(qw_doc *doc);
+int qw_doc_compact(qw_doc *doc, int steps);
+int qw_doc_lex(qw_doc *doc, int size);
+int qw_doc_history(qw_doc *doc);
+int qw_doc_sync(qw_doc *doc);
+int qw_doc_recover(qw_doc *doc, int replay);
+qw_block *qw_doc_cursor(qw_doc *doc, int *i);
+void qw_doc_set_cursor(qw_doc *doc, qw_block *b, int i, int apos);
 qw_doc *qw_doc_destroy(qw_doc *doc);
 void qw_doc_dump(qw_doc *d, FILE *f);
 
@@ -194,11 +405,14 @@ struct qw_core {
     qw_op keymap[QW_KEY_COUNT]; /* the keymap */
     qw_view view;               /* view */
     void *drv_data;             /* opaque pointer to drv internal data */
+    int frame_bytes;            /* bytes sent to paint the last frame */
+    int view_allocs;            /* allocations of the view buffers */
 };
 
 qw_core *qw_core_new(void);
 void qw_core_create_view(qw_core *core, int *cursor_x, int *cursor_y);
 void qw_core_key(qw_core *core, qw_key key);
+int qw_core_idle(qw_core *core);
 void qw_core_dump(qw_core *core, FILE *f);
 char *qw_core_status_line(qw_core *core, char *buf, int max_size);
 void qw_core_doc_new(qw_core *core, const char *fname);
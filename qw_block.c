@@ -1,80 +1,798 @@
 /* qw - A minimalistic text editor by grunfink - public domain */
 
-#include "qw.h"
+#include "config.h"
+
+#if defined(CONFOPT_MEMRCHR) || defined(CONFOPT_MEMMEM)
+#define _GNU_SOURCE
+#endif
 
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef CONFOPT_MMAP
+#include <sys/mman.h>
+#endif
+
+#include "qw.h"
+
+/* size of each add buffer of the piece table engine */
+#define QW_ADDBUF_SIZE (QW_BLOCK_SIZE * 16)
+
+/* maximum size of a piece (except for big insertions) */
+#define QW_PIECE_SIZE (QW_BLOCK_SIZE * 16)
+
+/* default buffer engine for new chains */
+#ifdef CONFOPT_PIECE_TABLE
+int qw_block_pieces = 1;
+#else
+int qw_block_pieces = 0;
+#endif
+
+
+/** index tree **/
+
+/* The blocks in a chain are also the nodes of a treap (a binary search
+   tree ordered by chain position and heap-ordered by a random priority)
+   that keeps the sum of used bytes of every subtree. This allows
+   converting between absolute and relative positions in O(log n).
+   The newlines of each block and subtree are also kept, but lazily:
+   they are marked as unknown (-1) on changes and counted on demand,
+   so loading a file doesn't read it. */
+
+static int tree_total(qw_block *t)
+/* returns the total used bytes of a subtree */
+{
+    return t ? t->total : 0;
+}
+
+
+static int tree_tlines(qw_block *t)
+/* returns the newlines of a subtree, if known */
+{
+    return t ? t->tlines : 0;
+}
+
+
+static void tree_fix(qw_block *t)
+/* recalculates the totals of a node from its children */
+{
+    t->total = tree_total(t->left) + t->used + tree_total(t->right);
+
+    if (t->lines < 0 || tree_tlines(t->left) < 0 || tree_tlines(t->right) < 0)
+        t->tlines = -1;
+    else
+        t->tlines = tree_tlines(t->left) + t->lines + tree_tlines(t->right);
+}
+
+
+static void tree_fix_up(qw_block *t)
+/* recalculates the totals from a node up to the root */
+{
+    for (; t != NULL; t = t->up)
+        tree_fix(t);
+}
+
+
+static void tree_rotate_up(qw_block *x)
+/* rotates a node over its parent */
+{
+    qw_block *p = x->up;
+
+    if (x == p->left) {
+        p->left = x->right;
+
+        if (p->left)
+            p->left->up = p;
+
+        x->right = p;
+    }
+    else {
+        p->right = x->left;
+
+        if (p->right)
+            p->right->up = p;
+
+        x->left = p;
+    }
+
+    /* x takes the place of p */
+    x->up = p->up;
+    p->up = x;
+
+    if (x->up == NULL)
+        x->chain->root = x;
+    else
+    if (x->up->left == p)
+        x->up->left = x;
+    else
+        x->up->right = x;
+
+    tree_fix(p);
+    tree_fix(x);
+}
+
+
+static void tree_insert(qw_block *b)
+/* inserts a newly linked block into the index tree */
+{
+    qw_block *t;
+
+    if (b->prev != NULL) {
+        /* hang it as the in-order successor of prev */
+        if ((t = b->prev)->right != NULL) {
+            for (t = t->right; t->left; t = t->left);
+            t->left = b;
+        }
+        else
+            t->right = b;
+    }
+    else
+    if (b->next != NULL) {
+        /* hang it as the in-order predecessor of next */
+        if ((t = b->next)->left != NULL) {
+            for (t = t->left; t->right; t = t->right);
+            t->right = b;
+        }
+        else
+            t->left = b;
+    }
+    else
+        t = NULL;
+
+    b->up = t;
+
+    if (t == NULL)
+        b->chain->root = b;
+
+    tree_fix_up(b);
+
+    /* restore the heap property */
+    while (b->up && b->up->prio < b->prio)
+        tree_rotate_up(b);
+}
+
+
+static void tree_remove(qw_block *b)
+/* removes a block from the index tree */
+{
+    /* rotate it down until it's a leaf */
+    while (b->left || b->right) {
+        if (b->right == NULL || (b->left && b->left->prio > b->right->prio))
+            tree_rotate_up(b->left);
+        else
+            tree_rotate_up(b->right);
+    }
+
+    if (b->up == NULL)
+        b->chain->root = NULL;
+    else {
+        if (b->up->left == b)
+            b->up->left = NULL;
+        else
+            b->up->right = NULL;
+
+        tree_fix_up(b->up);
+    }
+
+    b->up = NULL;
+}
+
+
+static int count_nl(const char *data, int size)
+/* counts the newlines in a string */
+{
+    const char *p = data;
+    const char *e = data + size;
+    int n = 0;
+
+    while (p < e && (p = memchr(p, '\n', e - p)) != NULL) {
+        p++;
+        n++;
+    }
+
+    return n;
+}
+
+
+static int block_lines(qw_block *b)
+/* returns the newlines of a block, counting them if unknown */
+{
+    if (b->lines < 0)
+        b->lines = count_nl(b->data, b->raw ? b->raw : b->used);
+
+    return b->lines;
+}
+
+
+static int tree_lines(qw_block *t)
+/* returns the newlines of a subtree, counting them where unknown */
+{
+    if (t == NULL)
+        return 0;
+
+    if (t->tlines < 0)
+        t->tlines = tree_lines(t->left) + block_lines(t) + tree_lines(t->right);
+
+    return t->tlines;
+}
+
+
+static void block_changed(qw_block *b)
+/* updates the index after a change in the data of a block */
+{
+    /* the total still has the previous size */
+    if (b->size)
+        b->chain->mem_used += b->used - (b->total - tree_total(b->left) - tree_total(b->right));
+
+    b->lines = -1;
+    tree_fix_up(b);
+}
+
 
 /** code **/
 
-qw_block *qw_block_new(qw_block *prev, qw_block *next)
-/* allocate a new block or resize one */
+static qw_chain *chain_get(qw_block *prev, qw_block *next)
+/* returns the chain of the neighbours, or a new one */
 {
-    qw_block *b = malloc(sizeof(qw_block));
+    qw_chain *c;
+
+    if (prev != NULL)
+        c = prev->chain;
+    else
+    if (next != NULL)
+        c = next->chain;
+    else {
+        c = calloc(1, sizeof(qw_chain));
+        c->pieces = qw_block_pieces;
+
+        /* everything in the chain is allocated from its pools */
+        qw_pool_init(&c->headers, sizeof(qw_block), 256);
+        qw_pool_init(&c->blocks, sizeof(qw_block) + QW_BLOCK_SIZE, 16);
+        qw_pool_init(&c->buffers, QW_BLOCK_SIZE, 16);
+        qw_pool_init(&c->journals, sizeof(qw_journal), 256);
+        qw_pool_init(&c->slots, QW_JOURNAL_SLOT, 64);
+    }
+
+    return c;
+}
 
+
+static qw_block *block_link(qw_block *b, qw_block *prev, qw_block *next)
+/* links a block into its chain */
+{
     b->prev = prev;
     b->next = next;
-    b->used = 0;
 
     if (b->prev)
         b->prev->next = b;
     if (b->next)
         b->next->prev = b;
 
-    return b;
-}
+    if (b->prev == NULL)
+        b->chain->first = b;
+    if (b->next == NULL)
+        b->chain->last = b;
+
+    /* xorshift the priority */
+    b->chain->seed ^= b->chain->seed << 13;
+    b->chain->seed ^= b->chain->seed >> 17;
+    b->chain->seed ^= b->chain->seed << 5;
+
+    if (b->chain->seed == 0)
+        b->chain->seed = 0x9e3779b9;
+
+    b->prio  = b->chain->seed;
+    b->left  = b->right = NULL;
+    b->total = b->used;
+    b->lines = -1;
+
+    if (b->size) {
+        b->chain->mem_used += b->used;
+        b->chain->mem_size += b->size;
+    }
+
+    tree_insert(b);
+
+    return b;
+}
+
+
+static int strip_crlf(char *dst, const char *src, int size)
+/* copies a string dropping the CR of each CR/LF pair (dst can be src).
+   Returns the new size */
+{
+    int n, i;
+
+    for (n = i = 0; n < size; n++) {
+        if (src[n] != '\r' || n + 1 == size || src[n + 1] != '\n')
+            dst[i++] = src[n];
+    }
+
+    return i;
+}
+
+
+static void block_strip(qw_block *b)
+/* drops the CRs of a block still pointing to CR/LF data */
+{
+    if (b != NULL && b->raw) {
+        qw_chain *c = b->chain;
+        char *data;
+
+        if (c->pieces)
+            data = qw_block_stash(b, NULL, b->used);
+        else {
+            data = qw_pool_alloc(&c->buffers);
+
+            b->size = QW_BLOCK_SIZE;
+            c->mem_used += b->used;
+            c->mem_size += b->size;
+        }
+
+        strip_crlf(data, b->data, b->raw);
+
+        b->data = data;
+        b->raw  = 0;
+    }
+}
+
+
+/* In the piece table engine, blocks are pieces: read-only references
+   to either the base data or the append-only add buffers of the chain.
+   These are never modified, so inserting or deleting only creates,
+   splits or trims pieces, and the journal can point to the same data
+   instead of keeping copies. */
+
+static qw_block *piece_new(qw_chain *c, qw_block *prev, qw_block *next,
+                            const char *data, int used)
+/* creates a new piece */
+{
+    qw_block *b = qw_pool_alloc(&c->headers);
+
+    b->chain = c;
+    b->used  = used;
+    b->size  = 0;
+    b->raw   = 0;
+    b->data  = (char *)data;
+
+    return block_link(b, prev, next);
+}
+
+
+static int piece_holds(qw_chain *c, const char *str, int size)
+/* tests if a string is inside the immutable data of a chain */
+{
+    qw_addbuf *a;
+
+    if (c->base && str >= c->base && str + size <= c->base + c->base_size)
+        return 1;
+
+    for (a = c->add; a; a = a->prev) {
+        if (str >= a->data && str + size <= a->data + a->used)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+char *qw_block_stash(qw_block *b, const char *str, int size)
+/* stores a string in the add buffers of the chain, if not already
+   there in a piece chain. If str is NULL, just reserves the space.
+   Returns its permanent address */
+{
+    qw_chain *c = b->chain;
+    qw_addbuf *a = c->add;
+    char *p;
+
+    if (str != NULL && c->pieces && piece_holds(c, str, size))
+        return (char *)str;
+
+    if (a == NULL || a->size - a->used < size) {
+        /* start a new add buffer */
+        int z = size > QW_ADDBUF_SIZE ? size : QW_ADDBUF_SIZE;
+
+        a = malloc(sizeof(qw_addbuf) + z);
+        a->prev = c->add;
+        a->used = 0;
+        a->size = z;
+
+        c->add = a;
+
+        if (c->pieces)
+            c->mem_size += z;
+    }
+
+    p = &a->data[a->used];
+    a->used += size;
+
+    if (c->pieces)
+        c->mem_used += size;
+
+    if (str != NULL)
+        memcpy(p, str, size);
+
+    return p;
+}
+
+
+const char *qw_block_ptr(qw_block *b, int pos, int size)
+/* returns the permanent address of a range of a piece chain if it's
+   contiguous, or NULL otherwise */
+{
+    if (b == NULL || !b->chain->pieces)
+        return NULL;
+
+    /* at the end of a piece, the range starts in the next one */
+    while (pos == b->used && b->next) {
+        b   = b->next;
+        pos = 0;
+    }
+
+    block_strip(b);
+
+    return pos + size <= b->used ? &b->data[pos] : NULL;
+}
+
+
+static qw_block *piece_insert(qw_block *b, int pos, const char *str, int size)
+/* inserts a string into pos of a piece chain */
+{
+    str = qw_block_stash(b, str, size);
+
+    if (b->used == 0) {
+        /* empty piece: just point it to the string */
+        b->data = (char *)str;
+        b->used = size;
+        block_changed(b);
+    }
+    else
+    if (pos == b->used && &b->data[b->used] == str && b->used + size <= QW_PIECE_SIZE) {
+        /* the string follows this piece (i.e. typing); extend it */
+        b->used += size;
+        block_changed(b);
+    }
+    else
+    if (pos == 0) {
+        /* new piece before this one */
+        b = piece_new(b->chain, b->prev, b, str, size);
+    }
+    else {
+        if (pos < b->used) {
+            /* split this piece in two */
+            piece_new(b->chain, b, b->next, &b->data[pos], b->used - pos);
+
+            b->used = pos;
+            block_changed(b);
+        }
+
+        /* new piece after this one */
+        piece_new(b->chain, b, b->next, str, size);
+    }
+
+    return b;
+}
+
+
+static void piece_delete(qw_block *b, int pos, int size)
+/* deletes size chars from a piece chain */
+{
+    while (b != NULL && size > 0) {
+        int rmndr = b->used - pos;
+
+        block_strip(b);
+
+        if (rmndr > size) {
+            if (pos == 0) {
+                /* trim the beginning of the piece */
+                b->data += size;
+                b->used -= size;
+            }
+            else {
+                /* split, leaving the deleted part out */
+                piece_new(b->chain, b, b->next, &b->data[pos + size], rmndr - size);
+                b->used = pos;
+            }
+
+            block_changed(b);
+            size = 0;
+        }
+        else {
+            /* trim the end and continue in the next piece */
+            b->used = pos;
+            block_changed(b);
+
+            size -= rmndr;
+            b = b->next;
+            pos = 0;
+        }
+    }
+}
+
+
+qw_block *qw_block_new(qw_block *prev, qw_block *next)
+/* allocate a new block or resize one */
+{
+    qw_chain *c = chain_get(prev, next);
+    qw_block *b;
+
+    /* an empty piece for piece chains */
+    if (c->pieces)
+        return piece_new(c, prev, next, NULL, 0);
+
+    /* the data goes just after the header */
+    b = qw_pool_alloc(&c->blocks);
+
+    b->chain = c;
+    b->used = 0;
+    b->size = QW_BLOCK_SIZE;
+    b->raw  = 0;
+    b->data = (char *)(b + 1);
+
+    return block_link(b, prev, next);
+}
+
+
+qw_block *qw_block_new_base(char *base, int size, int mapped, int crlf)
+/* creates a chain of read-only blocks over the content of a file. If crlf
+   is set, the CRs of the CR/LF pairs are dropped: in place if the data is
+   not mapped, or else when each block is first touched */
+{
+    qw_block *b = NULL;
+    int n = 0;
+
+    /* pieces can be bigger than blocks */
+    int z = qw_block_pieces ? QW_PIECE_SIZE : QW_BLOCK_SIZE;
+
+    if (crlf && !mapped) {
+        size = strip_crlf(base, base, size);
+        crlf = 0;
+    }
+
+    do {
+        qw_chain *c = chain_get(b, NULL);
+        qw_block *nb = qw_pool_alloc(&c->headers);
+        int r = size - n < z ? size - n : z;
+
+        /* point into the base data; nothing is copied */
+        nb->chain = c;
+        nb->used = r;
+        nb->size = 0;
+        nb->raw  = 0;
+        nb->data = base + n;
+
+        if (crlf) {
+            const char *p = nb->data;
+            const char *e;
+
+            /* don't split a CR/LF pair */
+            if (n + r < size && p[r - 1] == '\r' && p[r] == '\n')
+                r++;
+
+            /* the size is what's left without the CRs */
+            e = p + r;
+            nb->used = r;
+
+            while (p < e && (p = memchr(p, '\r', e - p)) != NULL) {
+                if (++p < e && *p == '\n')
+                    nb->used--;
+            }
+
+            if (nb->used != r)
+                nb->raw = r;
+        }
+
+        b = block_link(nb, b, NULL);
+        n += r;
+    } while (n < size);
+
+    /* the chain will release the base data when destroyed */
+    b->chain->base      = base;
+    b->chain->base_size = size;
+    b->chain->mapped    = mapped;
+
+    return b->chain->first;
+}
+
+
+static void block_own(qw_block *b)
+/* makes a read-only block writable by copying its data */
+{
+    block_strip(b);
+
+    if (b->size == 0) {
+        char *data = qw_pool_alloc(&b->chain->buffers);
+
+        memcpy(data, b->data, b->used);
+
+        b->data = data;
+        b->size = QW_BLOCK_SIZE;
+
+        b->chain->mem_used += b->used;
+        b->chain->mem_size += b->size;
+    }
+}
+
+
+static void block_free(qw_block *b)
+/* returns a block and its data to the pools of the chain */
+{
+    qw_chain *c = b->chain;
+
+    c->mem_used -= b->size ? b->used : 0;
+    c->mem_size -= b->size;
+
+    if (b->data == (char *)(b + 1))
+        qw_pool_free(&c->blocks, b);
+    else {
+        if (b->size)
+            qw_pool_free(&c->buffers, b->data);
+
+        qw_pool_free(&c->headers, b);
+    }
+}
+
+
+qw_block *qw_block_destroy(qw_block *b)
+/* destroy this block and all the chain after it */
+{
+    if (b != NULL) {
+        qw_chain *chain = b->chain;
+        int all = (b == chain->first);
+
+        if (!all) {
+            /* truncate the chain before this block */
+            qw_view_release(chain);
+            qw_synhi_release(chain);
+
+            if (chain->cur)
+                chain->cur->b = NULL;
+
+            b->prev->next = NULL;
+            chain->last   = b->prev;
+
+            while (b != NULL) {
+                qw_block *next = b->next;
+
+                tree_remove(b);
+                block_free(b);
+                b = next;
+            }
+        }
+        else {
+            /* the full chain goes away: release the pools at once
+               (this includes the journal entries of the chain) */
+            qw_pool_release(&chain->headers);
+            qw_pool_release(&chain->blocks);
+            qw_pool_release(&chain->buffers);
+            qw_pool_release(&chain->journals);
+            qw_pool_release(&chain->slots);
+            qw_journal_release(chain);
+            qw_view_release(chain);
+            qw_synhi_release(chain);
+
+            if (chain->mapped) {
+#ifdef CONFOPT_MMAP
+                munmap(chain->base, chain->base_size);
+#endif
+            }
+            else
+                free(chain->base);
+
+            while (chain->add) {
+                qw_addbuf *prev = chain->add->prev;
+
+                free(chain->add);
+                chain->add = prev;
+            }
+
+            free(chain);
+        }
+    }
+
+    return NULL;
+}
+
+
+static void chain_dirty(qw_chain *c, int apos, int size)
+/* extends the range to be compacted with a change of size bytes
+   at apos (negative, if deleted) */
+{
+    int e = apos + (size > 0 ? size : 0);
+
+    if (!c->dirty) {
+        c->dirty   = 1;
+        c->dirty_s = apos;
+        c->dirty_e = e;
+    }
+    else {
+        /* the end moves along with what is after the change */
+        if (apos <= c->dirty_e)
+            c->dirty_e += size;
+
+        if (c->dirty_s > apos)
+            c->dirty_s = apos;
+
+        if (c->dirty_e < e)
+            c->dirty_e = e;
+    }
+}
+
+
+static void chain_moved(qw_chain *c, int apos)
+/* forgets the block of the cursor if a change at apos can move it;
+   changes after it leave its block and position valid */
+{
+    if (c->cur && apos <= c->cur->apos)
+        c->cur->b = NULL;
+}
+
+
+qw_block *qw_block_insert_str(qw_block *b, int pos, const char *str, int size)
+/* inserts a string into pos, updating the chain */
+{
+    qw_block *r;
+    int apos = qw_block_rel_to_abs(b, pos);
+
+    block_strip(b);
+    chain_dirty(b->chain, apos, size);
+    chain_moved(b->chain, apos);
+
+    if (b->chain->rows && size > 0)
+        qw_view_changed(b->chain, apos, size);
+
+    if (b->chain->lex && size > 0)
+        qw_synhi_changed(b->chain, apos, size);
+
+    if (b->chain->pieces)
+        return size > 0 ? piece_insert(b, pos, str, size) : b;
+
+    if (pos != b->used) {
+        if (pos == 0) {
+            /* insert into a new block before this one */
+            b = qw_block_new(b->prev, b);
+        }
+        else {
+            /* insert position in between: store
+               the second half in a new block */
+            qw_block *t = qw_block_new(b, b->next);
+
+            block_own(b);
 
+            t->used = b->used - pos;
+            memcpy(t->data, &b->data[pos], t->used);
+            block_changed(t);
 
-qw_block *qw_block_destroy(qw_block *b)
-/* destroy this block and all the chain after it */
-{
-    if (b != NULL) {
-        qw_block_destroy(b->next);
-        free(b);
+            /* truncate size */
+            b->used = pos;
+            block_changed(b);
+        }
     }
 
-    return NULL;
-}
+    /* insert position is now at the end of the block */
+    for (r = b;; r = qw_block_new(r, r->next)) {
+        int free;
 
-
-qw_block *qw_block_insert_str(qw_block *b, int pos, const char *str, int size)
-/* inserts a string into pos, updating the chain */
-{
-    /* insert position at the end of the block? */
-    if (pos == b->used) {
-        int free = QW_BLOCK_SIZE - b->used;
+        block_own(r);
+        free = r->size - r->used;
 
         /* does it fit? */
         if (size < free) {
             /* just copy and account it */
-            memcpy(&b->data[b->used], str, size);
-            b->used += size;
-        }
-        else {
-            /* copy what fits */
-            memcpy(&b->data[b->used], str, free);
-            b->used += free;
+            memcpy(&r->data[r->used], str, size);
+            r->used += size;
+            block_changed(r);
 
-            /* create a new block and keep inserting there */
-            qw_block_insert_str(qw_block_new(b, b->next), 0, str + free, size - free);
+            break;
         }
-    }
-    else
-    /* insert position at the beginning of the block? */
-    if (pos == 0) {
-        /* insert into a new block before this one */
-        b = qw_block_insert_str(qw_block_new(b->prev, b), 0, str, size);
-    }
-    else {
-        /* insert position in between */
 
-        /* create a new block and store there the second half */
-        qw_block_insert_str(qw_block_new(b, b->next), 0, &b->data[pos], b->used - pos);
+        /* copy what fits and keep inserting in a new block */
+        memcpy(&r->data[r->used], str, free);
+        r->used += free;
+        block_changed(r);
 
-        /* truncate size and retry */
-        b->used = pos;
-        qw_block_insert_str(b, pos, str, size);
+        str  += free;
+        size -= free;
     }
 
     return b;
@@ -84,22 +802,48 @@ qw_block *qw_block_insert_str(qw_block *b, int pos, const char *str, int size)
 void qw_block_delete(qw_block *b, int pos, int size)
 /* delete size chars */
 {
-    if (b != NULL && size > 0) {
-        int rmndr = b->used - pos;
+    if (b != NULL) {
+        int apos = qw_block_rel_to_abs(b, pos);
 
-        if (rmndr > size) {
-            /* collapse data */
-            memcpy(&b->data[pos], &b->data[pos + size], rmndr - size);
+        chain_dirty(b->chain, apos, -size);
+        chain_moved(b->chain, apos);
 
-            /* truncate used size */
-            b->used = pos + rmndr - size;
-        }
-        else {
-            /* truncate used size */
-            b->used = pos;
+        if (b->chain->rows && size > 0)
+            qw_view_changed(b->chain, apos, -size);
+
+        if (b->chain->lex && size > 0)
+            qw_synhi_changed(b->chain, apos, -size);
+    }
 
-            /* delete the rest in the next block */
-            qw_block_delete(b->next, 0, size - rmndr);
+    if (b != NULL && b->chain->pieces)
+        piece_delete(b, pos, size);
+    else {
+        while (b != NULL && size > 0) {
+            int rmndr = b->used - pos;
+
+            block_strip(b);
+
+            if (rmndr > size) {
+                /* collapse data */
+                block_own(b);
+                memmove(&b->data[pos], &b->data[pos + size], rmndr - size);
+
+                /* truncate used size */
+                b->used = pos + rmndr - size;
+                block_changed(b);
+
+                size = 0;
+            }
+            else {
+                /* truncate used size */
+                b->used = pos;
+                block_changed(b);
+
+                /* delete the rest in the next block */
+                size -= rmndr;
+                b = b->next;
+                pos = 0;
+            }
         }
     }
 }
@@ -108,14 +852,20 @@ void qw_block_delete(qw_block *b, int pos, int size)
 qw_block *qw_block_first(qw_block *b)
 /* returns the first in the block chain */
 {
-    return b && b->prev ? qw_block_first(b->prev) : b;
+    if (b != NULL)
+        block_strip(b = b->chain->first);
+
+    return b;
 }
 
 
 qw_block *qw_block_last(qw_block *b)
 /* returns the last in the block chain */
 {
-    return b && b->next ? qw_block_last(b->next) : b;
+    if (b != NULL)
+        block_strip(b = b->chain->last);
+
+    return b;
 }
 
 
@@ -124,17 +874,21 @@ int qw_block_get_str(qw_block *b, int pos, char *buf, int size)
 {
     int r = 0;
 
-    if (b != NULL && size) {
-        r = b->used - pos;
+    while (b != NULL && r < size) {
+        int z = b->used - pos;
+
+        block_strip(b);
 
         /* do not copy more than there is */
-        if (r > size)
-            r = size;
+        if (z > size - r)
+            z = size - r;
 
-        memcpy(buf, &b->data[pos], r);
+        memcpy(buf + r, &b->data[pos], z);
+        r += z;
 
         /* continue copying from the next block */
-        r += qw_block_get_str(b->next, 0, buf + r, size - r);
+        b = b->next;
+        pos = 0;
     }
 
     return r;
@@ -145,26 +899,28 @@ qw_block *qw_block_move(qw_block *b, int pos, int *npos, int inc)
 /* moves from pos an inc number of bytes, returns new block and new position */
 {
     if (b != NULL) {
-        int r = (pos == -1 ? b->used : pos) + inc;
+        int r = pos + inc;
 
-        /* is it inside this block? */
-        if (r >= 0 && r < b->used) {
-            /* return position */
+        /* is it inside this block? (or at EOF) */
+        if (r >= 0 && (r < b->used || (r == b->used && b->next == NULL)))
             *npos = r;
-        }
         else
-        if (inc < 0) {
-            /* move back */
-            b = qw_block_move(b->prev, -1, npos, r);
+        /* is it inside the previous one? */
+        if (r < 0 && b->prev && r + b->prev->used >= 0) {
+            b = b->prev;
+            *npos = r + b->used;
         }
-        else {
-            /* at EOF? allow being outside the block */
-            if (b->next == NULL && r == b->used)
-                *npos = r;
-            else
-            /* move next */
-            b = qw_block_move(b->next, 0, npos, r - b->used);
+        else
+        /* is it inside the next one? */
+        if (r >= b->used && b->next && r - b->used < b->next->used) {
+            *npos = r - b->used;
+            b = b->next;
         }
+        else
+            /* far away: go through the index */
+            b = qw_block_abs_to_rel(b, qw_block_rel_to_abs(b, pos) + inc, npos);
+
+        block_strip(b);
     }
 
     return b;
@@ -174,14 +930,57 @@ qw_block *qw_block_move(qw_block *b, int pos, int *npos, int inc)
 int qw_block_rel_to_abs(qw_block *b, int rpos)
 /* returns the absolute position from a relative one */
 {
-    return b && b->prev ? rpos + qw_block_rel_to_abs(b->prev, b->prev->used) : rpos;
+    if (b != NULL) {
+        qw_block *t;
+
+        rpos += tree_total(b->left);
+
+        /* add everything on the left of the path to the root */
+        for (t = b; t->up; t = t->up) {
+            if (t == t->up->right)
+                rpos += tree_total(t->up->left) + t->up->used;
+        }
+    }
+
+    return rpos;
 }
 
 
 qw_block *qw_block_abs_to_rel(qw_block *b, int apos, int *rpos)
 /* moves from an absolute position to a relative one */
 {
-    return qw_block_move(qw_block_first(b), 0, rpos, apos);
+    qw_block *t = NULL;
+
+    if (b != NULL && apos >= 0 && apos <= b->chain->root->total) {
+        if (apos == b->chain->root->total) {
+            /* EOF */
+            t = b->chain->last;
+            apos = t->used;
+        }
+        else {
+            /* descend the index tree */
+            t = b->chain->root;
+
+            for (;;) {
+                if (apos < tree_total(t->left))
+                    t = t->left;
+                else {
+                    apos -= tree_total(t->left);
+
+                    if (apos < t->used)
+                        break;
+
+                    apos -= t->used;
+                    t = t->right;
+                }
+            }
+        }
+
+        *rpos = apos;
+        block_strip(t);
+    }
+
+    return t;
 }
 
 
@@ -190,57 +989,265 @@ qw_block *qw_block_here(qw_block *b, int pos, const char *str, int size)
 {
     qw_block *r = NULL;
 
-    if (b != NULL) {
+    while (b != NULL) {
         int n = b->used - pos;
 
+        block_strip(b);
+
         if (size <= n) {
             /* all the string fits in this block, compare directly */
             if (memcmp(&b->data[pos], str, size) == 0)
                 r = b;
+
+            break;
         }
-        else {
-            /* compare the bytes available and if found try next block */
-            if (memcmp(&b->data[pos], str, n) == 0)
-                r = qw_block_here(b->next, 0, str + n, size - n);
-        }
+
+        /* compare the bytes available and if found try next block */
+        if (memcmp(&b->data[pos], str, n) != 0)
+            break;
+
+        str  += n;
+        size -= n;
+        b = b->next;
+        pos = 0;
     }
 
     return r;
 }
 
 
-qw_block *qw_block_search(qw_block *b, int *pos, const char *str, int size, int inc)
-/* search for a string in the chain of blocks */
+/* Strings are searched inside the data of each block with memmem() if
+   available, or else memchr() for short ones and Boyer-Moore-Horspool
+   for the rest (the same backwards); only the few
+   positions near the end of a block, where a match could continue in
+   the next ones, are tested with qw_block_here(). */
+
+#define QW_SEARCH_HORSPOOL 4
+
+static int search_fwd(const char *data, int from, int to,
+                      const char *str, int size, const int *skip)
+/* searches forward a string starting between from and to (inclusive) */
 {
-    qw_block *r = NULL;
+    const char *p;
 
-    while (b != NULL && (r = qw_block_here(b, *pos, str, size)) == NULL)
-        b = qw_block_move(b, *pos, pos, inc);
+#ifdef CONFOPT_MEMMEM
+    /* the system one is usually the fastest */
+    p = memmem(&data[from], to - from + size, str, size);
+    return p ? p - data : -1;
+#else
+    if (skip == NULL) {
+        while (from <= to && (p = memchr(&data[from], str[0], to - from + 1)) != NULL) {
+            from = p - data;
 
-    return r;
+            if (memcmp(p + 1, str + 1, size - 1) == 0)
+                return from;
+
+            from++;
+        }
+    }
+    else {
+        while (from <= to) {
+            unsigned char c = data[from + size - 1];
+
+            if (c == (unsigned char) str[size - 1]) {
+                if (memcmp(&data[from], str, size - 1) == 0)
+                    return from;
+
+                from += skip[c];
+            }
+            else
+            if (skip[c] == size) {
+                /* not in the string: jump to the next possible last char */
+                if ((p = memchr(&data[from + size], str[size - 1], to - from)) == NULL)
+                    break;
+
+                from = p - data - (size - 1);
+            }
+            else
+                from += skip[c];
+        }
+    }
+
+    return -1;
+#endif
 }
 
 
-qw_block *qw_block_move_bol(qw_block *b, int *pos)
-/* move to the beginning of the line */
+static int search_bwd(const char *data, int from, int to,
+                      const char *str, int size, const int *skip)
+/* searches backwards a string starting between from and to (inclusive) */
 {
-    qw_block *r = b;
+#ifdef CONFOPT_MEMRCHR
+    const char *p;
 
-    /* if it's over an end of line, move backwards */
-    if (r->data[*pos] == '\n')
-        r = qw_block_move(r, *pos, pos, -1);
+    if (skip == NULL) {
+        while (from >= to && (p = memrchr(&data[to], str[0], from - to + 1)) != NULL) {
+            from = p - data;
 
-    if ((r = qw_block_search(r, pos, "\n", 1, -1)) != NULL) {
-        /* found; move 1 char forward */
-        r = qw_block_move(r, *pos, pos, 1);
+            if (memcmp(p + 1, str + 1, size - 1) == 0)
+                return from;
+
+            from--;
+        }
+    }
+#else
+    if (skip == NULL) {
+        for (; from >= to; from--) {
+            if (data[from] == str[0] && memcmp(&data[from + 1], str + 1, size - 1) == 0)
+                return from;
+        }
     }
+#endif
     else {
-        /* not found; move to BOF */
-        r = qw_block_first(b);
-        *pos = 0;
+        while (from >= to) {
+            unsigned char c = data[from];
+
+            if (c == (unsigned char) str[0]) {
+                if (memcmp(&data[from + 1], str + 1, size - 1) == 0)
+                    return from;
+
+                from -= skip[c];
+            }
+#ifdef CONFOPT_MEMRCHR
+            else
+            if (skip[c] == size) {
+                /* not in the string: jump to the previous possible first char */
+                if ((p = memrchr(&data[to], str[0], from - to)) == NULL)
+                    break;
+
+                from = p - data;
+            }
+#endif
+            else
+                from -= skip[c];
+        }
     }
 
-    return r;
+    return -1;
+}
+
+
+qw_block *qw_block_search(qw_block *b, int *pos, const char *str, int size, int inc)
+/* search for a string in the chain of blocks */
+{
+    int skip[256];
+    int *sk = NULL;
+    int p = *pos;
+    int n, q;
+
+    if (b == NULL || size <= 0)
+        return b;
+
+#ifdef CONFOPT_MEMMEM
+    /* only needed backwards */
+    if (size >= QW_SEARCH_HORSPOOL && inc < 0) {
+#else
+    if (size >= QW_SEARCH_HORSPOOL) {
+#endif
+        /* build the skip table */
+        sk = skip;
+
+        for (n = 0; n < 256; n++)
+            sk[n] = size;
+
+        if (inc > 0) {
+            for (n = 0; n < size - 1; n++)
+                sk[(unsigned char) str[n]] = size - 1 - n;
+        }
+        else {
+            for (n = size - 1; n > 0; n--)
+                sk[(unsigned char) str[n]] = n;
+        }
+    }
+
+    if (inc > 0) {
+        for (; b != NULL; b = b->next, p = 0) {
+            /* last position where the string fits inside the block */
+            int end = b->used - size;
+
+            block_strip(b);
+
+            if (p <= end && (q = search_fwd(b->data, p, end, str, size, sk)) != -1)
+                goto found;
+
+            /* positions where it can continue into the next blocks */
+            for (q = p > end + 1 ? p : end + 1; q < b->used; q++) {
+                if (b->data[q] == str[0] && qw_block_here(b, q, str, size))
+                    goto found;
+            }
+        }
+    }
+    else {
+        /* the end of a block is the start of the next one */
+        while (p >= b->used && b->next) {
+            p -= b->used;
+            b = b->next;
+        }
+
+        for (; b != NULL; b = b->prev, p = b ? b->used - 1 : 0) {
+            int end = b->used - size;
+
+            block_strip(b);
+
+            q = p < b->used - 1 ? p : b->used - 1;
+
+            /* positions where it can continue into the next blocks */
+            for (; q > end && q >= 0; q--) {
+                if (b->data[q] == str[0] && qw_block_here(b, q, str, size))
+                    goto found;
+            }
+
+            if (q >= 0 && (q = search_bwd(b->data, q, 0, str, size, sk)) != -1)
+                goto found;
+        }
+    }
+
+    return NULL;
+
+found:
+    *pos = q;
+    return b;
+}
+
+
+qw_block *qw_block_move_bol(qw_block *b, int *pos)
+/* move to the beginning of the line */
+{
+    if (b != NULL) {
+        qw_block *t = b;
+        int n, i = *pos;
+
+        /* usually, the newline is near: in this same block or the
+           previous one (the line index counts from the start) */
+        for (n = 0; n < 2; n++) {
+#ifdef CONFOPT_MEMRCHR
+            const char *p = memrchr(t->data, '\n', i);
+
+            if (p != NULL) {
+                *pos = p - t->data + 1;
+                return t;
+            }
+#else
+            while (--i >= 0) {
+                if (t->data[i] == '\n') {
+                    *pos = i + 1;
+                    return t;
+                }
+            }
+#endif
+
+            /* no newline up to the start: it's the first line */
+            if ((t = t->prev) == NULL) {
+                *pos = 0;
+                return qw_block_first(b);
+            }
+
+            block_strip(t);
+            i = t->used;
+        }
+    }
+
+    return qw_block_line_to_rel(b, qw_block_line(b, *pos), pos);
 }
 
 
@@ -249,7 +1256,33 @@ qw_block *qw_block_move_eol(qw_block *b, int *pos)
 {
     qw_block *r;
 
-    if ((r = qw_block_search(b, pos, "\n", 1, 1)) == NULL) {
+    if (b != NULL) {
+        int n, i = *pos;
+
+        /* the same, forward */
+        for (r = b, n = 0; n < 2; n++) {
+            const char *p = memchr(&r->data[i], '\n', r->used - i);
+
+            if (p != NULL) {
+                *pos = p - r->data;
+                return r;
+            }
+
+            if (r->next == NULL) {
+                *pos = r->used;
+                return r;
+            }
+
+            block_strip(r = r->next);
+            i = 0;
+        }
+    }
+
+    if ((r = qw_block_line_to_rel(b, qw_block_line(b, *pos) + 1, pos)) != NULL) {
+        /* found the next line; move back over the newline */
+        r = qw_block_move(r, *pos, pos, -1);
+    }
+    else {
         /* not found; move to EOF */
         r = qw_block_last(b);
         *pos = r->used;
@@ -259,6 +1292,191 @@ qw_block *qw_block_move_eol(qw_block *b, int *pos)
 }
 
 
+int qw_block_line(qw_block *b, int pos)
+/* returns the line number (from 0) of a position */
+{
+    int l = 0;
+
+    if (b != NULL) {
+        qw_block *t;
+
+        l = count_nl(b->data, pos) + tree_lines(b->left);
+
+        /* add everything on the left of the path to the root */
+        for (t = b; t->up; t = t->up) {
+            if (t == t->up->right)
+                l += tree_lines(t->up->left) + block_lines(t->up);
+        }
+    }
+
+    return l;
+}
+
+
+qw_block *qw_block_line_to_rel(qw_block *b, int line, int *rpos)
+/* moves to the beginning of a line (from 0). Returns NULL if there
+   are not so many lines */
+{
+    qw_block *t = NULL;
+
+    if (b != NULL && line == 0) {
+        t = qw_block_first(b);
+        *rpos = 0;
+    }
+    else
+    if (b != NULL && line > 0) {
+        const char *p;
+
+        /* descend the index tree to the block with the newline,
+           counting only the subtrees on the way; falling off
+           the tree means there are not so many lines */
+        t = b->chain->root;
+
+        while (t != NULL) {
+            if (line <= tree_lines(t->left))
+                t = t->left;
+            else {
+                line -= tree_lines(t->left);
+
+                if (line <= block_lines(t))
+                    break;
+
+                line -= t->lines;
+                t = t->right;
+            }
+        }
+
+        if (t == NULL)
+            return NULL;
+
+        /* find it inside the block */
+        block_strip(t);
+
+        for (p = t->data; line; line--)
+            p = (char *)memchr(p, '\n', t->used - (p - t->data)) + 1;
+
+        *rpos = p - t->data;
+    }
+
+    return t;
+}
+
+
+static void block_unlink(qw_block *b)
+/* takes a block out of its chain and frees it */
+{
+    tree_remove(b);
+
+    if (b->chain->cur && b->chain->cur->b == b)
+        b->chain->cur->b = NULL;
+
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        b->chain->first = b->next;
+
+    if (b->next)
+        b->next->prev = b->prev;
+    else
+        b->chain->last = b->prev;
+
+    block_free(b);
+}
+
+
+static int block_mergeable(qw_block *b, qw_block *n)
+/* tests if the next block can be merged into this one */
+{
+    if (b->raw || n->raw)
+        return 0;
+
+    if (b->chain->pieces)
+        /* pieces that are contiguous in memory */
+        return &b->data[b->used] == n->data && b->used + n->used <= QW_PIECE_SIZE;
+
+    /* writable blocks whose data fits in one */
+    return b->size && n->size && b->used + n->used <= b->size;
+}
+
+
+qw_block *qw_block_compact(qw_block *b, int steps)
+/* runs a step of the compaction of the range of a chain changed since
+   the last pass, visiting up to steps blocks and resuming where the
+   previous call left. Merges adjacent underfilled blocks and frees
+   empty ones. Returns a valid block to replace b */
+{
+    qw_chain *c = b->chain;
+    qw_block *t;
+    int i, a;
+
+    if (!c->compacting) {
+        /* nothing changed since the last pass? */
+        if (!c->dirty)
+            return b;
+
+        c->dirty       = 0;
+        c->compacting  = 1;
+        c->compact_end = c->dirty_e;
+
+        /* start from the block before, that may take the first one in */
+        if ((t = qw_block_abs_to_rel(b, c->dirty_s, &i)) == NULL)
+            t = c->last;
+
+        while (t->prev && t->prev->used == 0)
+            t = t->prev;
+
+        c->compact_pos = t->prev ? qw_block_rel_to_abs(t->prev, 0) : 0;
+    }
+
+    /* resume, going back over empty blocks that can't be addressed */
+    if ((t = qw_block_abs_to_rel(b, c->compact_pos, &i)) == NULL)
+        t = c->last;
+
+    while (t->prev && t->prev->used == 0)
+        t = t->prev;
+
+    a = qw_block_rel_to_abs(t, 0);
+
+    while (t != NULL && a <= c->compact_end && steps-- > 0) {
+        qw_block *n = t->next;
+
+        if (t->used == 0 && (t->prev || n)) {
+            /* empty block: free it, keeping b valid */
+            if (b == t)
+                b = n ? n : t->prev;
+
+            block_unlink(t);
+            t = n;
+        }
+        else
+        if (n && n->used && block_mergeable(t, n)) {
+            /* move the next one into this one; stay here to retry */
+            if (!c->pieces)
+                memcpy(&t->data[t->used], n->data, n->used);
+
+            t->used += n->used;
+            block_changed(t);
+
+            if (b == n)
+                b = t;
+
+            block_unlink(n);
+        }
+        else {
+            a += t->used;
+            t = n;
+        }
+    }
+
+    if (t == NULL || a > c->compact_end)
+        c->compacting = 0;
+    else
+        c->compact_pos = a;
+
+    return b;
+}
+
+
 qw_block *qw_block_insert_str_and_move(qw_block *b, int *pos, const char *str, int size)
 /* insert and string and move forward */
 {
@@ -267,20 +1485,110 @@ qw_block *qw_block_insert_str_and_move(qw_block *b, int *pos, const char *str, i
 }
 
 
+static int block_mem(qw_block *b, int *used, int *size)
+/* counts the used and allocated memory from a block to the end of the
+   chain. Returns the utilisation percentage */
+{
+    *used = *size = 0;
+
+    if (b && b->chain->pieces) {
+        qw_addbuf *a;
+
+        /* the memory of piece chains is in the add buffers */
+        for (a = b->chain->add; a; a = a->prev) {
+            *used += a->used;
+            *size += a->size;
+        }
+    }
+
+    for (; b != NULL; b = b->next) {
+        /* read-only blocks don't account as allocated memory */
+        if (b->size) {
+            *used += b->used;
+            *size += b->size;
+        }
+    }
+
+    return *size ? (int) ((long long) *used * 100 / *size) : 100;
+}
+
+
+int qw_block_util(qw_block *b)
+/* returns the memory utilisation of a chain, in percentage */
+{
+    qw_chain *c = b->chain;
+
+    return c->mem_size ? (int) ((long long) c->mem_used * 100 / c->mem_size) : 100;
+}
+
+
+uint64_t qw_block_hash_str(uint64_t h, const char *str, int size)
+/* continues a hash (64 bit FNV-1a) with a string */
+{
+    const unsigned char *p = (unsigned char *)str;
+    int n;
+
+    for (n = 0; n < size; n++) {
+        h ^= p[n];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+
+uint64_t qw_block_hash(qw_block *b)
+/* returns a hash of the content of a chain */
+{
+    uint64_t h = QW_BLOCK_HASH_INIT;
+
+    for (b = qw_block_first(b); b != NULL; b = b->next) {
+        if (b->raw) {
+            /* not stripped yet: hash the lines without the CRs */
+            const char *p = b->data;
+            int z = b->raw;
+
+            while (z > 0) {
+                const char *lf = memchr(p, '\n', z);
+                int l = lf ? lf - p : z;
+
+                h = qw_block_hash_str(h, p, l - (lf && l && p[l - 1] == '\r'));
+
+                if (lf) {
+                    h = qw_block_hash_str(h, lf, 1);
+                    l++;
+                }
+
+                p += l;
+                z -= l;
+            }
+        }
+        else
+            h = qw_block_hash_str(h, b->data, b->used);
+    }
+
+    return h;
+}
+
+
 void qw_block_dump(qw_block *b, FILE *f)
 /* dumps information on a chain of blocks */
 {
     int n_blocks = 0;
-    int t_size = 0;
-    int t_used = 0;
+    int t_size, t_used, util;
+
+    util = block_mem(b, &t_used, &t_size);
 
     while (b) {
         int n;
 
+        block_strip(b);
+
         fprintf(f, "addr: %p\n", b);
         fprintf(f, "prev: %p\n", b->prev);
         fprintf(f, "next: %p\n", b->next);
         fprintf(f, "used: %d\n", b->used);
+        fprintf(f, "size: %d\n", b->size);
         fprintf(f, "data:\n");
 
         for (n = 0; n < b->used; n++) {
@@ -296,7 +1604,6 @@ void qw_block_dump(qw_block *b, FILE *f)
         fprintf(f, "\n");
 
         n_blocks++;
-        t_used += b->used;
 
         b = b->next;
 
@@ -304,8 +1611,6 @@ void qw_block_dump(qw_block *b, FILE *f)
             fprintf(f, "----------------------------\n");
     }
 
-    t_size = n_blocks * QW_BLOCK_SIZE;
-
     fprintf(f, "\nblocks: %d\n", n_blocks);
-    fprintf(f, "memory: %d / %d (%d%%)\n\n", t_used, t_size, t_used * 100 / t_size);
+    fprintf(f, "memory: %d / %d (%d%%)\n\n", t_used, t_size, util);
 }
@@ -127,6 +127,20 @@ int qw_conf_parse_cmd(qw_core *core, const char *cmd)
             r = -1;
     }
     else
+    if (strcmp(argv[0], "undo_memory") == 0) {
+        int mb;
+
+        if (argc != 2 || sscanf(argv[1], "%d", &mb) != 1)
+            r = -1;
+        else
+            qw_journal_budget = mb * 1024L * 1024L;
+    }
+    else
+    if (strcmp(argv[0], "undo_file") == 0) {
+        if (argc != 2 || sscanf(argv[1], "%d", &qw_doc_undo_file) != 1)
+            r = -1;
+    }
+    else
     if (strcmp(argv[0], "attr") == 0) {
         r = -1;
 
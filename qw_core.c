@@ -22,21 +22,24 @@ qw_core *qw_core_new(void)
 }
 
 
-static int add_char_to_view(qw_view *view, int vsz, char chr, qw_attr attr)
-/* adds a character and its attribute to a view */
-{
-    /* realloc if needed */
-    if (view->size >= vsz) {
-        vsz += 32;
-        view->data = realloc(view->data, vsz);
-        view->attr = realloc(view->attr, vsz);
-    }
+/* bytes per column to reserve in the view (the longest UTF-8 char) */
+#define QW_VIEW_BPC 4
+
+static void view_reserve(qw_core *core, int size)
+/* makes room in the view for size bytes (and an ASCIIZ) */
+{
+    qw_view *view = &core->view;
 
-    view->data[view->size] = chr;
-    view->attr[view->size] = (char) attr;
-    view->size++;
+    if (size + 1 > view->alloc) {
+        /* never less than a screen full */
+        int min = (core->width * QW_VIEW_BPC + 1) * core->height + 1;
 
-    return vsz;
+        view->alloc = (size + 1) * 2 > min ? (size + 1) * 2 : min;
+        view->data  = realloc(view->data, view->alloc);
+        view->attr  = realloc(view->attr, view->alloc);
+
+        core->view_allocs++;
+    }
 }
 
 
@@ -82,7 +85,6 @@ void qw_view_mark_matching(qw_view *view, int cpos)
 void qw_core_create_view(qw_core *core, int *cx, int *cy)
 /* creates a view for the current document */
 {
-    int vsz = 0;
     qw_doc *doc   = core->docs;
     qw_view *view = &core->view;
     qw_block *b;
@@ -93,10 +95,9 @@ void qw_core_create_view(qw_core *core, int *cx, int *cy)
     doc->vpos = qw_view_fix_vpos(doc->b,
         doc->vpos, doc->cpos, core->width, core->height);
 
-    /* clean previous view */
-    free(view->data);
-    free(view->attr);
-    memset(view, '\0', sizeof(qw_view));
+    /* reuse the buffers of the previous view */
+    view->size = 0;
+    view_reserve(core, 0);
 
     /* convert the vpos to relative */
     b = qw_block_abs_to_rel(doc->b, doc->vpos, &i);
@@ -104,44 +105,53 @@ void qw_core_create_view(qw_core *core, int *cx, int *cy)
     vpos = doc->vpos;
 
     for (h = 0; b != NULL && h < core->height; h++) {
-        char buf[4096]; /* should be enough to fit a row */
+        char *row, *t;
         int rsz, n;
 
-        memset(buf, ' ', sizeof(buf));
-
         /* get the row size */
         rsz = qw_view_row_size(b, i, core->width);
 
-        /* read the full row */
-        qw_block_get_str(b, i, buf, rsz);
+        /* read the full row right into the view (with room for a wordwrap) */
+        view_reserve(core, view->size + rsz + 1);
+        row = &view->data[view->size];
 
-        /* transfer bytes into the view */
-        for (n = 0; n < rsz; n++) {
-            /* is there a selection mark? */
-            if (doc->mark_s != -1 && doc->mark_e != -1) {
-                /* if no mark start is set and we're inside it, mark the start */
-                if (ms == -1 && vpos + n >= doc->mark_s && vpos + n < doc->mark_e)
-                    ms = view->size;
+        n = qw_block_get_str(b, i, row, rsz);
+        memset(&view->attr[view->size], QW_ATTR_NORMAL, rsz);
 
-                /* if we're outside the selection, mark the end */
-                if (vpos + n < doc->mark_e)
-                    me = view->size;
-            }
+        /* past the end of the document, as a blank */
+        if (n < rsz)
+            memset(row + n, ' ', rsz - n);
 
-            /* store the offset of the cursor inside the view */
-            if (vpos + n == doc->cpos)
-                cpos = view->size;
+        /* is there a selection mark? */
+        if (doc->mark_s != -1 && doc->mark_e != -1) {
+            /* if no mark start is set and it starts here, mark the start */
+            n = doc->mark_s > vpos ? doc->mark_s - vpos : 0;
 
-            /* FIXME: if it's a tab, change it to some thing less problematic */
-            if (buf[n] == '\t')
-                buf[n] = '_';
+            if (ms == -1 && n < rsz && vpos + n < doc->mark_e)
+                ms = view->size + n;
 
-            vsz = add_char_to_view(view, vsz, buf[n], QW_ATTR_NORMAL);
+            /* the last byte before the end of the selection */
+            n = doc->mark_e - vpos - 1;
+
+            if (n >= 0 && rsz > 0)
+                me = view->size + (n < rsz ? n : rsz - 1);
         }
 
+        /* store the offset of the cursor inside the view */
+        if (doc->cpos >= vpos && doc->cpos < vpos + rsz)
+            cpos = view->size + doc->cpos - vpos;
+
+        /* FIXME: tabs are changed to some thing less problematic */
+        for (t = row; (t = memchr(t, '\t', row + rsz - t)) != NULL; t++)
+            *t = '_';
+
+        view->size += rsz;
+
         /* if it wasn't a real EOL, add a soft wordwrap */
-        if (rsz > 0 && buf[rsz - 1] != '\n')
-            vsz = add_char_to_view(view, vsz, '\r', QW_ATTR_NORMAL);
+        if (rsz > 0 && row[rsz - 1] != '\n') {
+            view->attr[view->size]   = QW_ATTR_NORMAL;
+            view->data[view->size++] = '\r';
+        }
 
         /* if cpos is inside this line, fill cursor position */
         if (doc->cpos >= vpos && doc->cpos <= vpos + rsz) {
@@ -149,7 +159,7 @@ void qw_core_create_view(qw_core *core, int *cx, int *cy)
             *cy = h;
 
             /* get x position by calculating the width of the start of the line */
-            *cx = qw_utf8_str_width(buf, doc->cpos - vpos);
+            *cx = qw_utf8_str_width(row, doc->cpos - vpos);
         }
 
         /* advance cursor */
@@ -159,16 +169,17 @@ void qw_core_create_view(qw_core *core, int *cx, int *cy)
         vpos += rsz;
     }
 
-    /* insert an ASCIIZ to allow string searches, but don't account it */
-    vsz = add_char_to_view(view, vsz, '\0', QW_ATTR_NONE);
-    view->size--;
+    /* an ASCIIZ to allow string searches, but not accounted */
+    view->data[view->size] = '\0';
+    view->attr[view->size] = QW_ATTR_NONE;
 
     /* change the attribute of the matching character */
     if (cpos != -1)
         qw_view_mark_matching(view, cpos);
 
-    /* apply syntax highlight */
-    qw_synhi_apply_to_view(view, doc->sh);
+    /* apply syntax highlight, continuing the sections open above
+       (if not known yet, the idle loop will find them) */
+    doc->lex_pending = qw_synhi_apply_at(view, doc->sh, doc->b, doc->vpos) == -1;
 
     /* mark the selection, if any */
     if (ms != -1) {
@@ -199,16 +210,14 @@ static void op_left(qw_core *core)
     int i;
 
     /* get relative */
-    b = qw_block_abs_to_rel(doc->b, doc->cpos, &i);
+    b = qw_doc_cursor(doc, &i);
 
     /* move */
     b = qw_utf8_move(b, &i, -1);
 
-    /* store absolute */
-    if (b != NULL) {
-        doc->b    = b;
-        doc->cpos = qw_block_rel_to_abs(b, i);
-    }
+    /* store; absolute only if it changed block */
+    if (b != NULL)
+        qw_doc_set_cursor(doc, b, i, -1);
 }
 
 
@@ -220,16 +229,14 @@ static void op_right(qw_core *core)
     int i;
 
     /* get relative */
-    b = qw_block_abs_to_rel(doc->b, doc->cpos, &i);
+    b = qw_doc_cursor(doc, &i);
 
     /* move */
     b = qw_utf8_move(b, &i, 1);
 
-    /* store absolute */
-    if (b != NULL) {
-        doc->b    = b;
-        doc->cpos = qw_block_rel_to_abs(b, i);
-    }
+    /* store; absolute only if it changed block */
+    if (b != NULL)
+        qw_doc_set_cursor(doc, b, i, -1);
 }
 
 
@@ -237,26 +244,8 @@ static void op_up(qw_core *core)
 /* moves the cursor up */
 {
     qw_doc *doc = core->docs;
-    int size, col, ac0;
-    qw_block *b;
-    int i;
-
-    /* get col #0 position */
-    ac0 = qw_view_get_col_0(doc->b, core->docs->cpos, core->width, &size);
-
-    /* get column */
-    col = qw_view_width_diff(doc->b, ac0, core->docs->cpos);
 
-    b = qw_block_abs_to_rel(doc->b, ac0, &i);
-
-    /* move back one char (to the end of previous line) */
-    if ((b = qw_block_move(b, i, &i, -1)) != NULL) {
-        /* get this new col #0 position */
-        ac0 = qw_view_get_col_0(b, qw_block_rel_to_abs(b, i), core->width, &size);
-
-        /* skip to col */
-        core->docs->cpos = qw_view_set_col(doc->b, ac0, col, core->width);
-    }
+    qw_doc_set_cursor(doc, NULL, 0, qw_view_move_rows(doc->b, doc->cpos, -1, core->width));
 }
 
 
@@ -264,42 +253,28 @@ static void op_down(qw_core *core)
 /* moves the cursor down */
 {
     qw_doc *doc = core->docs;
-    int size, col, ac0;
-    qw_block *b;
-    int i;
 
-    /* get col #0 position */
-    ac0 = qw_view_get_col_0(doc->b, core->docs->cpos, core->width, &size);
-
-    /* get column */
-    col = qw_view_width_diff(doc->b, ac0, core->docs->cpos);
-
-    b = qw_block_abs_to_rel(doc->b, ac0, &i);
-
-    if ((b = qw_block_move(b, i, &i, size)) != NULL) {
-        /* skip to col */
-        core->docs->cpos = qw_view_set_col(doc->b, qw_block_rel_to_abs(b, i), col, core->width);
-    }
+    qw_doc_set_cursor(doc, NULL, 0, qw_view_move_rows(doc->b, doc->cpos, 1, core->width));
 }
 
 
 static void op_pgup(qw_core *core)
 /* moves the cursor a page up */
 {
-    int n;
+    qw_doc *doc = core->docs;
 
-    for (n = 0; n < core->height - 1; n++)
-        op_up(core);
+    qw_doc_set_cursor(doc, NULL, 0,
+        qw_view_move_rows(doc->b, doc->cpos, -(core->height - 1), core->width));
 }
 
 
 static void op_pgdn(qw_core *core)
-/* moves the cursor a page up */
+/* moves the cursor a page down */
 {
-    int n;
+    qw_doc *doc = core->docs;
 
-    for (n = 0; n < core->height - 1; n++)
-        op_down(core);
+    qw_doc_set_cursor(doc, NULL, 0,
+        qw_view_move_rows(doc->b, doc->cpos, core->height - 1, core->width));
 }
 
 
@@ -310,7 +285,7 @@ static void op_bol(qw_core *core)
     int size;
 
     /* move to column #0 */
-    doc->cpos = qw_view_get_col_0(doc->b, doc->cpos, core->width, &size);
+    qw_doc_set_cursor(doc, NULL, 0, qw_view_get_col_0(doc->b, doc->cpos, core->width, &size));
 }
 
 
@@ -318,20 +293,20 @@ static void op_eol(qw_core *core)
 /* moves the cursor to the end of the line (row) */
 {
     qw_doc *doc = core->docs;
-    int size;
+    int ac0, size;
 
     /* move to column #0 */
-    doc->cpos = qw_view_get_col_0(doc->b, doc->cpos, core->width, &size);
+    ac0 = qw_view_get_col_0(doc->b, doc->cpos, core->width, &size);
 
     /* then skip to one byte less than the length */
-    doc->cpos += size - 1;
+    qw_doc_set_cursor(doc, NULL, 0, ac0 + size - 1);
 }
 
 
 static void op_bof(qw_core *core)
 /* moves the cursor to the beginning of the file */
 {
-    core->docs->cpos = 0;
+    qw_doc_set_cursor(core->docs, qw_block_first(core->docs->b), 0, 0);
 }
 
 
@@ -344,7 +319,7 @@ static void op_eof(qw_core *core)
     b = qw_block_last(core->docs->b);
 
     /* store the last position */
-    core->docs->cpos = qw_block_rel_to_abs(b, b->used);
+    qw_doc_set_cursor(core->docs, b, b->used, -1);
 }
 
 
@@ -368,16 +343,11 @@ static void op_del_mark(qw_core *core)
 
         /* create a journal entry and apply it */
         doc->j = qw_journal_new(0, b, i, NULL, doc->mark_e - doc->mark_s, doc->j);
-        b = qw_journal_apply(b, doc->j, 1);
-
-        /* set the cursor to the previous start of the block */
-        if (b != NULL) {
-            doc->b    = b;
-            doc->cpos = qw_block_rel_to_abs(b, i);
-        }
+        b = qw_journal_apply_at(b, i, doc->j, 1);
 
         /* move the cursor to where the selection started */
-        doc->cpos = doc->mark_s;
+        if (b != NULL)
+            qw_doc_set_cursor(doc, b, i, doc->mark_s);
 
         op_unmark(core);
     }
@@ -395,21 +365,22 @@ static void op_char(qw_core *core)
     op_del_mark(core);
 
     /* get relative */
-    b = qw_block_abs_to_rel(doc->b, doc->cpos, &i);
+    b = qw_doc_cursor(doc, &i);
 
     /* create a journal entry, apply it and move */
     doc->j = qw_journal_new(1, b, i, core->payload, core->pl_size, doc->j);
-    b = qw_journal_apply(b, doc->j, 1);
+    b = qw_journal_apply_at(b, i, doc->j, 1);
     b = qw_block_move(b, i, &i, doc->j->size);
 
+    /* store; the absolute position is known */
+    if (b != NULL)
+        qw_doc_set_cursor(doc, b, i, doc->cpos + doc->j->size);
+
+    /* typing a word is undone at once */
+    doc->j = qw_journal_merge(doc->j);
+
     free(core->payload);
     core->payload = NULL;
-
-    /* store absolute */
-    if (b != NULL) {
-        doc->b    = b;
-        doc->cpos = qw_block_rel_to_abs(b, i);
-    }
 }
 
 
@@ -468,17 +439,18 @@ static void op_del(qw_core *core)
         int i;
 
         /* get relative */
-        b = qw_block_abs_to_rel(doc->b, doc->cpos, &i);
+        b = qw_doc_cursor(doc, &i);
 
         /* create a journal entry and apply it */
         doc->j = qw_journal_new(0, b, i, NULL, 1, doc->j);
-        b = qw_journal_apply(b, doc->j, 1);
+        b = qw_journal_apply_at(b, i, doc->j, 1);
 
-        /* store absolute */
-        if (b != NULL) {
-            doc->b    = b;
-            doc->cpos = qw_block_rel_to_abs(b, i);
-        }
+        /* so is a run of deletes */
+        doc->j = qw_journal_merge(doc->j);
+
+        /* store; the cursor stays in the same absolute position */
+        if (b != NULL)
+            qw_doc_set_cursor(doc, b, i, doc->cpos);
     }
 }
 
@@ -496,10 +468,20 @@ static void op_undo(qw_core *core)
 {
     qw_doc *doc = core->docs;
 
+    /* at the start? continue into the previous session */
+    if (doc->j->prev == NULL)
+        qw_doc_history(doc);
+
     if (doc->j->prev) {
-        doc->b    = qw_journal_apply(doc->b, doc->j, 0);
-        doc->cpos = doc->j->apos;
-        doc->j    = doc->j->prev;
+        qw_block *b;
+
+        if ((b = qw_journal_apply(doc->b, doc->j, 0)) == NULL)
+            qw_drv_alert(core, "Error reading undo data");
+        else {
+            doc->b = b;
+            qw_doc_set_cursor(doc, NULL, 0, doc->j->apos);
+            doc->j = doc->j->prev;
+        }
     }
 }
 
@@ -510,9 +492,15 @@ static void op_redo(qw_core *core)
     qw_doc *doc = core->docs;
 
     if (doc->j->next) {
-        doc->j    = doc->j->next;
-        doc->b    = qw_journal_apply(doc->b, doc->j, 1);
-        doc->cpos = doc->j->apos;
+        qw_block *b;
+
+        if ((b = qw_journal_apply(doc->b, doc->j->next, 1)) == NULL)
+            qw_drv_alert(core, "Error reading undo data");
+        else {
+            doc->j = doc->j->next;
+            doc->b = b;
+            qw_doc_set_cursor(doc, NULL, 0, doc->j->apos);
+        }
     }
 }
 
@@ -532,13 +520,11 @@ static void op_del_row(qw_core *core)
 
     /* create a journal entry and apply it */
     doc->j = qw_journal_new(0, b, i, NULL, size, doc->j);
-    b = qw_journal_apply(b, doc->j, 1);
+    b = qw_journal_apply_at(b, i, doc->j, 1);
 
-    /* store absolute */
-    if (b != NULL) {
-        doc->b    = b;
-        doc->cpos = qw_block_rel_to_abs(b, i);
-    }
+    /* store; the cursor is now at column #0 */
+    if (b != NULL)
+        qw_doc_set_cursor(doc, b, i, ac0);
 }
 
 
@@ -615,18 +601,16 @@ static void op_paste(qw_core *core)
 
     if (core->clip_size) {
         /* get relative */
-        b = qw_block_abs_to_rel(doc->b, doc->cpos, &i);
+        b = qw_doc_cursor(doc, &i);
 
         /* create a journal entry, apply it and move */
         doc->j = qw_journal_new(1, b, i, core->clip_data, core->clip_size, doc->j);
-        b = qw_journal_apply(b, doc->j, 1);
+        b = qw_journal_apply_at(b, i, doc->j, 1);
         b = qw_block_move(b, i, &i, doc->j->size);
 
-        /* store absolute */
-        if (b != NULL) {
-            doc->b    = b;
-            doc->cpos = qw_block_rel_to_abs(b, i);
-        }
+        /* store; the absolute position is known */
+        if (b != NULL)
+            qw_doc_set_cursor(doc, b, i, doc->cpos + core->clip_size);
     }
 }
 
@@ -660,13 +644,30 @@ static void op_save(qw_core *core)
 
     if (core->docs->fname != NULL) {
         /* save to disk */
-        qw_file_save(core->docs->b, core->docs->fname, core->docs->crlf);
+        if (qw_doc_save(core->docs) == -1)
+            qw_drv_alert(core, "Error saving file");
+        else
+            /* mark as clean */
+            qw_journal_mark_clean(core->docs->j);
+    }
+}
 
-        /* mark as clean */
-        qw_journal_mark_clean(core->docs->j);
 
-        /* no longer new */
-        core->docs->new_file = 0;
+static void cat_fname(qw_core *core, char *str)
+/* appends the (maybe shortened) current file name to str */
+{
+    char *fname = core->docs->fname;
+
+    if (fname == NULL)
+        strcat(str, "<unnamed>");
+    else
+    if (strlen(fname) < core->width / 4)
+        strcat(str, fname);
+    else {
+        /* file name too long; print only the last part */
+        char *p = &fname[strlen(fname) - core->width / 4];
+        strcat(str, "...");
+        strcat(str, p);
     }
 }
 
@@ -676,23 +677,11 @@ static void op_close(qw_core *core)
 {
     int r = 1;
 
-    if (!core->docs->j->clean) {
+    if (!qw_journal_is_clean(core->docs->j)) {
         /* unsaved? ask first */
-        char *fname = core->docs->fname;
         char str[4096] = "'";
 
-        if (fname == NULL)
-            strcat(str, "<unnamed>");
-        else
-        if (strlen(fname) < core->width / 4)
-            strcat(str, fname);
-        else {
-            /* file name too long; print only the last part */
-            char *p = &fname[strlen(fname) - core->width / 4];
-            strcat(str, "...");
-            strcat(str, p);
-        }
-
+        cat_fname(core, str);
         strcat(str, "' has unsaved changes. Save?");
 
         r = qw_drv_confirm(core, str);
@@ -733,13 +722,12 @@ static void op_search_next(qw_core *core)
         qw_block *b;
         int i;
 
-        b = qw_block_abs_to_rel(doc->b, doc->cpos, &i);
+        b = qw_doc_cursor(doc, &i);
 
         if ((b = qw_block_search(b, &i, core->search, core->search_size, 1)) != NULL) {
             /* skip search result */
-            b = qw_block_move(b, i, &i, core->search_size);
-
-            doc->cpos = qw_block_rel_to_abs(b, i);
+            if ((b = qw_block_move(b, i, &i, core->search_size)) != NULL)
+                qw_doc_set_cursor(doc, b, i, -1);
         }
         else
             qw_drv_alert(core, "Not found.");
@@ -786,6 +774,35 @@ static void op_conf_cmd(qw_core *core)
 }
 
 
+static void op_goto_line(qw_core *core)
+/* moves the cursor to the beginning of a line */
+{
+    char *str;
+
+    if ((str = qw_drv_readline(core, "Line:")) != NULL) {
+        qw_doc *doc = core->docs;
+        int line = atoi(str);
+        qw_block *b;
+        int i, size;
+
+        if (line > 0) {
+            /* lines are counted from 1; beyond the last one is EOF */
+            if ((b = qw_block_line_to_rel(doc->b, line - 1, &i)) == NULL) {
+                b = qw_block_last(doc->b);
+                i = b->used;
+            }
+
+            qw_doc_set_cursor(doc, b, i, qw_block_rel_to_abs(b, i));
+
+            /* show it on top, instead of scrolling all the way */
+            doc->vpos = qw_view_get_col_0(doc->b, doc->cpos, core->width, &size);
+        }
+
+        free(str);
+    }
+}
+
+
 /* array of function handlers indexed by op */
 static void (*op2func[])(qw_core *) = {
 #define X(oid, oname) op_##oname,
@@ -808,6 +825,49 @@ void qw_core_key(qw_core *core, qw_key key)
 }
 
 
+int qw_core_idle(qw_core *core)
+/* does background work while idle. Returns 1 if there is more to do */
+{
+    qw_doc *doc = core->docs;
+    int more = 0;
+
+    if (doc != NULL) {
+        do {
+            more |= qw_doc_compact(doc, 256);
+            more |= qw_doc_sync(doc);
+            more |= qw_doc_lex(doc, 256 * 1024);
+            doc = doc->next;
+        } while (doc != core->docs);
+
+        /* painted without knowing the sections open above? now they are */
+        doc = core->docs;
+        if (doc->lex_pending && qw_synhi_ready(doc->sh, doc->b, doc->vpos)) {
+            doc->lex_pending = 0;
+            core->refresh++;
+        }
+
+        /* changes left by a crash? */
+        if (doc->recover) {
+            char str[4096] = "'";
+            int replay;
+
+            cat_fname(core, str);
+            strcat(str, "' has unsaved changes from a crash. Recover?");
+
+            /* not asked again if the prompt runs the idle loop */
+            doc->recover = 0;
+            replay = qw_drv_confirm(core, str) == 1;
+            doc->recover = 1;
+
+            qw_doc_recover(doc, replay);
+            core->refresh++;
+        }
+    }
+
+    return more;
+}
+
+
 void qw_core_dump(qw_core *core, FILE *f)
 /* dumps information on a core */
 {
@@ -816,6 +876,8 @@ void qw_core_dump(qw_core *core, FILE *f)
     struct tm *tm = localtime(&t);
 
     fprintf(f, "%s\n", asctime(tm));
+    fprintf(f, "frame: %d bytes\n", core->frame_bytes);
+    fprintf(f, "view allocs: %d\n", core->view_allocs);
 
     do {
         qw_doc_dump(d, f);
@@ -828,11 +890,43 @@ void qw_core_dump(qw_core *core, FILE *f)
 char *qw_core_status_line(qw_core *core, char *buf, int max_size)
 /* fills the buffer with the status line */
 {
-    if (core->docs != NULL)
-        snprintf(buf, max_size, "%s%s%s - qw",
-            core->docs->j->clean      ? "" : "*",
+    if (core->docs != NULL) {
+        qw_cursor *c = &core->docs->cur;
+        char rate[64] = "";
+        qw_block *b;
+        int i;
+
+        /* show the speed of the last save while still clean */
+        if (qw_journal_is_clean(core->docs->j) && core->docs->save_bps > 0.0) {
+            double bps = core->docs->save_bps / 1024.0;
+            const char *unit = "KB/s";
+
+            if (bps >= 1024.0) {
+                bps /= 1024.0;
+                unit = "MB/s";
+            }
+
+            snprintf(rate, sizeof(rate), " (saved at %.1f %s)", bps, unit);
+        }
+
+        /* line and column of the cursor, if it moved since last time */
+        b = qw_doc_cursor(core->docs, &i);
+
+        if (c->line == -1) {
+            b = qw_block_move_bol(b, &i);
+
+            c->line = qw_block_line(b, i);
+            c->col  = qw_view_width_diff(b, qw_block_rel_to_abs(b, i), c->apos);
+        }
+
+        snprintf(buf, max_size, "%s%s%s%s %d:%d - qw",
+            qw_journal_is_clean(core->docs->j) ? "" : "*",
             core->docs->fname != NULL ? core->docs->fname : "<unnamed>",
-            core->docs->new_file      ? " (new file)" : "");
+            core->docs->new_file      ? " (new file)" : "",
+            rate,
+            c->line + 1,
+            c->col + 1);
+    }
     else
         strcpy(buf, "qw");
 
@@ -843,7 +937,18 @@ char *qw_core_status_line(qw_core *core, char *buf, int max_size)
 void qw_core_doc_new(qw_core *core, const char *fname)
 /* opens a file */
 {
-    core->docs = qw_doc_new(core->docs, fname);
+    qw_doc *doc;
+
+    if ((doc = qw_doc_new(core->docs, fname)) == NULL) {
+        char str[4096];
+
+        snprintf(str, sizeof(str), "'%.3000s' is too big to be edited", fname);
+        qw_drv_alert(core, str);
+
+        return;
+    }
+
+    core->docs = doc;
 
     if (fname != NULL) {
         if ((core->docs->sh = qw_synhi_find_by_extension(fname, core->shs)) == NULL)
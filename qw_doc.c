@@ -1,40 +1,147 @@
 /* qw - A minimalistic text editor by grunfink - public domain */
 
-#include "qw.h"
+#include "config.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <fcntl.h>
+
+#ifdef CONFOPT_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef CONFOPT_WRITEV
+#include <sys/uio.h>
+#else
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
+#include "qw.h"
+
+/* write an undo sidecar file on save */
+int qw_doc_undo_file = 1;
+
+/* group commit period of the write-ahead log (milliseconds) */
+#define QW_WAL_PERIOD 200
+
+/* seconds a file must be unmodified to be mapped instead of read */
+#define QW_MAP_QUIET 2
+
+/* header of the undo sidecar file, followed by the journal entries */
+struct undo_hdr {
+    char magic[4];      /* "QWU1" */
+    int32_t count;      /* number of journal entries */
+    int64_t fsize;      /* size of the file */
+    int64_t mtime;      /* modification time of the file */
+    uint64_t hash;      /* hash of the content */
+};
+
+/* header of the write-ahead log, followed by the changes */
+struct wal_hdr {
+    char magic[4];      /* "QWL1" */
+    int32_t pad;        /* unused */
+    int64_t fsize;      /* size of the file (-1: not on disk) */
+    int64_t mtime;      /* modification time of the file */
+};
 
 /** code **/
 
 qw_block *qw_file_load(const char *fname, int *crlf)
-/* loads a file. Returns the loaded data and if it has CR/LF line endings */
+/* loads a file. Returns the loaded data and if it has CR/LF line endings,
+   or NULL on errors (with errno set to EFBIG if it's too big) */
 {
     FILE *f;
     qw_block *b = NULL;
 
     if ((f = fopen(fname, "rb")) != NULL) {
-        char line[1024];
-        int i = 0;
+        struct stat st;
+        char *data = NULL;
+        int size = 0;
+        int mapped = 0;
+        int quiet = 0;
 
         /* normal EOL by default */
         *crlf = 0;
 
-        b = qw_block_new(NULL, NULL);
+        if (fstat(fileno(f), &st) != -1) {
+            /* positions are ints; bigger files can't be edited */
+            if (st.st_size > INT_MAX) {
+                fclose(f);
+                errno = EFBIG;
+                return NULL;
+            }
 
-        while ((fgets(line, sizeof(line), f)) != NULL) {
-            int sz = strlen(line);
+            size = (int) st.st_size;
 
-            /* does it have a CR? chop it */
-            if (sz >= 2 && line[sz - 2] == '\r') {
-                line[sz - 2] = '\n';
-                sz--;
+            /* a regular file not modified lately is not being written */
+            quiet = S_ISREG(st.st_mode) && time(NULL) - st.st_mtime > QW_MAP_QUIET;
+        }
 
-                *crlf = 1;
+#ifdef CONFOPT_MMAP
+        /* map the file; untouched pages are never read. If another
+           process truncates it while mapped, touching the lost pages
+           raises SIGBUS, so files that can still change are read */
+        if (size > 0 && quiet) {
+            data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+
+            if (data == MAP_FAILED)
+                data = NULL;
+            else
+                mapped = 1;
+        }
+#endif
+
+        if (data == NULL) {
+            /* read it all, until EOF (the size of pipes and
+               devices is not known, and a file can be growing) */
+            int a = size > 0 && size < INT_MAX ? size + 1 : QW_BLOCK_SIZE;
+            int z;
+
+            data = malloc(a);
+            size = 0;
+
+            while ((z = fread(data + size, 1, a - size, f)) > 0) {
+                size += z;
+
+                if (size == a) {
+                    if (a > INT_MAX / 2) {
+                        free(data);
+                        fclose(f);
+                        errno = EFBIG;
+                        return NULL;
+                    }
+
+                    a *= 2;
+                    data = realloc(data, a);
+                }
             }
+        }
+
+        if (size > 0) {
+            char *p;
+            int z = size < QW_BLOCK_SIZE * 16 ? size : QW_BLOCK_SIZE * 16;
 
-            b = qw_block_insert_str_and_move(b, &i, line, sz);
+            /* only the first line is looked at for a CR; if it has one,
+               the CRs of all CR/LF pairs are dropped (as they are
+               written back on save), and lone LFs or CRs are kept */
+            if ((p = memchr(data, '\n', z)) != NULL && p > data && p[-1] == '\r')
+                *crlf = 1;
+
+            b = qw_block_new_base(data, size, mapped, *crlf);
+        }
+        else {
+            free(data);
+            b = qw_block_new(NULL, NULL);
         }
 
         fclose(f);
@@ -44,39 +151,799 @@ qw_block *qw_file_load(const char *fname, int *crlf)
 }
 
 
-int qw_file_save(qw_block *b, const char *fname, int crlf)
-/* saves a file. Returns -1 on errors */
+#define QW_IOV_MAX 1024
+
+static int file_writev(int fd, struct iovec *iov, int n)
+/* writes a set of ranges, retrying after short writes. Returns -1 on errors */
+{
+    while (n > 0) {
+        ssize_t z;
+
+#ifdef CONFOPT_WRITEV
+        z = writev(fd, iov, n);
+#else
+        z = write(fd, iov->iov_base, iov->iov_len);
+#endif
+
+        if (z == -1) {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        /* skip the ranges that were fully written */
+        while (n > 0 && (size_t) z >= iov->iov_len) {
+            z -= iov->iov_len;
+            iov++;
+            n--;
+        }
+
+        /* and advance into the partially written one */
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + z;
+            iov->iov_len -= z;
+        }
+    }
+
+    return 0;
+}
+
+
+static int file_sync(int fd)
+/* flushes a file to disk, if the system can. Returns -1 on errors */
+{
+    int ret = 0;
+
+#ifdef CONFOPT_FDATASYNC
+    ret = fdatasync(fd);
+#endif
+#ifdef CONFOPT_FSYNC
+    ret = fsync(fd);
+#endif
+
+    return ret;
+}
+
+
+static void dir_sync(const char *fname)
+/* flushes the directory entries of the directory of fname */
+{
+#if defined(CONFOPT_FDATASYNC) || defined(CONFOPT_FSYNC)
+    char *dname = strdup(fname);
+    char *p;
+    int fd;
+
+    if ((p = strrchr(dname, '/')) != NULL)
+        p[p == dname ? 1 : 0] = '\0';
+    else
+        strcpy(dname, ".");
+
+    if ((fd = open(dname, O_RDONLY)) != -1) {
+        file_sync(fd);
+        close(fd);
+    }
+
+    free(dname);
+#endif
+}
+
+
+static int file_save(qw_block *b, const char *fname, int crlf, uint64_t *hash)
+/* saves a file, and the hash of its content if wanted. Returns
+   the number of bytes written, or -1 on errors */
 {
     FILE *f;
     int ret = 0;
+    char *rname = NULL;
+    char *tmp;
+
+#ifdef CONFOPT_REALPATH
+    /* if it's a symlink, the file it points to is the one replaced */
+    rname = realpath(fname, NULL);
+#endif
+
+    if (rname == NULL)
+        rname = strdup(fname);
 
-    if ((f = fopen(fname, "wb")) != NULL) {
-        int i = 0;
-        char c;
+    /* write to a temporary file and rename it later; the original
+       one can still be mapped by some document */
+    tmp = malloc(strlen(rname) + 8);
+    strcpy(tmp, rname);
+    strcat(tmp, ".qwtmp");
 
-        /* move to the beginning */
-        b = qw_block_first(b);
+    if ((f = fopen(tmp, "wb")) != NULL) {
+        static char eol[] = "\r\n";
+        struct iovec iov[QW_IOV_MAX];
+        struct stat st;
+        int n = 0;
+        int exists;
 
-        while (b != NULL && qw_block_get_str(b, i, &c, 1)) {
-            /* write CR if appropriate */
-            if (crlf && c == '\n')
-                fputc('\r', f);
+        /* write whole blocks, split at LFs only if CRs are to be added
+           or dropped (blocks still with the CR/LF data of the file) */
+        for (b = qw_block_first(b); b != NULL && ret != -1; b = b->next) {
+            char *p = b->data;
+            int z = b->raw ? b->raw : b->used;
 
-            fputc(c, f);
-            b = qw_block_move(b, i, &i, 1);
+            while (z > 0 && ret != -1) {
+                char *lf = crlf || b->raw ? memchr(p, '\n', z) : NULL;
+                int l = lf ? lf - p : z;
+                int t = l - (b->raw && lf && l && p[l - 1] == '\r');
+
+                if (hash != NULL) {
+                    *hash = qw_block_hash_str(*hash, p, t);
+
+                    if (lf)
+                        *hash = qw_block_hash_str(*hash, lf, 1);
+                }
+
+                if (t) {
+                    iov[n].iov_base = p;
+                    iov[n].iov_len  = t;
+                    n++;
+                }
+
+                if (lf) {
+                    iov[n].iov_base = eol + !crlf;
+                    iov[n].iov_len  = crlf ? 2 : 1;
+                    n++;
+                    l++;
+                }
+
+                p   += l;
+                z   -= l;
+                ret += t + (lf ? (crlf ? 2 : 1) : 0);
+
+                /* flush if full (keeping room for a CR/LF pair) */
+                if (n >= QW_IOV_MAX - 1) {
+                    if (file_writev(fileno(f), iov, n) == -1)
+                        ret = -1;
+
+                    n = 0;
+                }
+            }
         }
 
-        fclose(f);
+        if (ret != -1 && file_writev(fileno(f), iov, n) == -1)
+            ret = -1;
+
+        exists = stat(rname, &st) != -1;
+
+#ifdef CONFOPT_FCHOWN
+        /* keep the owner of the original file, if allowed to */
+        if (ret != -1 && exists && fchown(fileno(f), st.st_uid, st.st_gid) == -1)
+            fchown(fileno(f), -1, st.st_gid);
+#endif
+
+        /* the data must be on disk before it replaces the original */
+        if (ret != -1 && file_sync(fileno(f)) == -1)
+            ret = -1;
+
+        if (fclose(f) == EOF)
+            ret = -1;
+
+        /* keep the permissions of the original file */
+        if (ret != -1 && exists)
+            chmod(tmp, st.st_mode);
+
+        if (ret != -1 && rename(tmp, rname) == -1) {
+            int done = 0;
+
+            /* some systems can't rename over an existing file;
+               move the original aside until the new one is in place */
+            if (errno == EEXIST) {
+                char *bak = malloc(strlen(rname) + 8);
+
+                strcpy(bak, rname);
+                strcat(bak, ".qwbak");
+
+                if (rename(rname, bak) != -1) {
+                    if (rename(tmp, rname) != -1) {
+                        remove(bak);
+                        done = 1;
+                    }
+                    else
+                        rename(bak, rname);
+                }
+
+                free(bak);
+            }
+
+            if (!done)
+                ret = -1;
+        }
+
+        /* and so must be the rename */
+        if (ret != -1)
+            dir_sync(rname);
+
+        if (ret == -1)
+            remove(tmp);
     }
     else
         ret = -1;
 
+    free(tmp);
+    free(rname);
+
     return ret;
 }
 
 
+int qw_file_save(qw_block *b, const char *fname, int crlf)
+/* saves a file. Returns the number of bytes written, or -1 on errors */
+{
+    return file_save(b, fname, crlf, NULL);
+}
+
+
+/* The undo history is saved along the file in a sidecar file (.name.qwu),
+   keyed by the size, modification time and content hash of the file.
+   When the file is opened again, it's mapped but not read; only when
+   an undo goes past the start of the session the hash is checked and
+   the entries are loaded, pointing into the mapped data. */
+
+static char *sidecar_fname(const char *fname, const char *ext)
+/* returns the name of a sidecar file of a file */
+{
+    char *r = malloc(strlen(fname) + strlen(ext) + 2);
+    int n, l = 0;
+
+    /* a hidden file in the same directory */
+    for (n = 0; fname[n]; n++) {
+        if (fname[n] == '/' || fname[n] == '\\')
+            l = n + 1;
+    }
+
+    memcpy(r, fname, l);
+    r[l] = '.';
+    strcpy(&r[l + 1], &fname[l]);
+    strcat(r, ext);
+
+    return r;
+}
+
+
+static void undo_open(qw_doc *doc)
+/* maps the undo sidecar file, if it matches the file */
+{
+    struct stat st, ust;
+    struct undo_hdr h;
+    char *uname;
+    FILE *f;
+
+    if (!qw_doc_undo_file || stat(doc->fname, &st) == -1)
+        return;
+
+    uname = sidecar_fname(doc->fname, ".qwu");
+
+    if ((f = fopen(uname, "rb")) != NULL) {
+        if (fstat(fileno(f), &ust) != -1 && ust.st_size > (off_t) sizeof(h) &&
+            fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, "QWU1", 4) == 0 &&
+            h.fsize == st.st_size && h.mtime == st.st_mtime) {
+            int size = (int) ust.st_size;
+            char *data = NULL;
+            int mapped = 0;
+
+#ifdef CONFOPT_MMAP
+            data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+
+            if (data == MAP_FAILED)
+                data = NULL;
+            else
+                mapped = 1;
+#endif
+
+            if (data == NULL) {
+                /* no mapping available: read it all */
+                data = malloc(size);
+                rewind(f);
+
+                if (fread(data, size, 1, f) != 1) {
+                    free(data);
+                    data = NULL;
+                }
+            }
+
+            doc->undo        = data;
+            doc->undo_size   = size;
+            doc->undo_mapped = mapped;
+        }
+
+        fclose(f);
+    }
+
+    free(uname);
+}
+
+
+static void undo_close(qw_doc *doc)
+/* releases the undo history of the previous session */
+{
+    if (doc->undo_mapped) {
+#ifdef CONFOPT_MMAP
+        munmap(doc->undo, doc->undo_size);
+#endif
+    }
+    else
+        free(doc->undo);
+
+    doc->undo = NULL;
+}
+
+
+static int undo_append(qw_doc *doc, const char *uname, struct undo_hdr *h)
+/* appends the entries after the last save to the sidecar file written
+   by this session. Returns the number of entries in it, or -1 if it
+   can't (e.g. the entry last written was undone and replaced) */
+{
+    struct undo_hdr oh;
+    qw_journal *t;
+    FILE *f;
+    int n = -1;
+
+    for (t = doc->j; t != NULL && t->gen != doc->undo_gen; t = t->prev);
+
+    if (t == NULL || (f = fopen(uname, "r+b")) == NULL)
+        return -1;
+
+    if (fread(&oh, sizeof(oh), 1, f) == 1 && memcmp(oh.magic, "QWU1", 4) == 0 &&
+        fseek(f, 0, SEEK_END) == 0 && (n = qw_journal_save(t, doc->j, f)) != -1) {
+        h->count = oh.count + n;
+
+        /* the header goes last, so a failure leaves it stale */
+        rewind(f);
+        if (fwrite(h, sizeof(*h), 1, f) != 1)
+            n = -1;
+    }
+
+    if (fclose(f) == EOF)
+        n = -1;
+
+    return n == -1 ? -1 : h->count;
+}
+
+
+static void undo_save(qw_doc *doc, uint64_t hash)
+/* saves the undo history to the sidecar file; errors are ignored */
+{
+    struct stat st;
+    struct undo_hdr h;
+    char *uname, *tmp;
+    FILE *f;
+    int n;
+
+    if (!qw_doc_undo_file || stat(doc->fname, &st) == -1)
+        return;
+
+    uname = sidecar_fname(doc->fname, ".qwu");
+    tmp   = malloc(strlen(uname) + 8);
+    strcpy(tmp, uname);
+    strcat(tmp, ".qwtmp");
+
+    memcpy(h.magic, "QWU1", 4);
+    h.count = 0;
+    h.fsize = st.st_size;
+    h.mtime = st.st_mtime;
+    h.hash  = hash;
+
+    /* written before by this session? just add the new entries */
+    if (doc->undo_gen && undo_append(doc, uname, &h) > 0)
+        doc->undo_gen = doc->j->gen;
+    else
+    if ((f = fopen(tmp, "wb")) != NULL) {
+        n = fwrite(&h, sizeof(h), 1, f) == 1 ? 0 : -1;
+
+        /* the history of the previous session, if not loaded, goes first */
+        if (n != -1 && doc->undo != NULL && !doc->undo_loaded) {
+            struct undo_hdr oh;
+
+            memcpy(&oh, doc->undo, sizeof(oh));
+
+            if (fwrite(doc->undo + sizeof(oh), doc->undo_size - sizeof(oh), 1, f) == 1)
+                h.count += oh.count;
+            else
+                n = -1;
+        }
+
+        if (n != -1 && (n = qw_journal_save(qw_journal_first(doc->j), doc->j, f)) != -1) {
+            h.count += n;
+
+            rewind(f);
+            if (fwrite(&h, sizeof(h), 1, f) != 1)
+                n = -1;
+        }
+
+        if (fclose(f) == EOF)
+            n = -1;
+
+        /* as private as the file */
+        chmod(tmp, st.st_mode);
+
+        if (n == -1 || h.count == 0 || rename(tmp, uname) == -1) {
+            remove(tmp);
+
+            /* nothing to undo: the old one is stale */
+            if (n != -1 && h.count == 0)
+                remove(uname);
+
+            doc->undo_gen = 0;
+        }
+        else
+            doc->undo_gen = doc->j->gen;
+    }
+
+    free(tmp);
+    free(uname);
+}
+
+
+int qw_doc_history(qw_doc *doc)
+/* loads the undo history of the previous session before the start of
+   the journal. Returns 1 if loaded */
+{
+    struct undo_hdr h;
+    int r = 0;
+
+    if (doc->undo != NULL && !doc->undo_loaded && doc->j->prev == NULL) {
+        qw_block *b = qw_block_last(doc->b);
+
+        memcpy(&h, doc->undo, sizeof(h));
+
+        /* the content must be the one the history was saved for */
+        if (h.hash != qw_block_hash(doc->b))
+            undo_close(doc);
+        else
+        if (qw_journal_load(doc->j, doc->undo + sizeof(h), doc->undo_size - sizeof(h),
+                h.count, qw_block_rel_to_abs(b, b->used)) == -1) {
+            /* broken; it will never be good (unless this session
+               already wrote a new one) */
+            char *uname = sidecar_fname(doc->fname, ".qwu");
+
+            if (!doc->undo_gen)
+                remove(uname);
+
+            free(uname);
+            undo_close(doc);
+        }
+        else {
+            doc->undo_loaded = 1;
+            r = 1;
+        }
+    }
+
+    return r;
+}
+
+
+/* Every change applied to the journal is appended to a write-ahead log
+   (.name.qwl), keyed by the size and time of the file on disk. Writes
+   are grouped and synced from the idle loop at most every
+   QW_WAL_PERIOD, so typing is never waiting for the disk. The log is
+   removed on save or close; if one is found on open, it can be
+   replayed on top of the file. */
+
+static long wal_now(void)
+/* returns the current time in milliseconds */
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+
+static void wal_key(qw_doc *doc, struct wal_hdr *h)
+/* fills a log header with the key of the file on disk */
+{
+    struct stat st;
+
+    memcpy(h->magic, "QWL1", 4);
+    h->pad = 0;
+
+    if (stat(doc->fname, &st) != -1) {
+        h->fsize = st.st_size;
+        h->mtime = st.st_mtime;
+    }
+    else {
+        h->fsize = -1;
+        h->mtime = 0;
+    }
+}
+
+
+static void wal_check(qw_doc *doc)
+/* checks if there is a log to recover for this file */
+{
+    struct wal_hdr h, k;
+    char *wname = sidecar_fname(doc->fname, ".qwl");
+    FILE *f;
+
+    if ((f = fopen(wname, "rb")) != NULL) {
+        wal_key(doc, &k);
+
+        if (fread(&h, sizeof(h), 1, f) == 1 && memcmp(&h, &k, sizeof(h)) == 0)
+            doc->recover = 1;
+
+        fclose(f);
+    }
+
+    free(wname);
+}
+
+
+static void wal_reset(qw_doc *doc)
+/* drops the log; its changes are on disk or discarded */
+{
+    qw_wal *w = &doc->wal;
+
+    if (w->fd != -1 || doc->recover) {
+        char *wname = sidecar_fname(doc->fname, ".qwl");
+
+        if (w->fd != -1)
+            close(w->fd);
+
+        remove(wname);
+        free(wname);
+    }
+
+    w->fd   = -1;
+    w->used = 0;
+
+    doc->recover = 0;
+}
+
+
+int qw_doc_sync(qw_doc *doc)
+/* writes and syncs the pending changes to the log, if due.
+   Returns 1 if there are still changes pending */
+{
+    qw_wal *w = &doc->wal;
+    long now;
+
+    if (w->used == 0 || (now = wal_now()) - w->stamp < QW_WAL_PERIOD)
+        return w->used > 0;
+
+    if (w->fd == -1) {
+        /* first change since open or save: start the log */
+        char *wname = sidecar_fname(doc->fname, ".qwl");
+        struct wal_hdr h;
+
+        wal_key(doc, &h);
+
+        /* a log not recovered is lost now */
+        doc->recover = 0;
+
+        if ((w->fd = open(wname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) != -1 &&
+            write(w->fd, &h, sizeof(h)) != sizeof(h)) {
+            close(w->fd);
+            w->fd = -1;
+        }
+
+        free(wname);
+    }
+
+    if (w->fd != -1) {
+        struct iovec iov;
+
+        iov.iov_base = w->buf;
+        iov.iov_len  = w->used;
+
+        if (file_writev(w->fd, &iov, 1) != -1)
+            file_sync(w->fd);
+    }
+
+    /* on errors, there is nothing better to do than forget them */
+    w->used  = 0;
+    w->stamp = now;
+
+    return 0;
+}
+
+
+int qw_doc_recover(qw_doc *doc, int replay)
+/* replays the log left by a crash on top of the document, or
+   discards it. Returns the number of recovered changes */
+{
+    char *wname = sidecar_fname(doc->fname, ".qwl");
+    qw_chain *c = doc->b->chain;
+    int n = 0;
+    FILE *f;
+
+    /* only if nothing was changed in the meantime */
+    if (replay && doc->recover && doc->j->prev == NULL &&
+        doc->j->next == NULL && (f = fopen(wname, "rb")) != NULL) {
+        struct wal_hdr h;
+        long o = sizeof(h);
+        int32_t r[3];
+        char *data = NULL;
+        int size = 0;
+
+        /* don't log the changes being replayed */
+        c->wal = NULL;
+
+        fseek(f, sizeof(h), SEEK_SET);
+
+        /* replay up to the end or a truncated record */
+        while (fread(r, sizeof(r), 1, f) == 1) {
+            qw_block *b;
+            int i, total;
+
+            b     = qw_block_last(doc->b);
+            total = qw_block_rel_to_abs(b, b->used);
+
+            if (r[0] < 0 || r[0] > 1 || r[1] < 0 || r[2] <= 0 || r[1] > total ||
+                (r[0] == 0 && r[1] + r[2] > total))
+                break;
+
+            if (r[0]) {
+                /* insertions come with their data */
+                if (r[2] > size)
+                    data = realloc(data, size = r[2]);
+
+                if (fread(data, r[2], 1, f) != 1)
+                    break;
+            }
+
+            b = qw_block_abs_to_rel(doc->b, r[1], &i);
+            doc->j = qw_journal_new(r[0], b, i, data, r[2], doc->j);
+            doc->b = qw_journal_apply_at(b, i, doc->j, 1);
+
+            o = ftell(f);
+            n++;
+        }
+
+        free(data);
+        fclose(f);
+
+        c->wal = &doc->wal;
+
+        /* keep logging after the last good record */
+        if ((doc->wal.fd = open(wname, O_WRONLY)) != -1) {
+            if (ftruncate(doc->wal.fd, o) == -1 || lseek(doc->wal.fd, o, SEEK_SET) == -1) {
+                close(doc->wal.fd);
+                doc->wal.fd = -1;
+            }
+        }
+
+        doc->recover = 0;
+        doc->cpos    = doc->j->apos;
+    }
+    else
+        wal_reset(doc);
+
+    free(wname);
+
+    return n;
+}
+
+
+int qw_doc_save(qw_doc *doc)
+/* saves a document to its file. Returns -1 on errors */
+{
+    struct timeval t0, t1;
+    uint64_t hash = QW_BLOCK_HASH_INIT;
+    int size;
+
+    gettimeofday(&t0, NULL);
+
+    /* the hash of the content keys the undo sidecar */
+    if ((size = file_save(doc->b, doc->fname, doc->crlf, &hash)) != -1) {
+        double t;
+
+        gettimeofday(&t1, NULL);
+
+        t = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1000000.0;
+
+        /* store the achieved throughput */
+        doc->save_bps = t > 0.0 ? size / t : 0.0;
+
+        /* no longer new */
+        doc->new_file = 0;
+
+        undo_save(doc, hash);
+
+        /* the changes are on disk; start logging the next ones */
+        wal_reset(doc);
+        doc->b->chain->wal = &doc->wal;
+    }
+
+    return size == -1 ? -1 : 0;
+}
+
+
+/* The block and relative position of the cursor are kept along with
+   its absolute position, so moving around it doesn't need to walk the
+   index tree. The chain forgets the block on changes at or before the
+   cursor, or when the block goes away; they are then taken again, as
+   when cpos is set from elsewhere. */
+
+qw_block *qw_doc_cursor(qw_doc *doc, int *i)
+/* returns the block and relative position of the cursor */
+{
+    qw_cursor *c = &doc->cur;
+
+    if (c->b == NULL || c->apos != doc->cpos) {
+        c->b    = qw_block_abs_to_rel(doc->b, doc->cpos, &c->i);
+        c->apos = doc->cpos;
+        c->line = -1;
+    }
+
+    *i = c->i;
+
+    return c->b;
+}
+
+
+void qw_doc_set_cursor(qw_doc *doc, qw_block *b, int i, int apos)
+/* moves the cursor to the relative position i of b, known to be
+   at the absolute position apos (-1: unknown). If b is NULL, only
+   apos is known, and the block is taken when needed */
+{
+    qw_cursor *c = &doc->cur;
+
+    if (b == NULL) {
+        if (apos != c->apos)
+            c->b = NULL;
+    }
+    else {
+        if (apos == -1) {
+            if (b == c->b && c->apos == doc->cpos)
+                /* moved inside the same block */
+                apos = c->apos + i - c->i;
+            else
+                apos = qw_block_rel_to_abs(b, i);
+        }
+
+        doc->b = b;
+
+        /* line and column are kept only if not moved */
+        if (b != c->b || i != c->i || apos != c->apos)
+            c->line = -1;
+
+        c->b    = b;
+        c->i    = i;
+        c->apos = apos;
+    }
+
+    doc->cpos = apos;
+}
+
+
+int qw_doc_compact(qw_doc *doc, int steps)
+/* runs a step of the compaction of the document blocks.
+   Returns 1 if there is still work to do */
+{
+    qw_chain *c = doc->b->chain;
+
+    if (!c->compacting && !c->dirty)
+        return 0;
+
+    /* starting a new pass? */
+    if (!c->compacting)
+        doc->util_before = qw_block_util(doc->b);
+
+    doc->b = qw_block_compact(doc->b, steps);
+
+    /* pass finished? */
+    if (!c->compacting)
+        doc->util_after = qw_block_util(doc->b);
+
+    return c->compacting || c->dirty;
+}
+
+
+int qw_doc_lex(qw_doc *doc, int size)
+/* lexes some more of the document for the syntax highlight.
+   Returns 1 if there is still work to do */
+{
+    return qw_synhi_lex_ahead(doc->sh, doc->b, size);
+}
+
+
 qw_doc *qw_doc_new(qw_doc *d, const char *fname)
-/* creates a new document */
+/* creates a new document. Returns NULL if the file is too big */
 {
     qw_doc *doc;
 
@@ -85,16 +952,38 @@ qw_doc *qw_doc_new(qw_doc *d, const char *fname)
     if (fname != NULL) {
         doc->fname = strdup(fname);
 
-        if ((doc->b = qw_file_load(fname, &doc->crlf)) == NULL)
+        if ((doc->b = qw_file_load(fname, &doc->crlf)) != NULL)
+            undo_open(doc);
+        else
+        if (errno == EFBIG) {
+            /* too big; not to be overwritten as a new file */
+            free(doc->fname);
+            free(doc);
+            return NULL;
+        }
+        else
             doc->new_file = 1;
     }
 
     if (doc->b == NULL)
         doc->b = qw_block_new(NULL, NULL);
 
+    /* the chain keeps the block of the cursor valid */
+    doc->b->chain->cur = &doc->cur;
+
+    doc->wal.fd = -1;
+
+    /* documents with a name log their changes */
+    if (fname != NULL) {
+        doc->b->chain->wal = &doc->wal;
+        wal_check(doc);
+    }
+
     /* no selection mark */
     doc->mark_s = doc->mark_e = -1;
 
+    doc->util_before = doc->util_after = qw_block_util(doc->b);
+
     /* first (dummy) journal entry */
     doc->j = qw_journal_new(0, doc->b, 0, NULL, 0, NULL);
 
@@ -121,10 +1010,20 @@ qw_doc *qw_doc_destroy(qw_doc *doc)
 {
     qw_doc *next;
 
+    /* closed normally: the log is no longer needed */
+    if (doc->fname != NULL)
+        wal_reset(doc);
+
+    free(doc->wal.buf);
+
     /* destroy everything */
     free(doc->fname);
+
+    /* the journal is allocated from the chain, so it goes with it */
     qw_block_destroy(qw_block_first(doc->b));
-    qw_journal_destroy(qw_journal_first(doc->j));
+
+    /* the loaded undo history pointed here */
+    undo_close(doc);
 
     /* if next if this doc, then it's the only one in the chain */
     if (doc->next == doc)
@@ -151,6 +1050,9 @@ void qw_doc_dump(qw_doc *d, FILE *f)
     fprintf(f, "vpos: %d\n", d->vpos);
     fprintf(f, "cpos: %d\n", d->cpos);
     fprintf(f, "crlf: %d\n", d->crlf);
+    fprintf(f, "save: %.0f bytes/s\n", d->save_bps);
+    fprintf(f, "util: %d%% -> %d%%\n", d->util_before, d->util_after);
+    fprintf(f, "undo: %ld bytes in memory\n", d->b->chain->undo_mem);
     fprintf(f, "blocks:\n\n");
 
     qw_block_dump(d->b, f);
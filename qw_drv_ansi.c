@@ -5,20 +5,50 @@
 #include "qw.h"
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <termios.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <string.h>
 #include <stdlib.h>
 #include <wchar.h>
-#include <sys/time.h>
 #include <pwd.h>
+#include <errno.h>
 
 static int sigwinch_received = 0;
+static int sigwinch_pipe[2] = { -1, -1 };
+
+/* size of the input buffer */
+#define QW_ANSI_INPUT 1024
+
+/* time to wait for the rest of an incomplete key (milliseconds) */
+#define QW_ANSI_KEY_WAIT 25
+
+/* time to wait for input when there is background work (milliseconds) */
+#define QW_ANSI_IDLE_WAIT 10
+
+struct ansi_row {
+    char *data;                     /* bytes */
+    char *attr;                     /* attributes */
+    int size;                       /* number of bytes (-1: unknown) */
+    int alloc;                      /* allocated size */
+};
 
 struct ansi_drv_data {
     char attr[QW_ATTR_COUNT][64];   /* ANSI code for setting the attribute */
+    struct ansi_row *shadow;        /* what the screen is showing */
+    int rows;                       /* number of rows in shadow */
+    int tx, ty;                     /* terminal cursor (-1: unknown) */
+    int tattr;                      /* terminal attribute (-1: unknown) */
+    char *out;                      /* output not yet written */
+    int used;                       /* used bytes in out */
+    int size;                       /* allocated size of out */
+    int sync;                       /* terminal has synchronized output */
+    char in[QW_ANSI_INPUT + 1];     /* input not yet processed */
+    int in_used;                    /* used bytes in in */
+    int gone;                       /* the terminal is gone */
 };
 
 
@@ -46,95 +76,299 @@ static void ansi_raw_tty(int start)
 }
 
 
-static int ansi_something_waiting(void)
-/* returns yes if there is something waiting on fd */
+/* Input is read in bulk when poll() says there is some, and is then
+   split into keys. The SIGWINCH handler writes into a pipe that is
+   also polled, so a resize wakes the main loop up. */
+
+static int ansi_input(qw_core *core, int timeout)
+/* waits up to timeout milliseconds (-1: forever) for input or a
+   resize, and reads what there is. Returns the bytes read */
 {
-    fd_set ids;
-    struct timeval tv;
+    struct ansi_drv_data *dd = core->drv_data;
+    struct pollfd pfd[2];
+    int n, z = 0;
+
+    pfd[0].fd     = 0;
+    pfd[0].events = POLLIN;
+    pfd[1].fd     = sigwinch_pipe[0];
+    pfd[1].events = POLLIN;
+
+    if (poll(pfd, 2, timeout) <= 0)
+        return 0;
+
+    if (pfd[1].revents & POLLIN) {
+        char junk[64];
+
+        /* just drain it; the flag says it all */
+        while (read(sigwinch_pipe[0], junk, sizeof(junk)) > 0);
+    }
+
+    if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR) && dd->in_used < QW_ANSI_INPUT) {
+        z = read(0, &dd->in[dd->in_used], QW_ANSI_INPUT - dd->in_used);
 
-    /* reset */
-    FD_ZERO(&ids);
+        if (z <= 0) {
+            /* the terminal is gone */
+            if (z == 0 || errno != EINTR) {
+                dd->gone      = 1;
+                core->running = 0;
+            }
 
-    /* add stdin to set */
-    FD_SET(0, &ids);
+            return 0;
+        }
 
-    tv.tv_sec  = 0;
-    tv.tv_usec = 10000;
+        /* carriage returns are always newlines */
+        for (n = dd->in_used; n < dd->in_used + z; n++) {
+            if (dd->in[n] == '\r')
+                dd->in[n] = '\n';
+        }
 
-    return select(1, &ids, NULL, NULL, &tv) > 0;
+        dd->in_used += z;
+    }
+
+    return z;
+}
+
+
+static int ansi_is_ctrl(int c)
+/* tests if a byte is a control key (not part of typed text) */
+{
+    return (c < 0x20 && c != '\n' && c != '\t') || c == 0x7f;
 }
 
 
-char *ansi_read_string(int *size)
-/* reads an ansi string, waiting in the first char */
+static int ansi_token(const char *buf, int z, int force)
+/* returns the size of the first key in buf, or 0 if it's not
+   complete (if force is set, takes whatever there is) */
+{
+    const unsigned char *in = (const unsigned char *)buf;
+    int n;
+
+    if (z == 0)
+        return 0;
+
+    if (force || z == QW_ANSI_INPUT)
+        force = z;
+
+    if (in[0] == '\033') {
+        if (z == 1)
+            return force ? 1 : 0;
+
+        if (in[1] == '[') {
+            /* CSI: parameters and intermediates up to a final byte */
+            for (n = 2; n < z && in[n] >= 0x20 && in[n] <= 0x3f; n++);
+
+            return n < z ? n + 1 : force;
+        }
+
+        if (in[1] == 'O')
+            return z >= 3 ? 3 : force;
+
+        /* ESC ESC is two keys; anything else is a two byte sequence */
+        return in[1] == '\033' ? 1 : 2;
+    }
+
+    if (ansi_is_ctrl(in[0]))
+        return 1;
+
+    /* a run of text (typed fast or pasted) */
+    for (n = 0; n < z && in[n] != '\033' && !ansi_is_ctrl(in[n]); n++);
+
+    if (n == z && !force) {
+        /* don't split an utf8 char */
+        int l = n - 1, s = 1;
+
+        while (l > 0 && (in[l] & 0xc0) == 0x80)
+            l--;
+
+        if ((in[l] & 0xe0) == 0xc0)
+            s = 2;
+        else
+        if ((in[l] & 0xf0) == 0xe0)
+            s = 3;
+        else
+        if ((in[l] & 0xf8) == 0xf0)
+            s = 4;
+
+        if (l + s > n)
+            n = l;
+    }
+
+    return n;
+}
+
+
+static void ansi_consume(struct ansi_drv_data *dd, int z)
+/* drops z bytes from the start of the input buffer */
+{
+    dd->in_used -= z;
+    memmove(dd->in, &dd->in[z], dd->in_used);
+}
+
+
+/* Everything is rendered into an output buffer that is sent with a
+   single write() (inside a synchronized output block, if the terminal
+   supports it, so that it doesn't paint half frames). */
+
+static void ansi_grow(struct ansi_drv_data *dd, int size)
+/* makes room for size more bytes in the output buffer */
+{
+    /* leave room for the start of a synchronized update */
+    if (dd->used == 0 && dd->sync)
+        size += 8;
+
+    if (dd->used + size > dd->size) {
+        dd->size = (dd->used + size) * 2;
+        dd->out  = realloc(dd->out, dd->size);
+    }
+
+    /* begin synchronized update */
+    if (dd->used == 0 && dd->sync) {
+        memcpy(dd->out, "\033[?2026h", 8);
+        dd->used = 8;
+    }
+}
+
+
+static void ansi_write(struct ansi_drv_data *dd, const char *data, int size)
+/* adds bytes to the output buffer */
+{
+    ansi_grow(dd, size);
+    memcpy(&dd->out[dd->used], data, size);
+    dd->used += size;
+}
+
+
+static void ansi_printf(struct ansi_drv_data *dd, const char *fmt, ...)
+/* adds formatted output to the output buffer */
+{
+    va_list ap;
+    int z;
+
+    va_start(ap, fmt);
+    z = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    ansi_grow(dd, z + 1);
+
+    va_start(ap, fmt);
+    vsnprintf(&dd->out[dd->used], z + 1, fmt, ap);
+    va_end(ap);
+
+    dd->used += z;
+}
+
+
+static int ansi_refresh(struct ansi_drv_data *dd)
+/* sends the output buffer. Returns the number of bytes */
 {
-    char *buf = NULL;
-    int z = 0;
     int n = 0;
 
-    while (ansi_something_waiting()) {
-        char c;
+    if (dd->used && dd->sync)
+        ansi_write(dd, "\033[?2026l", 8);
 
-        if (read(0, &c, sizeof(c)) == -1)
-            break;
-        else {
-            if (n == z) {
-                z += 32;
-                buf = realloc(buf, z + 1);
-            }
+    while (n < dd->used) {
+        int z = write(1, &dd->out[n], dd->used - n);
 
-            /* carriage returns are always newlines */
-            if (c == '\r')
-                c = '\n';
+        if (z == -1) {
+            if (errno == EINTR)
+                continue;
 
-            buf[n++] = c;
+            break;
         }
+
+        n += z;
     }
 
-    /* null terminate for strcmp() when searching */
-    if (buf != NULL)
-        buf[n] = '\0';
+    dd->used = 0;
 
-    *size = n;
+    return n;
+}
 
-    return buf;
+
+/* The rows on the screen are kept in a shadow copy, so a paint only
+   sends the spans of each row that changed, using the shortest cursor
+   motions available. */
+
+static void ansi_shadow_reset(struct ansi_drv_data *dd, int y)
+/* forgets what row y (or all, if -1) is showing */
+{
+    int n;
+
+    for (n = 0; n < dd->rows; n++) {
+        if (y == -1 || y == n)
+            dd->shadow[n].size = -1;
+    }
 }
 
 
-static void ansi_get_tty_size(qw_core *core)
-/* asks the tty for its size */
+static void ansi_get_tty_size(qw_core *core, int probe)
+/* asks the tty for its size (and, if probe is set, if it
+   supports synchronized output) */
 {
-    char *buffer;
-    int size;
+    struct ansi_drv_data *dd = core->drv_data;
     int retries = 3;
+    int found = 0;
+
+    /* ask for the synchronized output mode; terminals that
+       don't know it just don't answer */
+    if (probe)
+        ansi_printf(dd, "\033[?2026$p");
 
     /* magic line: save cursor position, move to stupid position,
        ask for current position and restore cursor position */
-    printf("\0337\033[r\033[999;999H\033[6n\0338");
-    fflush(stdout);
+    ansi_printf(dd, "\0337\033[r\033[999;999H\033[6n\0338");
+    ansi_refresh(dd);
 
     /* retry, as sometimes the answer is delayed from the signal */
-    while (retries) {
-        buffer = ansi_read_string(&size);
+    while (retries && !found) {
+        int n = 0;
 
-        if (size) {
-            sscanf(buffer, "\033[%d;%dR", &core->height, &core->width);
-            break;
+        ansi_input(core, 100);
+
+        /* pick the answers (they come in order) from the input,
+           leaving the keys that may be mixed with them */
+        while (n < dd->in_used) {
+            int z, m;
+            char c;
+
+            if (dd->in[n] != '\033') {
+                n++;
+                continue;
+            }
+
+            /* incomplete? wait for the rest */
+            if ((z = ansi_token(&dd->in[n], dd->in_used - n, 0)) == 0)
+                break;
+
+            dd->in[dd->in_used] = '\0';
+
+            if (sscanf(&dd->in[n], "\033[?2026;%d$%c", &m, &c) == 2 && c == 'y')
+                dd->sync = (m == 1 || m == 2);
+            else
+            if (sscanf(&dd->in[n], "\033[%d;%dR", &core->height, &core->width) == 2)
+                found = 1;
+            else {
+                n += z;
+                continue;
+            }
+
+            dd->in_used -= z;
+            memmove(&dd->in[n], &dd->in[n + z], dd->in_used - n);
         }
 
-        usleep(100);
         retries--;
     }
 
     /* out of retries? assume most common size */
-    if (retries == 0) {
+    if (!found) {
         core->width  = 80;
         core->height = 25;
     }
 
-    free(buffer);
-
     sigwinch_received = 0;
+
+    /* the screen must be painted again */
+    ansi_shadow_reset(core->drv_data, -1);
 }
 
 
@@ -142,59 +376,61 @@ static void ansi_sigwinch(int s)
 /* SIGWINCH signal handler */
 {
     struct sigaction sa;
+    int e = errno;
 
     sigwinch_received = 1;
 
+    /* wake the main loop up (if the pipe is full, it's already awake) */
+    if (sigwinch_pipe[1] != -1) {
+        ssize_t r = write(sigwinch_pipe[1], "", 1);
+        (void) r;
+    }
+
     /* (re)attach signal */
     memset(&sa, '\0', sizeof(sa));
     sa.sa_handler = ansi_sigwinch;
     sigaction(SIGWINCH, &sa, NULL);
+
+    errno = e;
 }
 
 
-static void ansi_gotoxy(int x, int y)
+static void ansi_gotoxy(struct ansi_drv_data *dd, int x, int y)
 /* positions the cursor */
 {
-    printf("\033[%d;%dH", y + 1, x + 1);
+    ansi_printf(dd, "\033[%d;%dH", y + 1, x + 1);
 }
 
 #if 0
-static void ansi_clrscr(void)
+static void ansi_clrscr(struct ansi_drv_data *dd)
 /* clears the screen */
 {
-    printf("\033[2J");
+    ansi_printf(dd, "\033[2J");
 }
 #endif
 
-static void ansi_clreol(void)
+static void ansi_clreol(struct ansi_drv_data *dd)
 /* clear to end of line */
 {
-    printf("\033[K");
+    ansi_printf(dd, "\033[K");
 }
 
 
-static void ansi_enter_alt_screen(void)
+static void ansi_enter_alt_screen(struct ansi_drv_data *dd)
 /* enter alternate screen */
 {
-    printf("\033[?1049h");
+    ansi_printf(dd, "\033[?1049h");
 }
 
 
-static void ansi_leave_alt_screen(void)
+static void ansi_leave_alt_screen(struct ansi_drv_data *dd)
 /* leave alternate screen */
 {
     /* set default attribute */
-    printf("\033[0;39;49m\n");
+    ansi_printf(dd, "\033[0;39;49m\n");
 
     /* leave alternate screen */
-    printf("\033[?1049l\n");
-}
-
-
-static void ansi_refresh(void)
-/* force redraw */
-{
-    fflush(stdout);
+    ansi_printf(dd, "\033[?1049l\n");
 }
 
 
@@ -298,6 +534,108 @@ int qw_drv_conf_font(qw_core *core, const char *font_face, const char *font_size
 }
 
 
+static void ansi_moveto(struct ansi_drv_data *dd, int x, int y)
+/* moves the terminal cursor, as cheaply as possible */
+{
+    if (y == dd->ty && x == dd->tx)
+        return;
+
+    if (y == dd->ty + 1 && x == 0 && dd->ty != -1)
+        ansi_printf(dd, "\r\n");
+    else
+    if (y == dd->ty && x == 0)
+        ansi_printf(dd, "\r");
+    else
+    if (y == dd->ty && x > dd->tx && dd->tx != -1)
+        ansi_printf(dd, "\033[%dC", x - dd->tx);
+    else
+        ansi_gotoxy(dd, x, y);
+
+    dd->tx = x;
+    dd->ty = y;
+}
+
+
+static void ansi_set_attr(struct ansi_drv_data *dd, qw_attr attr)
+/* sets the terminal attribute, if different */
+{
+    if (dd->tattr != (int) attr) {
+        ansi_printf(dd, "%s", dd->attr[attr]);
+        dd->tattr = attr;
+    }
+}
+
+
+static void ansi_paint_row(qw_core *core, int y, const char *data,
+                           const char *attr, int size)
+/* paints the changed span of a row */
+{
+    struct ansi_drv_data *dd = core->drv_data;
+    struct ansi_row *r = &dd->shadow[y];
+    int p = 0, q = 0, n, e, ow = 0, nw;
+
+    if (r->size == size && memcmp(r->data, data, size) == 0 &&
+        memcmp(r->attr, attr, size) == 0)
+        return;
+
+    if (r->size != -1) {
+        int m = r->size < size ? r->size : size;
+
+        /* common start, from a char boundary */
+        while (p < m && r->data[p] == data[p] && r->attr[p] == attr[p])
+            p++;
+        while (p > 0 && (data[p] & 0xc0) == 0x80)
+            p--;
+
+        /* common end, also from a char boundary */
+        while (q < m - p && r->data[r->size - q - 1] == data[size - q - 1] &&
+               r->attr[r->size - q - 1] == attr[size - q - 1])
+            q++;
+        while (q > 0 && (data[size - q] & 0xc0) == 0x80)
+            q--;
+
+        /* it's only kept if the changed span keeps its width */
+        if (q && qw_utf8_str_width(&r->data[p], r->size - q - p) !=
+                 qw_utf8_str_width(&data[p], size - q - p))
+            q = 0;
+
+        ow = qw_utf8_str_width(r->data, r->size);
+    }
+
+    ansi_moveto(dd, qw_utf8_str_width(data, p), y);
+
+    /* write the changed span in runs of the same attribute */
+    for (n = p; n < size - q; n = e) {
+        for (e = n; e < size - q && attr[e] == attr[n]; e++);
+
+        ansi_set_attr(dd, (qw_attr) attr[n]);
+        ansi_write(dd, &data[n], e - n);
+    }
+
+    nw = qw_utf8_str_width(data, size - q);
+
+    /* clear what the old row had beyond the new one */
+    if (q == 0 && (r->size == -1 || ow > nw)) {
+        ansi_set_attr(dd, QW_ATTR_NORMAL);
+        ansi_clreol(dd);
+    }
+
+    /* wrapping (or not) at the last column is not reliable */
+    dd->tx = nw < core->width ? nw : -1;
+
+    /* store what is shown now */
+    if (r->alloc < size) {
+        r->alloc = size;
+        r->data  = realloc(r->data, size);
+        r->attr  = realloc(r->attr, size);
+    }
+
+    memcpy(r->data, data, size);
+    memcpy(r->attr, attr, size);
+    r->size = size;
+}
+
+
 static void ansi_paint(qw_core *core)
 /* dumps the current document to the screen */
 {
@@ -313,50 +651,41 @@ static void ansi_paint(qw_core *core)
 
     view = &core->view;
 
-    for (h = 0; i < view->size && h < core->height; h++) {
-        qw_attr attr = QW_ATTR_NONE;
-
-        /* move to start of line */
-        ansi_gotoxy(0, h);
+    /* the terminal size changed? start anew */
+    if (dd->rows != core->height) {
+        dd->shadow = realloc(dd->shadow, core->height * sizeof(struct ansi_row));
 
-        while (i < view->size) {
-            /* different attribute? */
-            if (attr != (qw_attr) view->attr[i]) {
-                /* store for later */
-                attr = (qw_attr) view->attr[i];
+        for (h = dd->rows; h < core->height; h++)
+            memset(&dd->shadow[h], '\0', sizeof(struct ansi_row));
 
-                printf("%s", dd->attr[attr]);
-            }
+        dd->rows = core->height;
+        ansi_shadow_reset(dd, -1);
+    }
 
-            if (view->data[i] == '\n' || view->data[i] == '\r') {
-                i++;
-                break;
-            }
+    /* others may have moved the cursor or changed the attribute */
+    dd->tx = dd->ty = dd->tattr = -1;
 
-            /* write the byte */
-            fwrite(&view->data[i], 1, 1, stdout);
+    for (h = 0; h < core->height; h++) {
+        int s = i;
 
+        /* find the end of the row */
+        while (i < view->size && view->data[i] != '\n' && view->data[i] != '\r')
             i++;
-        }
 
-        printf("%s", dd->attr[QW_ATTR_NORMAL]);
-        ansi_clreol();
-    }
+        ansi_paint_row(core, h, &view->data[s], &view->attr[s], i - s);
 
-    /* clear the rest of lines */
-    for (; h < core->height; h++) {
-        ansi_gotoxy(0, h);
-        ansi_clreol();
+        if (i < view->size)
+            i++;
     }
 
     /* finally move cursor to its position */
-    ansi_gotoxy(cx, cy);
+    ansi_moveto(dd, cx, cy);
 
     /* set title */
-    printf("\033]0;%s\007", qw_core_status_line(core, buf, sizeof(buf)));
+    ansi_printf(dd, "\033]0;%s\007", qw_core_status_line(core, buf, sizeof(buf)));
 
-    /* force paint */
-    ansi_refresh();
+    /* send the frame at once */
+    core->frame_bytes = ansi_refresh(dd);
 
     core->refresh = 0;
 }
@@ -451,19 +780,42 @@ static void ansi_key_optimize(void)
 }
 
 
-static qw_key ansi_get_key(qw_core *core)
-/* gets a key */
+static qw_key ansi_get_key(qw_core *core, int timeout)
+/* gets a key, waiting up to timeout milliseconds (-1: forever) */
 {
-    char *str;
-    int size;
+    struct ansi_drv_data *dd = core->drv_data;
     qw_key key = QW_KEY_NONE;
 
-    /* reads from stdin */
-    str = ansi_read_string(&size);
+    while (key == QW_KEY_NONE && !dd->gone) {
+        struct ansi_key kp, *kr;
+        char *str;
+        int z;
+
+        /* if a SIGWINCH was received, get size and force refresh */
+        if (sigwinch_received) {
+            ansi_get_tty_size(core, 0);
+            core->refresh++;
+            break;
+        }
+
+        if ((z = ansi_token(dd->in, dd->in_used, 0)) == 0) {
+            /* nothing or not complete: read more */
+            if (ansi_input(core, dd->in_used ? QW_ANSI_KEY_WAIT : timeout) > 0)
+                continue;
+
+            /* no more is coming */
+            if ((z = ansi_token(dd->in, dd->in_used, 1)) == 0)
+                break;
+        }
+
+        str = malloc(z + 1);
+        memcpy(str, dd->in, z);
+        str[z] = '\0';
+
+        ansi_consume(dd, z);
 
-    if (str != NULL) {
-        struct ansi_key kp = { str, QW_KEY_NONE };
-        struct ansi_key *kr;
+        kp.ansi_str = str;
+        kp.key      = QW_KEY_NONE;
 
         /* finds this string in the table */
         kr = bsearch(&kp, ansi_keys,
@@ -482,63 +834,43 @@ static qw_key ansi_get_key(qw_core *core)
 
             /* store the read string in the payload */
             core->payload = str;
-            core->pl_size = size;
+            core->pl_size = z;
 
             /* detach to avoid freeing */
             str = NULL;
         }
-    }
 
-    free(str);
-
-    /* if a SIGWINCH was received, get size and force refresh */
-    if (sigwinch_received) {
-        ansi_get_tty_size(core);
-        core->refresh++;
+        free(str);
     }
 
     return key;
 }
 
 
-static int timeval_diff(struct timeval *tn, struct timeval *tp)
-/* returns the different between two timevals in milliseconds */
-{
-    return ((tn->tv_sec  - tp->tv_sec) * 1000) +
-           ((tn->tv_usec - tp->tv_usec) / 1000);
-}
-
-
-#define PAINT_PERIOD 100
-
 static void ansi_main_loop(qw_core *core)
 /* ansi driver main loop */
 {
-    struct timeval tp;
-
-    gettimeofday(&tp, NULL);
+    struct ansi_drv_data *dd = core->drv_data;
 
     while (core->running) {
         qw_key key;
-        struct timeval tn;
 
-        /* get a (possible) key */
-        key = ansi_get_key(core);
-
-        /* process it */
-        if (key != QW_KEY_NONE)
+        /* process all the keys already typed */
+        while ((key = ansi_get_key(core, 0)) != QW_KEY_NONE)
             qw_core_key(core, key);
 
-        gettimeofday(&tn, NULL);
+        /* and show the result right away */
+        if (core->running && core->refresh)
+            ansi_paint(core);
 
-        /* has the paint period pass over? */
-        if (timeval_diff(&tn, &tp) >= PAINT_PERIOD) {
-            /* if a repaint is needed, do it */
-            if (core->running && core->refresh)
-                ansi_paint(core);
+        /* do background work, then sleep until there is input
+           (or just a bit, if there is more work to do); keys left
+           unread by a resize are not to be waited for */
+        if (core->running && !core->refresh) {
+            int more = qw_core_idle(core);
 
-            /* set past time as current time */
-            tp = tn;
+            if (!core->refresh && dd->in_used == 0)
+                ansi_input(core, more ? QW_ANSI_IDLE_WAIT : -1);
         }
     }
 }
@@ -547,30 +879,38 @@ static void ansi_main_loop(qw_core *core)
 void qw_drv_alert(qw_core *core, const char *prompt)
 /* shows an alert */
 {
+    struct ansi_drv_data *dd = core->drv_data;
     qw_key key;
 
-    ansi_gotoxy(0, core->height - 1);
-    printf("%s [ENTER]", prompt);
-    ansi_clreol();
-    ansi_refresh();
+    ansi_shadow_reset(core->drv_data, core->height - 1);
+
+    ansi_gotoxy(core->drv_data, 0, core->height - 1);
+    ansi_printf(core->drv_data, "%s [ENTER]", prompt);
+    ansi_clreol(core->drv_data);
+    ansi_refresh(core->drv_data);
 
-    while ((key = ansi_get_key(core)) != QW_KEY_ENTER)
-        usleep(100);
+    /* (it only gives up if the terminal is gone) */
+    do
+        key = ansi_get_key(core, -1);
+    while (key != QW_KEY_ENTER && !dd->gone);
 }
 
 
 int qw_drv_confirm(qw_core *core, const char *prompt)
 /* asks for confirmation (1, yes; 0, no; -1, cancel) */
 {
+    struct ansi_drv_data *dd = core->drv_data;
     int ret = -2;
 
-    ansi_gotoxy(0, core->height - 1);
-    printf("%s [Y/N/Esc] ", prompt);
-    ansi_clreol();
-    ansi_refresh();
+    ansi_shadow_reset(core->drv_data, core->height - 1);
+
+    ansi_gotoxy(core->drv_data, 0, core->height - 1);
+    ansi_printf(core->drv_data, "%s [Y/N/Esc] ", prompt);
+    ansi_clreol(core->drv_data);
+    ansi_refresh(core->drv_data);
 
     while (ret == -2) {
-        qw_key key = ansi_get_key(core);
+        qw_key key = ansi_get_key(core, -1);
 
         if (key == QW_KEY_ESC)
             ret = -1;
@@ -586,7 +926,8 @@ int qw_drv_confirm(qw_core *core, const char *prompt)
             core->payload = NULL;
         }
         else
-            usleep(100);
+        if (dd->gone)
+            ret = -1;
     }
 
     return ret;
@@ -596,6 +937,7 @@ int qw_drv_confirm(qw_core *core, const char *prompt)
 char *qw_drv_readline(qw_core *core, const char *prompt)
 /* asks for line of text */
 {
+    struct ansi_drv_data *dd = core->drv_data;
     char buf[4096] = "";
     int px, cx, y;
     int state = 0;
@@ -603,8 +945,9 @@ char *qw_drv_readline(qw_core *core, const char *prompt)
 
     /* print prompt and setup */
     y = core->height - 1;
-    ansi_gotoxy(0, y);
-    printf("%s ", prompt);
+    ansi_shadow_reset(dd, y);
+    ansi_gotoxy(dd, 0, y);
+    ansi_printf(dd, "%s ", prompt);
     px = strlen(prompt) + 1;
     cx = 0;
 
@@ -613,15 +956,15 @@ char *qw_drv_readline(qw_core *core, const char *prompt)
 
         if (draw) {
             /* print content */
-            ansi_gotoxy(px, y);
-            printf("%s", buf);
-            ansi_clreol();
-            ansi_gotoxy(px + cx, y);
-            ansi_refresh();
+            ansi_gotoxy(dd, px, y);
+            ansi_printf(dd, "%s", buf);
+            ansi_clreol(dd);
+            ansi_gotoxy(dd, px + cx, y);
+            ansi_refresh(dd);
             draw = 0;
         }
 
-        key = ansi_get_key(core);
+        key = ansi_get_key(core, -1);
 
         if (key == QW_KEY_ESC)
             state = -1;
@@ -650,7 +993,8 @@ char *qw_drv_readline(qw_core *core, const char *prompt)
             draw = 1;
         }
         else
-            usleep(100);
+        if (dd->gone)
+            state = -1;
     }
 
     return state == 1 ? strdup(buf) : NULL;
@@ -694,23 +1038,30 @@ int qw_drv_exec(qw_core *core)
 {
     signal(SIGPIPE, SIG_IGN);
 
+    /* the pipe where SIGWINCH is signaled */
+    if (pipe(sigwinch_pipe) == 0) {
+        fcntl(sigwinch_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(sigwinch_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+
     ansi_raw_tty(1);
     ansi_sigwinch(0);
-    ansi_get_tty_size(core);
-    ansi_enter_alt_screen();
+    ansi_get_tty_size(core, 1);
+    ansi_enter_alt_screen(core->drv_data);
 
     ansi_key_optimize();
 
     /* push current title to stack */
-    printf("\033[22t");
+    ansi_printf(core->drv_data, "\033[22t");
 
     ansi_main_loop(core);
 
     /* pop previous title */
-    printf("\033[23t");
+    ansi_printf(core->drv_data, "\033[23t");
 
     ansi_raw_tty(0);
-    ansi_leave_alt_screen();
+    ansi_leave_alt_screen(core->drv_data);
+    ansi_refresh(core->drv_data);
 
     return 1;
 }
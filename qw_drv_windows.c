@@ -414,6 +414,9 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
         return 0;
 
     case WM_TIMER:
+        /* background work */
+        qw_core_idle(core);
+
         if (core->refresh)
             InvalidateRect(hwnd, NULL, FALSE);
 
@@ -443,12 +446,26 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
 }
 
 
+static void windows_idle_timer(struct windows_drv_data *dd, int on)
+/* starts or stops the background work timer. It's stopped while a
+   modal box is open, as its message loop would run it in the middle
+   of the operation that opened it */
+{
+    if (on)
+        SetTimer(dd->hwnd, 1, 100, NULL);
+    else
+        KillTimer(dd->hwnd, 1);
+}
+
+
 void qw_drv_alert(qw_core *core, const char *prompt)
 /* shows an alert window */
 {
     struct windows_drv_data *dd = core->drv_data;
 
+    windows_idle_timer(dd, 0);
     MessageBox(dd->hwnd, prompt, "qw", MB_ICONWARNING | MB_OK);
+    windows_idle_timer(dd, 1);
 }
 
 
@@ -458,7 +475,9 @@ int qw_drv_confirm(qw_core *core, const char *prompt)
     struct windows_drv_data *dd = core->drv_data;
     int ret = 0;
 
+    windows_idle_timer(dd, 0);
     ret = MessageBox(dd->hwnd, prompt, "qw", MB_ICONQUESTION | MB_YESNOCANCEL);
+    windows_idle_timer(dd, 1);
 
     return ret == IDYES ? 1 : ret == IDNO ? 0 : -1;
 }
@@ -517,7 +536,9 @@ char *qw_drv_readline(qw_core *core, const char *prompt)
     inputbox_ptr = (char *)prompt;
 
     /* call the dialog */
+    windows_idle_timer(dd, 0);
     DialogBoxW(GetModuleHandle(NULL), L"QWINPUTBOX", dd->hwnd, InputBoxProc);
+    windows_idle_timer(dd, 1);
 
     /* inputbox_ptr will be NULL on cancel */
     return inputbox_ptr;
@@ -627,7 +648,7 @@ int qw_drv_startup(qw_core *core)
         ShowWindow(hwnd, SW_SHOW);
         UpdateWindow(hwnd);
 
-        SetTimer(hwnd, 1, 100, NULL);
+        windows_idle_timer(dd, 1);
     }
 
     return 0;
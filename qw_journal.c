@@ -4,25 +4,170 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <sys/time.h>
 
 #include "qw.h"
 
+/* maximum pause between merged keystrokes (milliseconds) */
+#define QW_JOURNAL_WINDOW 1000
+
+/* maximum size of a merged entry (it grows in its slot) */
+#define QW_JOURNAL_MERGE_MAX QW_JOURNAL_SLOT
+
+/* payloads of at least this size are kept apart, so they can be spilled */
+#define QW_JOURNAL_APART QW_BLOCK_SIZE
+
+/* default memory budget for journal payloads */
+#define QW_JOURNAL_BUDGET (64 * 1024 * 1024)
+
+long qw_journal_budget = QW_JOURNAL_BUDGET;
+
 
 /** code **/
 
+/* Big payloads (like a deleted selection) are kept apart from the add
+   buffers, in a list ordered by age. When their total size goes over
+   the budget, the oldest ones are spilled to an append-only undo log
+   and read back when an undo or redo reaches them. Block chains, where
+   nothing else would ever free the add buffers, keep the small ones in
+   fixed-size slots from a pool of the chain instead, freed along with
+   their entries and released at once with the chain. */
+
+static char *payload_new(qw_journal *j)
+/* allocates an own payload for an entry */
+{
+    qw_chain *c = j->chain;
+    qw_payload *p = malloc(sizeof(qw_payload) + j->size);
+
+    p->j    = j;
+    p->prev = c->newest;
+    p->next = NULL;
+
+    if (p->prev)
+        p->prev->next = p;
+    else
+        c->oldest = p;
+
+    c->newest = p;
+    c->undo_mem += j->size;
+
+    j->own = p;
+
+    return p->data;
+}
+
+
+static void payload_free(qw_journal *j)
+/* frees the own payload of an entry */
+{
+    qw_chain *c = j->chain;
+    qw_payload *p = j->own;
+
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        c->oldest = p->next;
+
+    if (p->next)
+        p->next->prev = p->prev;
+    else
+        c->newest = p->prev;
+
+    c->undo_mem -= j->size;
+
+    free(p);
+    j->own = NULL;
+}
+
+
+static char *slot_new(qw_journal *j)
+/* allocates a pooled slot for a small payload of an entry */
+{
+    j->slot = 1;
+
+    return qw_pool_alloc(&j->chain->slots);
+}
+
+
+static void slot_free(qw_journal *j)
+/* returns the slot of an entry to the pool */
+{
+    qw_pool_free(&j->chain->slots, (char *)j->data);
+    j->slot = 0;
+}
+
+
+static void journal_spill(qw_chain *c)
+/* spills the oldest payloads to the undo log until under budget */
+{
+    while (c->undo_mem > qw_journal_budget && c->oldest) {
+        qw_journal *j = c->oldest->j;
+
+        if (j->spill == -1) {
+            /* not yet in the log: append it */
+            if (c->undo_log == NULL && (c->undo_log = tmpfile()) == NULL)
+                break;
+
+            fseek(c->undo_log, 0, SEEK_END);
+            j->spill = ftell(c->undo_log);
+
+            if (fwrite(j->own->data, j->size, 1, c->undo_log) != 1) {
+                /* can't spill; keep everything in memory */
+                j->spill = -1;
+                break;
+            }
+        }
+
+        payload_free(j);
+        j->data = NULL;
+    }
+}
+
+
+static int journal_page_in(qw_journal *j)
+/* reads back a spilled payload. Returns -1 on error */
+{
+    char *data = payload_new(j);
+
+    fseek(j->chain->undo_log, j->spill, SEEK_SET);
+
+    if (fread(data, j->size, 1, j->chain->undo_log) != 1) {
+        payload_free(j);
+        return -1;
+    }
+
+    j->data = data;
+
+    return 0;
+}
+
+
 qw_journal *qw_journal_first(qw_journal *j)
 /* finds the first in the chain */
 {
-    return j && j->prev ? qw_journal_first(j->prev) : j;
+    while (j && j->prev)
+        j = j->prev;
+
+    return j;
 }
 
 
 qw_journal *qw_journal_destroy(qw_journal *j)
 /* destroys a journal entry and all the following */
 {
-    if (j) {
-        qw_journal_destroy(j->next);
-        free(j);
+    while (j) {
+        qw_journal *next = j->next;
+
+        /* the data in the add buffers or the undo log stays */
+        if (j->own)
+            payload_free(j);
+        else
+        if (j->slot)
+            slot_free(j);
+
+        qw_pool_free(&j->chain->journals, j);
+        j = next;
     }
 
     return NULL;
@@ -33,22 +178,60 @@ qw_journal *qw_journal_new(int op, qw_block *b, int pos,
                             const char *str, int size, qw_journal *prev)
 /* adds an entry to the journal */
 {
-    qw_journal *j;
+    qw_journal *j = qw_pool_alloc(&b->chain->journals);
+    struct timeval tv;
+    const char *p;
 
-    j = calloc(1, sizeof(qw_journal) + size);
+    gettimeofday(&tv, NULL);
 
-    j->prev = prev;
-    j->next = NULL;
-    j->op   = op;
-    j->apos = qw_block_rel_to_abs(b, pos);
-    j->size = size;
+    j->prev  = prev;
+    j->next  = NULL;
+    j->op    = op;
+    j->apos  = qw_block_rel_to_abs(b, pos);
+    j->size  = size;
+    j->chain = b->chain;
+    j->gen   = ++j->chain->gen;
+    j->stamp = tv.tv_sec * 1000L + tv.tv_usec / 1000;
+    j->own   = NULL;
+    j->slot  = 0;
+    j->spill = -1;
 
-    if (op == 1)
-        /* insert: store the data that will be inserted */
-        memcpy(j->data, str, size);
+    if (size == 0) {
+        /* nothing to store (e.g. the first, dummy entry) */
+        j->data = "";
+    }
     else
-        /* delete: pick the data that will be deleted */
-        qw_block_get_str(b, pos, j->data, size);
+    if (op == 1 && j->chain->pieces) {
+        /* insert: piece chains keep the data anyway; share it */
+        j->data = qw_block_stash(b, str, size);
+    }
+    else
+    if (op == 0 && (p = qw_block_ptr(b, pos, size)) != NULL) {
+        /* delete: piece chains share it if contiguous */
+        j->data = p;
+    }
+    else {
+        /* store a copy: small ones in the add buffers (or in a slot,
+           in block chains), big ones apart */
+        char *data;
+
+        if (size <= QW_JOURNAL_SLOT && !j->chain->pieces)
+            data = slot_new(j);
+        else
+        if (size < QW_JOURNAL_APART && j->chain->pieces)
+            data = qw_block_stash(b, NULL, size);
+        else
+            data = payload_new(j);
+
+        if (op == 1)
+            /* insert: store the data that will be inserted */
+            memcpy(data, str, size);
+        else
+            /* delete: pick the data that will be deleted */
+            qw_block_get_str(b, pos, data, size);
+
+        j->data = data;
+    }
 
     if (prev) {
         qw_journal_destroy(prev->next);
@@ -59,33 +242,333 @@ qw_journal *qw_journal_new(int op, qw_block *b, int pos,
 }
 
 
-qw_block *qw_journal_apply(qw_block *b, qw_journal *j, int dir)
-/* applies or unapplies a journal entry */
+static void journal_log(qw_journal *j, int dir)
+/* appends the change to the write-ahead log of the chain, to be
+   written and synced later, as a record like those of saved journals
+   (without data for deletions) */
 {
-    int rpos;
+    qw_wal *w = j->chain->wal;
+    int32_t r[3];
+    int z;
+
+    r[0] = j->op == dir ? 1 : 0;
+    r[1] = j->apos;
+    r[2] = j->size;
+
+    z = sizeof(r) + (r[0] ? j->size : 0);
+
+    if (w->used + z > w->size) {
+        w->size = (w->used + z) * 2;
+        w->buf  = realloc(w->buf, w->size);
+    }
+
+    memcpy(&w->buf[w->used], r, sizeof(r));
+
+    if (r[0])
+        memcpy(&w->buf[w->used + sizeof(r)], j->data, j->size);
+
+    w->used += z;
+}
 
-    /* gets the block and relative position */
-    b = qw_block_abs_to_rel(b, j->apos, &rpos);
+
+qw_block *qw_journal_apply_at(qw_block *b, int rpos, qw_journal *j, int dir)
+/* applies or unapplies a journal entry at rpos of b, already known to
+   be its position. Returns NULL, changing nothing, if its data can't
+   be read back */
+{
+    /* spilled? read it back */
+    if (j->data == NULL && journal_page_in(j) == -1)
+        return NULL;
+
+    if (j->chain->wal && j->size)
+        journal_log(j, dir);
 
     if (j->op == dir)
         b = qw_block_insert_str(b, rpos, j->data, j->size);
     else
         qw_block_delete(b, rpos, j->size);
 
+    /* keep the payloads in memory under budget */
+    journal_spill(j->chain);
+
     return b;
 }
 
 
+qw_block *qw_journal_apply(qw_block *b, qw_journal *j, int dir)
+/* applies or unapplies a journal entry. Returns NULL, changing
+   nothing, if its data can't be read back */
+{
+    int rpos;
+
+    /* gets the block and relative position */
+    b = qw_block_abs_to_rel(b, j->apos, &rpos);
+
+    return qw_journal_apply_at(b, rpos, j, dir);
+}
+
+
+qw_journal *qw_journal_merge(qw_journal *j)
+/* merges an already applied entry into the previous one if both are
+   contiguous keystrokes (typing a word, or a run of deletes). Returns
+   the entry that stands for both */
+{
+    qw_journal *p = j->prev;
+    const char *d1, *d2;
+    int apos, z1, size;
+
+    /* only into a real, unsaved and quite recent entry of the same kind */
+    if (p == NULL || p->prev == NULL || qw_journal_is_clean(p) || p->op != j->op ||
+        p->size == 0 || j->size == 0 || p->data == NULL || (!p->chain->pieces && !p->slot) ||
+        j->stamp - p->stamp > QW_JOURNAL_WINDOW ||
+        p->size + j->size > QW_JOURNAL_MERGE_MAX)
+        return j;
+
+    if (j->op == 1) {
+        /* insert: must follow the previous one, and a word
+           after whitespace starts a new entry */
+        if (j->apos != p->apos + p->size ||
+            (isspace((unsigned char)p->data[p->size - 1]) &&
+            !isspace((unsigned char)j->data[0])))
+            return j;
+
+        apos = p->apos;
+        d1   = p->data;
+        z1   = p->size;
+        d2   = j->data;
+    }
+    else
+    if (j->apos == p->apos) {
+        /* delete forward */
+        apos = p->apos;
+        d1   = p->data;
+        z1   = p->size;
+        d2   = j->data;
+    }
+    else
+    if (j->apos + j->size == p->apos) {
+        /* delete backwards */
+        apos = j->apos;
+        d1   = j->data;
+        z1   = j->size;
+        d2   = p->data;
+    }
+    else
+        return j;
+
+    size = p->size + j->size;
+
+    /* join the data, only copying if not already together */
+    if (p->slot) {
+        /* block chains: in place, as the slot has room for both */
+        char *data = (char *)p->data;
+
+        if (d1 == data)
+            memcpy(data + z1, d2, size - z1);
+        else {
+            memmove(data + z1, data, size - z1);
+            memcpy(data, d1, z1);
+        }
+    }
+    else
+    if (d1 + z1 == d2)
+        p->data = d1;
+    else {
+        char *data = qw_block_stash(p->chain->first, NULL, size);
+
+        memcpy(data, d1, z1);
+        memcpy(data + z1, d2, size - z1);
+        p->data = data;
+    }
+
+    p->apos  = apos;
+    p->size  = size;
+    p->stamp = j->stamp;
+    p->next  = NULL;
+
+    if (j->own)
+        payload_free(j);
+    else
+    if (j->slot)
+        slot_free(j);
+
+    qw_pool_free(&j->chain->journals, j);
+
+    return p;
+}
+
+
 void qw_journal_mark_clean(qw_journal *j)
 /* mark this entry as clean (i.e. saved to disk) */
+{
+    /* any other entry is dirty from now on */
+    j->chain->clean_gen = j->gen;
+}
+
+
+int qw_journal_is_clean(qw_journal *j)
+/* tests if this entry is the clean one */
+{
+    return j->gen == j->chain->clean_gen;
+}
+
+
+void qw_journal_release(qw_chain *c)
+/* releases the journal payloads of a chain being destroyed */
+{
+    while (c->oldest) {
+        qw_payload *next = c->oldest->next;
+
+        free(c->oldest);
+        c->oldest = next;
+    }
+
+    if (c->undo_log)
+        fclose(c->undo_log);
+}
+
+
+/* The journal is saved as a sequence of records (three 32 bit
+   integers: op, apos and size, followed by the data), in the native
+   byte order, from the entry after a given one (usually the first,
+   dummy one) up to another, so new entries can be appended later. */
+
+static int journal_write(qw_journal *j, FILE *f)
+/* writes the data of an entry, from memory or the undo log */
+{
+    char buf[QW_BLOCK_SIZE];
+    long pos = j->spill;
+    int z = j->size;
+
+    if (j->data != NULL)
+        return fwrite(j->data, 1, z, f) == (size_t) z ? 0 : -1;
+
+    while (z > 0) {
+        int l = z < (int) sizeof(buf) ? z : (int) sizeof(buf);
+
+        fseek(j->chain->undo_log, pos, SEEK_SET);
+
+        if (fread(buf, l, 1, j->chain->undo_log) != 1 || fwrite(buf, l, 1, f) != 1)
+            return -1;
+
+        pos += l;
+        z   -= l;
+    }
+
+    return 0;
+}
+
+
+int qw_journal_save(qw_journal *from, qw_journal *j, FILE *f)
+/* saves the journal entries after from up to j. Returns the number
+   of saved entries, or -1 on errors */
 {
     qw_journal *t;
+    int count = 0;
+
+    for (t = from; t != j; t = t->next) {
+        int32_t r[3];
+
+        r[0] = t->next->op;
+        r[1] = t->next->apos;
+        r[2] = t->next->size;
 
-    j->clean = 1;
+        if (fwrite(r, sizeof(r), 1, f) != 1 || journal_write(t->next, f) == -1)
+            return -1;
 
-    /* mark the rest of entries as dirty */
-    for (t = j->prev; t; t = t->prev)
-        t->clean = 0;
-    for (t = j->next; t; t = t->next)
-        t->clean = 0;
+        count++;
+    }
+
+    return count;
 }
+
+
+int qw_journal_load(qw_journal *j, const char *data, int size, int count, int length)
+/* loads count saved entries before the first entry of a journal, that
+   leave the document with length bytes. The data must outlive it.
+   Returns -1 if the data is not valid */
+{
+    qw_journal *p = NULL;
+    int32_t r[3];
+    int n, o, l = 0;
+
+    /* validate it first */
+    for (n = o = 0; n < count; n++) {
+        if (size - o < (int) sizeof(r))
+            return -1;
+
+        memcpy(r, data + o, sizeof(r));
+        o += sizeof(r);
+
+        if (r[0] < 0 || r[0] > 1 || r[1] < 0 || r[2] < 0 || r[2] > size - o)
+            return -1;
+
+        o += r[2];
+        l += r[0] ? r[2] : -r[2];
+    }
+
+    if (count == 0 || o != size)
+        return -1;
+
+    /* then each position, against the length before the entry */
+    if ((l = length - l) < 0)
+        return -1;
+
+    for (n = o = 0; n < count; n++) {
+        memcpy(r, data + o, sizeof(r));
+        o += sizeof(r) + r[2];
+
+        if (r[1] > l || (r[0] == 0 && r[2] > l - r[1]))
+            return -1;
+
+        l += r[0] ? r[2] : -r[2];
+    }
+
+    j = qw_journal_first(j);
+
+    /* a new dummy entry, followed by the loaded ones */
+    for (n = o = 0; n <= count; n++) {
+        qw_journal *t;
+
+        /* the last one is the state the first entry stands for */
+        if (n == count)
+            t = j;
+        else {
+            t = qw_pool_alloc(&j->chain->journals);
+            t->chain = j->chain;
+            t->gen   = ++t->chain->gen;
+            t->stamp = 0;
+        }
+
+        if (n == 0) {
+            t->op   = 0;
+            t->apos = 0;
+            t->size = 0;
+            t->data = "";
+        }
+        else {
+            memcpy(r, data + o, sizeof(r));
+            o += sizeof(r);
+
+            t->op   = r[0];
+            t->apos = r[1];
+            t->size = r[2];
+            t->data = data + o;
+            o += r[2];
+        }
+
+        t->own   = NULL;
+        t->slot  = 0;
+        t->spill = -1;
+
+        t->prev = p;
+
+        if (p != NULL)
+            p->next = t;
+
+        p = t;
+    }
+
+    return 0;
+}
+
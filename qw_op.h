@@ -33,3 +33,4 @@ X(QW_OP_SEARCH, search)
 X(QW_OP_SEARCH_NEXT, search_next)
 X(QW_OP_M_DASH, m_dash)
 X(QW_OP_CONF_CMD, conf_cmd)
+X(QW_OP_GOTO_LINE, goto_line)
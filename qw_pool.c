@@ -0,0 +1,85 @@
+/* qw - A minimalistic text editor by grunfink - public domain */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include "qw.h"
+
+
+/** code **/
+
+/* A pool hands out elements of a fixed size carved from big slabs.
+   Freed elements go to a free list to be reused, and all of them are
+   released at once with the slabs. */
+
+/* slab header size (keeps elements aligned) */
+#define QW_SLAB_HDR 16
+
+void qw_pool_init(qw_pool *p, int size, int count)
+/* initializes a pool of elements of size bytes, count per slab */
+{
+    /* round up to keep alignment */
+    p->size  = (size + QW_SLAB_HDR - 1) & ~(QW_SLAB_HDR - 1);
+    p->count = count;
+    p->free  = NULL;
+    p->slabs = NULL;
+    p->left  = 0;
+    p->used  = 0;
+}
+
+
+void *qw_pool_alloc(qw_pool *p)
+/* allocates an element (not zeroed) */
+{
+    void *e;
+
+    if (p->free != NULL) {
+        /* reuse a freed one */
+        e = p->free;
+        p->free = *(void **)e;
+    }
+    else {
+        if (p->left == 0) {
+            /* new slab, linked to the previous ones */
+            char *s = malloc(QW_SLAB_HDR + (size_t) p->size * p->count);
+
+            *(void **)s = p->slabs;
+            p->slabs = s;
+            p->left  = p->count;
+        }
+
+        e = (char *)p->slabs + QW_SLAB_HDR + (size_t) p->size * (p->count - p->left);
+        p->left--;
+    }
+
+    p->used++;
+
+    return e;
+}
+
+
+void qw_pool_free(qw_pool *p, void *e)
+/* returns an element to the pool */
+{
+    *(void **)e = p->free;
+    p->free = e;
+
+    p->used--;
+}
+
+
+void qw_pool_release(qw_pool *p)
+/* frees all the elements of a pool at once */
+{
+    while (p->slabs != NULL) {
+        void *next = *(void **)p->slabs;
+
+        free(p->slabs);
+        p->slabs = next;
+    }
+
+    p->free = NULL;
+    p->left = 0;
+    p->used = 0;
+}
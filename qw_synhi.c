@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 
 
 /** code **/
@@ -13,7 +14,7 @@ qw_synhi *qw_synhi_find_by_name(const char *name, qw_synhi *list)
 /* finds a syntax highlight definition by name */
 {
     while (list && strcmp(name, list->name) != 0)
-        list = qw_synhi_find_by_name(name, list->next);
+        list = list->next;
 
     return list;
 }
@@ -50,23 +51,21 @@ void qw_synhi_add_extension(qw_synhi *sh, const char *ext)
 qw_synhi *qw_synhi_find_by_extension(const char *fname, qw_synhi *list)
 /* finds a syntax highlight definition by filename extension */
 {
-    if (list) {
+    int s = strlen(fname);
+
+    for (; list; list = list->next) {
         int n;
-        int s = strlen(fname);
 
         /* iterate all extensions */
         for (n = 0; n < list->n_extensions; n++) {
             int es = strlen(list->extensions[n]);
 
             if (s > es && strcmp(list->extensions[n], &fname[s - es]) == 0)
-                goto found;
+                return list;
         }
-
-        list = qw_synhi_find_by_extension(fname, list->next);
     }
 
-found:
-    return list;
+    return NULL;
 }
 
 
@@ -118,6 +117,7 @@ void qw_synhi_add_token(qw_synhi *sh, const char *token, qw_attr attr)
 
     sh->tokens[i].token = strdup(token);
     sh->tokens[i].attr  = attr;
+    sh->tokens[i].size  = strlen(token);
 
     /* not sorted */
     sh->sorted = 0;
@@ -137,6 +137,13 @@ void qw_synhi_add_section(qw_synhi *sh, const char *begin,
     sh->sections[i].end     = strdup(end);
     sh->sections[i].escaped = escaped != NULL ? strdup(escaped) : NULL;
     sh->sections[i].attr    = attr;
+
+    sh->sections[i].begin_size   = strlen(begin);
+    sh->sections[i].end_size     = strlen(end);
+    sh->sections[i].escaped_size = escaped != NULL ? strlen(escaped) : 0;
+
+    /* the lexer must be rebuilt */
+    sh->sorted = 0;
 }
 
 
@@ -149,31 +156,106 @@ static int token_compare(const void *p1, const void *p2)
 }
 
 
+/* lexer table flags: bytes starting a token, or a section delimiter */
+#define QW_LEX_TOKEN 1
+#define QW_LEX_DELIM 2
+
+/* Tokens are looked up in an open addressing hash table (with linear
+   probing) of indexes to the sorted token array, so the scanners can
+   find them right from the view data, without copying them. */
+
+static unsigned int token_hash(const char *token, int size)
+/* returns the hash of a token (FNV-1a) */
+{
+    unsigned int h = 2166136261u;
+
+    while (size--)
+        h = (h ^ (unsigned char) *token++) * 16777619u;
+
+    return h;
+}
+
+
 void qw_synhi_optimize(qw_synhi *sh)
 /* optimizes a syntax highlight structure for faster access */
 {
     if (!sh->sorted) {
+        int n;
+
         /* sort the tokens */
         qsort(sh->tokens, sh->n_tokens, sizeof(qw_token), token_compare);
         sh->sorted = 1;
+
+        /* rebuild the hash table, never more than half full */
+        for (sh->hash_size = 16; sh->hash_size < sh->n_tokens * 2; sh->hash_size *= 2);
+
+        sh->hash = realloc(sh->hash, sizeof(int) * sh->hash_size);
+        memset(sh->hash, 0xff, sizeof(int) * sh->hash_size);
+
+        for (n = 0; n < sh->n_tokens; n++) {
+            qw_token *t = &sh->tokens[n];
+            unsigned int h = token_hash(t->token, t->size) & (sh->hash_size - 1);
+
+            while (sh->hash[h] != -1)
+                h = (h + 1) & (sh->hash_size - 1);
+
+            sh->hash[h] = n;
+        }
+
+        /* rebuild the lexer table */
+        memset(sh->lex, 0, sizeof(sh->lex));
+        sh->line_sections = 0;
+
+        for (n = 0; n < sh->n_tokens; n++)
+            sh->lex[(unsigned char) sh->tokens[n].token[0]] |= QW_LEX_TOKEN;
+
+        for (n = 0; n < sh->n_sections; n++) {
+            qw_section *sect = &sh->sections[n];
+
+            if (sect->begin[0] == '\n')
+                sh->line_sections++;
+            else {
+                sh->lex[(unsigned char) sect->begin[0]] |= QW_LEX_DELIM;
+                sh->lex[(unsigned char) sect->end[0]]   |= QW_LEX_DELIM;
+
+                if (sect->escaped)
+                    sh->lex[(unsigned char) sect->escaped[0]] |= QW_LEX_DELIM;
+            }
+        }
+
+        /* the end of the view never starts anything */
+        sh->lex[0] = 0;
     }
 }
 
 
-qw_attr qw_synhi_find_token(qw_synhi *sh, const char *token)
-/* finds the attribute of a token */
+qw_attr qw_synhi_find_token_n(qw_synhi *sh, const char *token, int size)
+/* finds the attribute of a token of size bytes */
 {
-    qw_attr attr = QW_ATTR_NONE;
-    qw_token s_token = { token, 0 };
-    qw_token *t;
+    unsigned int h;
+    int n;
 
     qw_synhi_optimize(sh);
 
-    if ((t = bsearch(&s_token, sh->tokens, sh->n_tokens,
-            sizeof(qw_token), token_compare)) != NULL)
-        attr = t->attr;
+    h = token_hash(token, size) & (sh->hash_size - 1);
+
+    while ((n = sh->hash[h]) != -1) {
+        qw_token *t = &sh->tokens[n];
 
-    return attr;
+        if (t->size == size && memcmp(t->token, token, size) == 0)
+            return t->attr;
+
+        h = (h + 1) & (sh->hash_size - 1);
+    }
+
+    return QW_ATTR_NONE;
+}
+
+
+qw_attr qw_synhi_find_token(qw_synhi *sh, const char *token)
+/* finds the attribute of a token */
+{
+    return qw_synhi_find_token_n(sh, token, strlen(token));
 }
 
 
@@ -182,29 +264,31 @@ qw_attr qw_synhi_find_token(qw_synhi *sh, const char *token)
 static void apply_tokens(qw_view *view, qw_synhi *sh)
 /* applies the synhi to tokens */
 {
-    char token[4096];
     int i = 0;
 
     while (i < view->size) {
-        int s, ti = 0;
+        int s;
         qw_attr attr;
 
         /* skip to the start of a token */
         while (i < view->size && !is_token(view->data[i]))
             i++;
 
-        /* store the token */
+        /* find its end */
         s = i;
         while (i < view->size && is_token(view->data[i]))
-            token[ti++] = view->data[i++];
+            i++;
 
-        token[ti] = '\0';
+        if (s == i)
+            break;
 
-        /* is the token a numeral? */
-        if (isdigit(token[0]))
-            strcpy(token, "0");
+        /* is the token a numeral? all are found as "0" */
+        if (isdigit((unsigned char) view->data[s]))
+            attr = qw_synhi_find_token_n(sh, "0", 1);
+        else
+            attr = qw_synhi_find_token_n(sh, &view->data[s], i - s);
 
-        if ((attr = qw_synhi_find_token(sh, token)) != QW_ATTR_NONE) {
+        if (attr != QW_ATTR_NONE) {
             while (s < i)
                 view->attr[s++] = attr;
         }
@@ -217,25 +301,25 @@ static void apply_tokens(qw_view *view, qw_synhi *sh)
 static void apply_words(qw_view *view, qw_synhi *sh)
 /* applies the synhi to words */
 {
-    char word[4096];
     int i = 0;
 
     while (i < view->size) {
-        int s, ti = 0;
+        int s;
         qw_attr attr;
 
         /* skip blanks */
         while (i < view->size && is_blank(view->data[i]))
             i++;
 
-        /* store the word up to next blank */
+        /* find the word up to next blank */
         s = i;
         while (i < view->size && !is_blank(view->data[i]))
-            word[ti++] = view->data[i++];
+            i++;
 
-        word[ti] = '\0';
+        if (s == i)
+            break;
 
-        if ((attr = qw_synhi_find_token(sh, word)) != QW_ATTR_NONE) {
+        if ((attr = qw_synhi_find_token_n(sh, &view->data[s], i - s)) != QW_ATTR_NONE) {
             while (s < i)
                 view->attr[s++] = attr;
         }
@@ -298,6 +382,10 @@ static void apply_sections(qw_view *view, qw_synhi *sh)
             i = begin - view->data;
             e = end   - view->data + strlen(sect->end);
 
+            /* not beyond the end of the view */
+            if (e > view->size)
+                e = view->size;
+
             /* not yet attributed? do it */
             if (view->attr[i] == QW_ATTR_NORMAL) {
                 /* fill from begin to end */
@@ -311,8 +399,9 @@ static void apply_sections(qw_view *view, qw_synhi *sh)
 }
 
 
-void qw_synhi_apply_to_view(qw_view *view, qw_synhi *sh)
-/* applies the synhi to the view */
+void qw_synhi_apply_passes(qw_view *view, qw_synhi *sh)
+/* applies the synhi to the view in separate passes (slow, but simple:
+   it's kept as the reference for the lexer) */
 {
     if (view != NULL && sh != NULL) {
         apply_tokens(view, sh);
@@ -320,3 +409,632 @@ void qw_synhi_apply_to_view(qw_view *view, qw_synhi *sh)
         apply_sections(view, sh);
     }
 }
+
+
+/* The lexer attributes the view in a single pass, with the same results
+   as the separate passes: each word is looked up whole, or else its
+   tokens, when the scan gets to it; and each section is a small state
+   machine (looking for its begin, or inside it, looking for its end or
+   escape) run side by side with the others. As the passes applied them
+   one after the other, a section only starts where the previous ones
+   (and the words and tokens) left the text normal, and where sections
+   overlap the last defined one wins. Bytes that can't start any
+   delimiter are skipped by looking them up in a table. */
+
+/* maximum number of sections with state kept in the stack */
+#define QW_LEX_SECTIONS 32
+
+#define lex_match(v, p, s, z) ((v)->data[p] == (s)[0] && strncmp(&(v)->data[p], (s), (z)) == 0)
+
+static qw_attr lex_find(qw_synhi *sh, const char *token, int size)
+/* finds a token, if any starts with the same byte */
+{
+    if (!(sh->lex[(unsigned char) token[0]] & QW_LEX_TOKEN))
+        return QW_ATTR_NONE;
+
+    return qw_synhi_find_token_n(sh, token, size);
+}
+
+
+static void lex_word(qw_view *view, qw_synhi *sh, int w, int e)
+/* applies the synhi to a word, or to its tokens if not found */
+{
+    qw_attr attr;
+    int s = w;
+
+    if ((attr = lex_find(sh, &view->data[w], e - w)) != QW_ATTR_NONE) {
+        while (s < e)
+            view->attr[s++] = attr;
+    }
+    else {
+        while (s < e) {
+            int t;
+
+            /* skip to the start of a token */
+            while (s < e && !is_token(view->data[s]))
+                s++;
+
+            /* find its end */
+            t = s;
+            while (s < e && is_token(view->data[s]))
+                s++;
+
+            if (t == s)
+                break;
+
+            /* is the token a numeral? all are found as "0" */
+            if (isdigit((unsigned char) view->data[t]))
+                attr = lex_find(sh, "0", 1);
+            else
+            if (t == w && s == e)
+                break;          /* the whole word: already not found */
+            else
+                attr = lex_find(sh, &view->data[t], s - t);
+
+            if (attr != QW_ATTR_NONE) {
+                while (t < s)
+                    view->attr[t++] = attr;
+            }
+        }
+    }
+}
+
+
+static void lex_line(qw_view *view, qw_synhi *sh, qw_lexstate *st, int p, int len)
+/* starts the sections matched at the start of the line at p */
+{
+    int n, ls = p, eol = -1;
+
+    /* skip blanks */
+    while (view->data[ls] == ' ')
+        ls++;
+
+    for (n = 0; n < sh->n_sections; n++) {
+        qw_section *sect = &sh->sections[n];
+
+        if (sect->begin[0] == '\n' &&
+            strncmp(&view->data[ls], &sect->begin[1], sect->begin_size - 1) == 0) {
+            /* find the EOL only once; if not here, it's further on */
+            if (eol == -1) {
+                for (eol = ls; eol < len && view->data[eol] != '\n'; eol++);
+
+                if (eol == len)
+                    eol = INT_MAX;
+            }
+
+            st[n].cov_s = ls;
+            st[n].cov_e = eol;
+        }
+    }
+}
+
+
+static void lex_init(qw_synhi *sh, qw_lexstate *st)
+/* sets the sections to the state of the start of a document */
+{
+    memset(st, 0, sizeof(qw_lexstate) * sh->n_sections);
+}
+
+
+static void lex(qw_view *view, qw_synhi *sh, qw_lexstate *st, int bol)
+/* attributes the view, from the state of the sections at its start
+   (bol: if it's also the start of a line). Leaves in st the state at
+   its end */
+{
+    qw_attr top = QW_ATTR_NONE;
+    int n, p, len, wend = 0, until = 0;
+
+    /* sections stop at the first ASCIIZ, like string functions */
+    len = strlen(view->data);
+
+    for (p = 0; p < view->size; p++) {
+        int c = (unsigned char) view->data[p];
+
+        /* a word starts here? */
+        if (p >= wend && !is_blank(c)) {
+            for (wend = p + 1; wend < view->size && !is_blank(view->data[wend]); wend++);
+
+            lex_word(view, sh, p, wend);
+        }
+
+        if (sh->line_sections) {
+            /* a line ends here? close the line sections left open */
+            if (c == '\n' || p == len) {
+                for (n = 0; n < sh->n_sections; n++) {
+                    if (st[n].cov_e == INT_MAX && sh->sections[n].begin[0] == '\n')
+                        st[n].cov_e = p;
+                }
+
+                until = p;
+            }
+
+            /* a line starts here? */
+            if (p < len && (p == 0 ? bol : view->data[p - 1] == '\n')) {
+                lex_line(view, sh, st, p, len);
+                until = p;
+            }
+        }
+
+        /* no delimiter here, and the same sections as before? */
+        if (p < until && (p >= len || !(sh->lex[c] & QW_LEX_DELIM))) {
+            if (top != QW_ATTR_NONE)
+                view->attr[p] = top;
+
+            continue;
+        }
+
+        {
+            qw_attr attr = view->attr[p];
+            int done = attr != QW_ATTR_NORMAL;
+
+            top   = QW_ATTR_NONE;
+            until = INT_MAX;
+
+            for (n = 0; n < sh->n_sections; n++) {
+                qw_section *sect = &sh->sections[n];
+                qw_lexstate *s = &st[n];
+
+                if (p < len && p >= s->from && sect->begin[0] != '\n') {
+                    if (s->inside) {
+                        if (lex_match(view, p, sect->end, sect->end_size)) {
+                            /* the end is also attributed */
+                            s->inside = 0;
+                            s->cov_e  = p + sect->end_size;
+                            s->from   = s->cov_e;
+                        }
+                        else
+                        if (sect->escaped &&
+                            lex_match(view, p, sect->escaped, sect->escaped_size))
+                            s->from = p + sect->escaped_size;
+                    }
+                    else
+                    if (lex_match(view, p, sect->begin, sect->begin_size)) {
+                        if (!done) {
+                            /* the end is searched for right after the begin */
+                            s->inside = 1;
+                            s->cov_s  = p;
+                            s->cov_e  = INT_MAX;
+                            s->from   = p + 1;
+                        }
+                        else
+                            s->from = p + sect->begin_size;
+                    }
+                }
+
+                /* inside this section? it takes over the previous ones */
+                if (s->cov_s <= p && p < s->cov_e) {
+                    top  = sect->attr;
+                    done = 1;
+                }
+
+                /* the next position where this can change */
+                if (s->cov_s > p && s->cov_s < until)
+                    until = s->cov_s;
+                if (s->cov_e > p && s->cov_e < until)
+                    until = s->cov_e;
+            }
+
+            if (top != QW_ATTR_NONE)
+                view->attr[p] = top;
+        }
+    }
+}
+
+
+static void lex_shift(qw_synhi *sh, qw_lexstate *st, int z)
+/* makes a state relative to z bytes forward, forgetting what's behind */
+{
+    int n;
+
+    for (n = 0; n < sh->n_sections; n++) {
+        qw_lexstate *s = &st[n];
+
+        s->from = s->from > z ? s->from - z : 0;
+
+        if (s->cov_e > z) {
+            s->cov_s = s->cov_s > z ? s->cov_s - z : 0;
+
+            if (s->cov_e != INT_MAX)
+                s->cov_e -= z;
+        }
+        else
+            s->cov_s = s->cov_e = 0;
+    }
+}
+
+
+void qw_synhi_apply_to_view(qw_view *view, qw_synhi *sh)
+/* applies the synhi to the view, as if it was the whole document */
+{
+    if (view != NULL && sh != NULL) {
+        qw_lexstate buf[QW_LEX_SECTIONS], *st = buf;
+
+        qw_synhi_optimize(sh);
+
+        if (sh->n_sections > QW_LEX_SECTIONS)
+            st = malloc(sizeof(qw_lexstate) * sh->n_sections);
+
+        lex_init(sh, st);
+        lex(view, sh, st, 1);
+
+        if (st != buf)
+            free(st);
+    }
+}
+
+
+/* A section can start far above the view, so the state of the sections
+   at some points of the document (checkpoints: the first line start
+   after every QW_LEX_STEP bytes or so) is kept in a cache in the chain.
+   The state at the start of the view is found by lexing from the
+   nearest checkpoint before it. A change keeps the checkpoints before
+   it, moves the ones after it and marks them as unsure; lexing forward
+   again, as soon as the state at one of them is the same as before,
+   all the rest are right again. */
+
+/* checkpoints are taken at the first line start after this many bytes */
+#define QW_LEX_STEP 8192
+
+/* ... or after this many, if lines are very long */
+#define QW_LEX_STEP_MAX (QW_LEX_STEP * 4)
+
+/* maximum bytes lexed while painting to find the state of a view
+   (the rest is left to qw_synhi_lex_ahead(), from the idle loop) */
+#define QW_LEX_BUDGET (256 * 1024)
+
+#define lex_point(l, n) (&(l)->state[(n) * (l)->n_sections])
+
+static qw_lex *lex_cache(qw_chain *c, qw_synhi *sh)
+/* returns the checkpoint cache of a chain for a synhi */
+{
+    qw_lex *l = c->lex;
+
+    if (l == NULL) {
+        l = c->lex = calloc(1, sizeof(qw_lex));
+        l->data = malloc(QW_LEX_STEP_MAX + 2);
+        l->attr = malloc(QW_LEX_STEP_MAX + 1);
+    }
+
+    if (l->sh != sh || l->n_sections != sh->n_sections) {
+        /* for another synhi: start again */
+        l->sh         = sh;
+        l->n_sections = sh->n_sections;
+        l->count      = 0;
+    }
+
+    if (l->count == 0) {
+        /* the start of the document */
+        l->alloc = 16;
+        l->apos  = realloc(l->apos, sizeof(int) * l->alloc);
+        l->state = realloc(l->state, sizeof(qw_lexstate) * l->alloc * l->n_sections);
+
+        l->apos[0] = 0;
+        lex_init(sh, lex_point(l, 0));
+
+        l->count = l->valid = 1;
+    }
+
+    return l;
+}
+
+
+static void lex_store(qw_lex *l, int apos, qw_lexstate *st)
+/* stores a checkpoint after the last valid one */
+{
+    int z = sizeof(qw_lexstate) * l->n_sections;
+    int k = l->valid, n;
+
+    /* skip the unsure ones before it */
+    for (n = k; n < l->count && l->apos[n] < apos; n++);
+
+    if (n < l->count && l->apos[n] == apos) {
+        if (memcmp(lex_point(l, n), st, z) == 0) {
+            /* the same as before: all the rest are right */
+            memmove(&l->apos[k], &l->apos[n], sizeof(int) * (l->count - n));
+            memmove(lex_point(l, k), lex_point(l, n), z * (l->count - n));
+
+            l->count -= n - k;
+            l->valid  = l->count;
+
+            return;
+        }
+
+        /* replace it */
+        n++;
+    }
+
+    if (n == k && l->count == l->alloc) {
+        /* no room */
+        l->alloc *= 2;
+        l->apos  = realloc(l->apos, sizeof(int) * l->alloc);
+        l->state = realloc(l->state, z * l->alloc);
+    }
+
+    /* the new one takes the place of the skipped ones */
+    memmove(&l->apos[k + 1], &l->apos[n], sizeof(int) * (l->count - n));
+    memmove(lex_point(l, k + 1), lex_point(l, n), z * (l->count - n));
+
+    l->count += k + 1 - n;
+    l->valid  = k + 1;
+
+    l->apos[k] = apos;
+    memcpy(lex_point(l, k), st, z);
+}
+
+
+static int lex_read(qw_lex *l, qw_block *b, int apos, int *bol)
+/* reads up to QW_LEX_STEP_MAX bytes from apos into the cache buffer,
+   also finding if it's the start of a line. Returns the size */
+{
+    int i, z;
+
+    if (apos > 0) {
+        b = qw_block_abs_to_rel(b, apos - 1, &i);
+        z = qw_block_get_str(b, i, l->data, QW_LEX_STEP_MAX + 1) - 1;
+        *bol = l->data[0] == '\n';
+    }
+    else {
+        b = qw_block_abs_to_rel(b, 0, &i);
+        z = qw_block_get_str(b, i, l->data + 1, QW_LEX_STEP_MAX);
+        *bol = 1;
+    }
+
+    return z < 0 ? 0 : z;
+}
+
+
+static int lex_find_point(qw_lex *l, int apos)
+/* returns the last valid checkpoint before apos */
+{
+    int lo = 0, hi = l->valid;
+
+    while (hi - lo > 1) {
+        int m = (lo + hi) / 2;
+
+        if (l->apos[m] <= apos)
+            lo = m;
+        else
+            hi = m;
+    }
+
+    return lo;
+}
+
+
+static int lex_step(qw_lex *l, qw_synhi *sh, qw_block *b, qw_lexstate *st, int limit)
+/* lexes from the last valid checkpoint to the next one (if not after
+   limit) and stores the state there. Returns the lexed size */
+{
+    int k = l->valid - 1, z, e, bol;
+    qw_view v;
+
+    v.data = l->data + 1;
+    v.attr = l->attr;
+
+    z = lex_read(l, b, l->apos[k], &bol);
+
+    /* the next checkpoint: the old one, if still at a line start */
+    e = k + 1 < l->count ? l->apos[k + 1] - l->apos[k] : 0;
+
+    if (e <= 0 || e > z || v.data[e - 1] != '\n') {
+        /* no; the first line start after QW_LEX_STEP bytes */
+        for (e = QW_LEX_STEP; e <= z && v.data[e - 1] != '\n'; e++);
+
+        if (e > z)
+            e = z;
+    }
+
+    if (e == 0 || l->apos[k] + e > limit)
+        return 0;
+
+    memcpy(st, lex_point(l, k), sizeof(qw_lexstate) * sh->n_sections);
+
+    v.size = e;
+    v.data[e] = '\0';
+    memset(v.attr, QW_ATTR_NORMAL, e);
+
+    lex(&v, sh, st, bol);
+    lex_shift(sh, st, e);
+
+    lex_store(l, l->apos[k] + e, st);
+
+    return e;
+}
+
+
+static int lex_state_at(qw_synhi *sh, qw_block *b, int apos, qw_lexstate *st, int *bol)
+/* gets into st the state of the sections at apos, lexing forward from
+   the checkpoints as needed. Returns -1 if it's too far to do it now */
+{
+    qw_lex *l = lex_cache(b->chain, sh);
+    int budget = QW_LEX_BUDGET;
+    int k, c, e;
+    qw_view v;
+
+    /* first, the checkpoints up to apos */
+    while ((k = lex_find_point(l, apos)) == l->valid - 1 &&
+           (e = lex_step(l, sh, b, st, apos)) > 0) {
+        if ((budget -= e) < 0)
+            return -1;
+    }
+
+    /* then, from the last one to apos */
+    v.data = l->data + 1;
+    v.attr = l->attr;
+
+    v.size = lex_read(l, b, l->apos[k], &c);
+
+    if (v.size > apos - l->apos[k])
+        v.size = apos - l->apos[k];
+
+    *bol = v.size ? v.data[v.size - 1] == '\n' : c;
+
+    memcpy(st, lex_point(l, k), sizeof(qw_lexstate) * sh->n_sections);
+
+    v.data[v.size] = '\0';
+    memset(v.attr, QW_ATTR_NORMAL, v.size);
+
+    lex(&v, sh, st, c);
+    lex_shift(sh, st, v.size);
+
+    return 0;
+}
+
+
+static int lex_view_pos(qw_view *view, int d)
+/* returns the position in the view of d bytes of the document
+   from its start (not counting the soft wordwraps) */
+{
+    int p = 0;
+
+    while (d > 0 && p < view->size) {
+        if (view->data[p] != '\r')
+            d--;
+
+        p++;
+    }
+
+    return p;
+}
+
+
+int qw_synhi_apply_at(qw_view *view, qw_synhi *sh, qw_block *b, int vpos)
+/* applies the synhi to the view of the document at vpos, continuing the
+   sections open before it. Returns -1 if they are not known yet */
+{
+    int ret = 0;
+
+    if (view != NULL && sh != NULL) {
+        qw_lexstate buf[QW_LEX_SECTIONS], *st = buf;
+        int n, bol;
+
+        qw_synhi_optimize(sh);
+
+        if (sh->n_sections > QW_LEX_SECTIONS)
+            st = malloc(sizeof(qw_lexstate) * sh->n_sections);
+
+        if ((ret = lex_state_at(sh, b, vpos, st, &bol)) == -1) {
+            /* too far: as if the document started here */
+            lex_init(sh, st);
+            bol = 1;
+        }
+
+        /* move the state to view positions */
+        for (n = 0; n < sh->n_sections; n++) {
+            qw_lexstate *s = &st[n];
+
+            s->from = lex_view_pos(view, s->from);
+
+            if (s->cov_e != INT_MAX)
+                s->cov_e = lex_view_pos(view, s->cov_e);
+        }
+
+        lex(view, sh, st, bol);
+
+        if (st != buf)
+            free(st);
+    }
+
+    return ret;
+}
+
+
+int qw_synhi_lex_ahead(qw_synhi *sh, qw_block *b, int size)
+/* lexes about size bytes more of the document, after the last valid
+   checkpoint. Returns 1 if there is still more to do */
+{
+    int e = 0;
+
+    if (sh != NULL) {
+        qw_lexstate buf[QW_LEX_SECTIONS], *st = buf;
+        qw_lex *l;
+
+        qw_synhi_optimize(sh);
+        l = lex_cache(b->chain, sh);
+
+        if (sh->n_sections > QW_LEX_SECTIONS)
+            st = malloc(sizeof(qw_lexstate) * sh->n_sections);
+
+        while (size > 0 && (e = lex_step(l, sh, b, st, INT_MAX)) > 0)
+            size -= e;
+
+        if (st != buf)
+            free(st);
+    }
+
+    return e > 0;
+}
+
+
+int qw_synhi_ready(qw_synhi *sh, qw_block *b, int apos)
+/* tests if the state of the sections at apos can be found right away */
+{
+    qw_lex *l = b->chain->lex;
+    int k;
+
+    if (sh == NULL || l == NULL || l->sh != sh)
+        return 0;
+
+    k = lex_find_point(l, apos);
+
+    return k < l->valid - 1 || apos - l->apos[k] <= QW_LEX_BUDGET;
+}
+
+
+void qw_synhi_changed(qw_chain *c, int apos, int size)
+/* updates the checkpoints after size bytes inserted
+   at apos (or deleted, if negative) */
+{
+    qw_lex *l = c->lex;
+    int z = sizeof(qw_lexstate) * l->n_sections;
+    int n, m;
+
+    for (n = m = 0; n < l->count; n++) {
+        int a = l->apos[n];
+
+        if (a <= apos) {
+            /* before the change: untouched */
+        }
+        else
+        if (size < 0 && a <= apos - size) {
+            /* deleted */
+            continue;
+        }
+        else {
+            /* after the change: move it, but it's unsure */
+            a += size;
+
+            if (l->valid > m)
+                l->valid = m;
+        }
+
+        l->apos[m] = a;
+
+        if (m != n)
+            memcpy(lex_point(l, m), lex_point(l, n), z);
+
+        m++;
+    }
+
+    l->count = m;
+
+    if (l->valid > m)
+        l->valid = m;
+}
+
+
+void qw_synhi_release(qw_chain *c)
+/* frees the checkpoint cache of a chain */
+{
+    qw_lex *l = c->lex;
+
+    if (l != NULL) {
+        free(l->data);
+        free(l->attr);
+        free(l->apos);
+        free(l->state);
+        free(l);
+
+        c->lex = NULL;
+    }
+}
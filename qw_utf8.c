@@ -14,8 +14,8 @@ qw_block *qw_utf8_move(qw_block *b, int *pos, int inc)
 /* moves to the previous/next utf8 character */
 {
     while ((b = qw_block_move(b, *pos, pos, inc)) != NULL) {
-        /* if it's not a continuation byte, done */
-        if ((b->data[*pos] & 0xc0) != 0x80)
+        /* if it's EOF or not a continuation byte, done */
+        if (*pos == b->used || (b->data[*pos] & 0xc0) != 0x80)
             break;
     }
 
@@ -63,7 +63,7 @@ int qw_utf8_get_char(qw_block *b, int pos, char *buf)
         char c;
 
         /* store continuation bytes */
-        if (((c = b->data[pos]) & 0xc0) == 0x80)
+        if (pos < b->used && ((c = b->data[pos]) & 0xc0) == 0x80)
             buf[size++] = c;
         else
             break;
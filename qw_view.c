@@ -5,18 +5,18 @@
 #include <stdlib.h>
 #include <string.h>
 
-int qw_view_row_size(qw_block *b, int pos, int width)
-/* returns the size of a view row in bytes */
+static int row_size(qw_block *b, int pos, int width, int *eol)
+/* returns the size of a view row in bytes, and in eol, the bytes up to
+   the end of the line if it ends it (0 otherwise) */
 {
     int w = 0;
     char uchr[32] = "";
     int cnt = 0;
     int p = pos;
     int size = -1;
+    int csz = -1;
 
     while (b && uchr[0] != '\n') {
-        int csz;
-
         /* get one utf8 char */
         b = qw_utf8_get_char_and_move(b, &p, uchr, &csz);
 
@@ -30,8 +30,10 @@ int qw_view_row_size(qw_block *b, int pos, int width)
         w += qw_unicode_width(qw_utf8_decode(uchr, csz));
 
         /* if this char would overflow the width, finish */
-        if (w > width)
+        if (w > width) {
+            uchr[0] = '\0';
             break;
+        }
 
         /* count new bytes */
         cnt += csz;
@@ -45,39 +47,237 @@ int qw_view_row_size(qw_block *b, int pos, int width)
     if (b == NULL || size == -1)
         size = cnt;
 
+    if (size != cnt || (csz != 0 && uchr[0] != '\n'))
+        *eol = 0;
+    else
+        /* the newline may have taken continuation bytes after it */
+        *eol = csz == 0 ? size : size - csz + 1;
+
     return size;
 }
 
 
-int qw_view_get_col_0(qw_block *b, int apos, int width, int *size)
-/* returns the absolute position of column #0 */
+/* The rows of the last used physical lines are kept in a cache in the
+   chain, as the ends of each row. The rows of a line are calculated
+   only as far as needed, and a change drops the lines it touches (or
+   may touch, if not known up to their end) and moves the ones after it. */
+
+static int rows_ext(qw_rowline *l)
+/* returns the size of the known rows of a line */
 {
-    int p;
-    int ac0;
+    return l->n ? l->end[l->n - 1] : 0;
+}
 
-    /* convert to relative */
-    b = qw_block_abs_to_rel(b, apos, &p);
 
-    /* get the first byte of the physical line */
-    b = qw_block_move_bol(b, &p);
+static int rows_len(qw_rowline *l)
+/* returns the size of the known part of a line (its last row
+   can go past its end, taking continuation bytes of a newline) */
+{
+    return l->done ? l->eol : rows_ext(l);
+}
+
 
-    /* convert to absolute */
-    ac0 = qw_block_rel_to_abs(b, p);
+static void rows_extend(qw_block *b, qw_rowline *l, int apos, int width)
+/* calculates more rows of a line until apos is in them */
+{
+    int i, ext = rows_ext(l);
 
-    while (b != NULL) {
-        /* calculate row size */
-        *size = qw_view_row_size(b, p, width);
+    b = qw_block_abs_to_rel(b, l->bol + ext, &i);
 
-        if (*size == 0)
+    while (!l->done && apos >= l->bol + ext) {
+        int size, eol;
+
+        if (b == NULL || (size = row_size(b, i, width, &eol)) == 0) {
+            l->done = 1;
+            l->eol  = ext;
             break;
+        }
+
+        if (l->n == l->size) {
+            l->size = l->size ? l->size * 2 : 16;
+            l->end  = realloc(l->end, l->size * sizeof(int));
+        }
 
-        /* if apos is between this column #0 and the end, done */
-        if (apos >= ac0 && apos < ac0 + *size)
+        l->done = eol != 0;
+        l->eol  = ext + eol;
+
+        ext += size;
+        l->end[l->n++] = ext;
+
+        b = qw_block_move(b, i, &i, size);
+    }
+}
+
+
+static qw_rowline *rows_line(qw_block *b, int apos, int width, int *r)
+/* returns the cached line with the row that holds apos, and
+   its row number in r (the number of rows if it's not there) */
+{
+    qw_chain *c = b->chain;
+    qw_rows *rs = c->rows;
+    qw_rowline *l = NULL;
+    int n, lo, hi;
+
+    if (rs == NULL) {
+        rs = c->rows = calloc(1, sizeof(qw_rows));
+        rs->width = -1;
+    }
+
+    if (rs->width != width) {
+        /* all calculated for another width */
+        for (n = 0; n < QW_ROWS_LINES; n++) {
+            rs->line[n].bol = -1;
+            rs->line[n].n   = 0;
+        }
+
+        rs->width = width;
+    }
+
+    /* is it in an already known row? */
+    for (n = 0; n < QW_ROWS_LINES; n++) {
+        qw_rowline *t = &rs->line[n];
+
+        if (t->bol != -1 && apos >= t->bol && apos < t->bol + rows_len(t)) {
+            l = t;
             break;
+        }
+    }
+
+    if (l == NULL) {
+        int i, bol = -1;
+        qw_block *bb;
+
+        /* find the physical line: right after a known one? */
+        for (n = 0; n < QW_ROWS_LINES; n++) {
+            qw_rowline *t = &rs->line[n];
+
+            if (t->bol != -1 && t->done && apos == t->bol + t->eol) {
+                bol = apos;
+                break;
+            }
+        }
+
+        if (bol == -1) {
+            bb  = qw_block_abs_to_rel(b, apos, &i);
+            bb  = qw_block_move_bol(bb, &i);
+            bol = qw_block_rel_to_abs(bb, i);
+        }
+
+        for (n = 0; n < QW_ROWS_LINES; n++) {
+            if (rs->line[n].bol == bol) {
+                l = &rs->line[n];
+                break;
+            }
+        }
+
+        if (l == NULL) {
+            /* not there: reuse the least recently used one */
+            l = &rs->line[0];
+
+            for (n = 1; n < QW_ROWS_LINES; n++) {
+                if (rs->line[n].stamp < l->stamp)
+                    l = &rs->line[n];
+            }
+
+            l->bol  = bol;
+            l->n    = 0;
+            l->done = 0;
+        }
+
+        rows_extend(b, l, apos, width);
+    }
+
+    l->stamp = ++rs->clock;
+
+    /* find the first row that ends after apos */
+    lo = 0;
+    hi = l->n;
+    apos -= l->bol;
+
+    while (lo < hi) {
+        int m = (lo + hi) / 2;
+
+        if (l->end[m] > apos)
+            hi = m;
+        else
+            lo = m + 1;
+    }
+
+    *r = lo;
+
+    return l;
+}
 
-        /* keep moving */
-        b = qw_block_move(b, p, &p, *size);
-        ac0 += *size;
+
+void qw_view_changed(qw_chain *c, int apos, int size)
+/* updates the row cache after size bytes inserted
+   at apos (or deleted, if negative) */
+{
+    int n;
+
+    for (n = 0; n < QW_ROWS_LINES; n++) {
+        qw_rowline *l = &c->rows->line[n];
+
+        if (l->bol == -1)
+            continue;
+
+        if (size > 0 ? apos < l->bol : apos - size < l->bol)
+            /* after the change: just move */
+            l->bol += size;
+        else
+        if (apos <= l->bol + rows_ext(l) || !l->done) {
+            /* touched, or not known up to its end, where its last
+               row may have looked ahead into the change: forget it */
+            l->bol = -1;
+            l->n   = 0;
+        }
+    }
+}
+
+
+void qw_view_release(qw_chain *c)
+/* frees the row cache of a chain */
+{
+    if (c->rows != NULL) {
+        int n;
+
+        for (n = 0; n < QW_ROWS_LINES; n++)
+            free(c->rows->line[n].end);
+
+        free(c->rows);
+        c->rows = NULL;
+    }
+}
+
+
+int qw_view_row_size(qw_block *b, int pos, int width)
+/* returns the size of a view row in bytes */
+{
+    int eol, r, apos = qw_block_rel_to_abs(b, pos);
+    qw_rowline *l = rows_line(b, apos, width, &r);
+
+    /* only rows starting where the line rows do are cached */
+    if (r < l->n && apos == l->bol + (r ? l->end[r - 1] : 0))
+        return l->end[r] - (r ? l->end[r - 1] : 0);
+
+    return row_size(b, pos, width, &eol);
+}
+
+
+int qw_view_get_col_0(qw_block *b, int apos, int width, int *size)
+/* returns the absolute position of column #0 */
+{
+    int r, ac0;
+    qw_rowline *l = rows_line(b, apos, width, &r);
+
+    if (r < l->n) {
+        ac0   = l->bol + (r ? l->end[r - 1] : 0);
+        *size = l->end[r] - (r ? l->end[r - 1] : 0);
+    }
+    else {
+        /* beyond the rows (e.g. a char wider than the width) */
+        ac0   = l->bol + rows_ext(l);
+        *size = 0;
     }
 
     /* size also keeps the size of the row */
@@ -150,51 +350,68 @@ int qw_view_set_col(qw_block *b, int ac0, int col, int width)
 }
 
 
-int qw_view_fix_vpos(qw_block *b, int vpos, int cpos, int wdth, int hght)
-/* fixes the vpos for the cursor always be visible */
+int qw_view_move_rows(qw_block *b, int apos, int rows, int width)
+/* returns the position after moving a number of rows down
+   (or up, if negative), keeping the column */
 {
-    int i;
-    int size, h = 0;
-    int *ac0 = NULL;
+    int i, col, ac0, size, moved = 0;
 
-    if (cpos < vpos) {
-        /* cpos above vpos: just set it the col #0 for cpos */
-        vpos = qw_view_get_col_0(b, cpos, wdth, &size);
-        goto end;
-    }
+    /* the column is taken only once */
+    ac0 = qw_view_get_col_0(b, apos, width, &size);
+    col = qw_view_width_diff(b, ac0, apos);
+
+    b = qw_block_abs_to_rel(b, ac0, &i);
+
+    while (rows > 0) {
+        int ni;
+        qw_block *nb = qw_block_move(b, i, &ni, size);
 
-    b = qw_block_abs_to_rel(b, vpos, &i);
+        /* already in the last row? */
+        if (nb == NULL)
+            break;
 
-    /* allocate a circular buffer to store a double set of col #0 addresses */
-    hght *= 2;
-    ac0 = malloc(sizeof(int) * hght);
+        b    = nb;
+        i    = ni;
+        ac0 += size;
+        size = qw_view_row_size(b, i, width);
+        moved++;
+        rows--;
+    }
 
-    /* fill the first half with the current vpos */
-    for (h = 0; h < hght / 2; h++)
-        ac0[h] = vpos;
-    h = 0;
+    while (rows < 0 && ac0 > 0) {
+        int p = ac0;
 
-    for (;;) {
-        /* store */
-        ac0[(h + hght / 2 - 2) % hght] = vpos;
+        /* the row with the byte before this one */
+        ac0 = qw_view_get_col_0(b, ac0 - 1, width, &size);
+        b   = qw_block_move(b, i, &i, ac0 - p);
+        moved++;
+        rows++;
+    }
 
-        /* get the row size */
-        size = qw_view_row_size(b, i, wdth);
+    return moved ? qw_view_set_col(b, ac0, col, width) : apos;
+}
 
-        /* if cpos is inside this line, set as valid */
-        if (cpos >= vpos && cpos <= vpos + size)
-            break;
 
-        /* keep moving */
-        b = qw_block_move(b, i, &i, size);
-        vpos += size;
-        h++;
+int qw_view_fix_vpos(qw_block *b, int vpos, int cpos, int wdth, int hght)
+/* fixes the vpos for the cursor always be visible */
+{
+    int size, ac0, h;
+
+    if (cpos < vpos) {
+        /* cpos above vpos: just set it the col #0 for cpos */
+        return qw_view_get_col_0(b, cpos, wdth, &size);
     }
 
-    vpos = ac0[h % hght];
+    if (cpos == vpos)
+        return vpos;
+
+    /* the row of the cursor (one ending exactly at cpos counts) */
+    ac0 = qw_view_get_col_0(b, cpos - 1, wdth, &size);
 
-end:
-    free(ac0);
+    /* go up from there, never further than a screen; if vpos is
+       found on the way, the cursor is already visible */
+    for (h = 0; h < hght - 2 && ac0 > vpos; h++)
+        ac0 = qw_view_get_col_0(b, ac0 - 1, wdth, &size);
 
-    return vpos;
+    return ac0 > vpos ? ac0 : vpos;
 }
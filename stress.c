@@ -3,9 +3,18 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <utime.h>
 #include <locale.h>
 
 #include "qw.h"
@@ -124,7 +133,8 @@ void test_block(void)
     do_test("sizeof get 3", z == 18);
     do_test("insert & get 3", strncmp(str, "ab---cde12345ABCDE", z) == 0);
 
-    b = qw_block_insert_str(b->next, 0, "!!!", 3);
+    b = qw_block_abs_to_rel(b, 5, &i);
+    b = qw_block_insert_str(b, i, "!!!", 3);
 
     if (verbose)
         qw_block_dump(qw_block_first(b), stdout);
@@ -273,6 +283,442 @@ void test_block(void)
 #endif
 }
 
+static qw_block *build_chain(int n_blocks)
+/* builds a chain of blocks of different sizes */
+{
+    qw_block *b = NULL;
+    int n;
+
+    for (n = 0; n < n_blocks; n++) {
+        b = qw_block_new(b, NULL);
+        b = qw_block_insert_str(b, 0, "0123456789abcdef", n % 17);
+    }
+
+    return b;
+}
+
+
+void test_block_index(void)
+{
+    qw_block *b, *t, *r;
+    int n, i, a, ok;
+
+    b = build_chain(2000);
+
+    do_test("index first", qw_block_first(b)->prev == NULL);
+    do_test("index last", qw_block_last(qw_block_first(b))->next == NULL);
+
+    /* compare with a walk along the chain */
+    ok = 1;
+    a = 0;
+    for (t = qw_block_first(b); t != NULL; t = t->next) {
+        for (n = 0; n < t->used; n++) {
+            if (qw_block_rel_to_abs(t, n) != a + n)
+                ok = 0;
+
+            r = qw_block_abs_to_rel(b, a + n, &i);
+
+            if (r != t || i != n)
+                ok = 0;
+        }
+
+        a += t->used;
+    }
+
+    do_test("index rel_to_abs & abs_to_rel", ok);
+
+    r = qw_block_abs_to_rel(b, a, &i);
+    do_test("index abs_to_rel EOF", r == qw_block_last(b) && i == r->used);
+    do_test("index abs_to_rel beyond EOF", qw_block_abs_to_rel(b, a + 1, &i) == NULL);
+    do_test("index abs_to_rel before BOF", qw_block_abs_to_rel(b, -1, &i) == NULL);
+
+    r = qw_block_move(qw_block_first(b), 0, &i, a / 2);
+    do_test("index long move", qw_block_rel_to_abs(r, i) == a / 2);
+    r = qw_block_move(r, i, &i, -(a / 3));
+    do_test("index long move back", qw_block_rel_to_abs(r, i) == a / 2 - a / 3);
+
+    /* truncate the chain in the middle */
+    r = qw_block_abs_to_rel(b, a / 2, &i);
+    t = r->prev;
+    qw_block_destroy(r);
+    do_test("index truncate", qw_block_last(t) == t &&
+        qw_block_abs_to_rel(t, qw_block_rel_to_abs(t, t->used), &i) == t);
+
+    qw_block_destroy(qw_block_first(t));
+}
+
+
+static int chain_check(qw_block *b, int *n_empty)
+/* checks the index of a chain against a walk. Returns the number of blocks */
+{
+    qw_block *t;
+    int n = 0, a = 0;
+
+    *n_empty = 0;
+
+    for (t = qw_block_first(b); t != NULL; t = t->next) {
+        if (qw_block_rel_to_abs(t, 0) != a)
+            return -1;
+
+        if (t->used == 0)
+            (*n_empty)++;
+
+        a += t->used;
+        n++;
+    }
+
+    return n;
+}
+
+
+static int chain_util(qw_block *b)
+/* calculates the memory utilisation of a chain with a walk */
+{
+    long long used = 0, size = 0;
+    qw_addbuf *a;
+
+    if (b->chain->pieces) {
+        for (a = b->chain->add; a; a = a->prev) {
+            used += a->used;
+            size += a->size;
+        }
+    }
+
+    for (b = qw_block_first(b); b != NULL; b = b->next) {
+        if (b->size) {
+            used += b->used;
+            size += b->size;
+        }
+    }
+
+    return size ? (int) (used * 100 / size) : 100;
+}
+
+
+void test_block_compact(void)
+{
+    static char s1[65536], s2[65536];
+    qw_block *b, *t;
+    qw_doc *doc;
+    int n, i, z1, z2, n1, n2, e1, e2, u1, u2;
+
+    /* fragment a chain with short edits all over */
+    b = qw_block_new(NULL, NULL);
+    i = 0;
+    for (n = 0; n < 400; n++)
+        b = qw_block_insert_str_and_move(b, &i, "0123456789abcdefghijklmnopqrstuvwxyz\n", 37);
+
+    for (n = 0; n < 2000; n++) {
+        b = qw_block_abs_to_rel(b, (n * 7919) % 10000, &i);
+
+        if (n % 3 == 0)
+            qw_block_delete(b, i, 5);
+        else
+            b = qw_block_insert_str(b, i, "+-", 2);
+    }
+
+    /* empty a whole region */
+    b = qw_block_abs_to_rel(b, 1000, &i);
+    qw_block_delete(b, i, 6000);
+
+    /* hold an empty block */
+    for (t = qw_block_first(b); t && t->used; t = t->next);
+    b = t ? t : b;
+
+    z1 = qw_block_get_str(qw_block_first(b), 0, s1, sizeof(s1));
+    n1 = chain_check(b, &e1);
+    u1 = qw_block_util(b);
+
+    n = 0;
+    do {
+        b = qw_block_compact(b, 7);
+        n++;
+    } while (b->chain->compacting);
+
+    z2 = qw_block_get_str(qw_block_first(b), 0, s2, sizeof(s2));
+    n2 = chain_check(b, &e2);
+    u2 = qw_block_util(b);
+
+    do_test("compact 1 (incremental)", n > 1);
+    do_test("compact 2 (same content)", z1 == z2 && memcmp(s1, s2, z1) == 0);
+    do_test("compact 3 (index ok)", n2 > 0);
+    do_test("compact 4 (fewer blocks)", n2 < n1);
+    do_test("compact 5 (no empty blocks)", e1 > 0 && e2 == 0);
+    do_test("compact 6 (better utilisation)", u2 >= u1);
+    do_test("compact 7 (returned block)", b->chain->first == qw_block_first(b) &&
+        qw_block_rel_to_abs(b, 0) >= 0);
+
+    /* nothing to do until it changes again */
+    t = qw_block_compact(b, 1);
+    do_test("compact 8 (clean)", t == b && !b->chain->compacting);
+
+    /* edit in the middle of a pass */
+    qw_block_delete(qw_block_first(b), 0, 1);
+    b = qw_block_compact(b, 1);
+    b = qw_block_insert_str(qw_block_last(b), 0, "X", 1);
+
+    while (b->chain->compacting || b->chain->dirty)
+        b = qw_block_compact(b, 3);
+
+    z2 = qw_block_get_str(qw_block_first(b), 0, s2, sizeof(s2));
+    do_test("compact 9 (edited during pass)", z2 == z1 && s2[0] == s1[1] &&
+        chain_check(b, &e2) > 0 && e2 == 0);
+
+    qw_block_destroy(qw_block_first(b));
+
+    /* a single empty block is kept */
+    b = qw_block_new(NULL, NULL);
+    b = qw_block_insert_str(b, 0, "abc", 3);
+    qw_block_delete(qw_block_first(b), 0, 3);
+
+    do
+        b = qw_block_compact(b, 10);
+    while (b->chain->compacting);
+
+    do_test("compact 10 (empty chain)", b != NULL && b->used == 0 &&
+        b->prev == NULL && b->next == NULL);
+    qw_block_destroy(b);
+
+    /* documents keep the utilisation figures */
+    doc = qw_doc_new(NULL, NULL);
+    i = 0;
+    for (n = 0; n < 200; n++) {
+        doc->b = qw_block_abs_to_rel(doc->b, n * 3 / 2, &i);
+        doc->b = qw_block_insert_str(doc->b, i, "abc", 3);
+    }
+
+    while (qw_doc_compact(doc, 5));
+
+    do_test("compact 11 (doc utilisation)", doc->util_after >= doc->util_before &&
+        doc->util_after == qw_block_util(doc->b));
+    do_test("compact 12 (doc idle)", qw_doc_compact(doc, 5) == 0);
+
+    qw_doc_destroy(doc);
+
+    /* only the changed range is visited */
+    b = qw_block_new(NULL, NULL);
+    i = 0;
+    for (n = 0; n < 2000; n++)
+        b = qw_block_insert_str_and_move(b, &i, "0123456789abcdefghijklmnopqrstuvwxyz\n", 37);
+
+    for (n = 0; n < 1000; n++) {
+        b = qw_block_abs_to_rel(b, (n * 7919) % 70000, &i);
+        b = qw_block_insert_str(b, i, "+-", 2);
+    }
+
+    u1 = chain_util(b);
+    do_test("compact 13 (utilisation kept)", qw_block_util(b) == u1);
+
+    while ((b = qw_block_compact(b, 100))->chain->compacting);
+    do_test("compact 14 (utilisation after pass)", qw_block_util(b) == chain_util(b));
+
+    b = qw_block_abs_to_rel(b, 40000, &i);
+    qw_block_delete(b, i, 10);
+    b = qw_block_insert_str(b, i, "0123", 4);
+    b = qw_block_compact(b, 6);
+    do_test("compact 15 (range only)", !b->chain->compacting && !b->chain->dirty);
+    do_test("compact 16 (utilisation after range)", qw_block_util(b) == chain_util(b) &&
+        chain_check(b, &e2) > 0 && e2 == 0);
+
+    qw_block_destroy(qw_block_first(b));
+}
+
+
+void test_search(void)
+{
+    static const char *needles[] = {
+        "a", "\n", "ab", "ba\n", "abab", "aabba", "b\nab\na", "abababab", "zz", NULL
+    };
+    char flat[8192], str[64];
+    qw_block *b, *r;
+    int n, m, s, q, i, z, size, ok_f = 1, ok_b = 1;
+    unsigned int seed = 1;
+
+    /* a chain of short blocks with a small alphabet */
+    b = NULL;
+    size = 0;
+    for (n = 0; n < 800; n++) {
+        b = qw_block_new(b, NULL);
+        z = n % 11;
+
+        for (m = 0; m < z; m++) {
+            seed = seed * 1103515245 + 12345;
+            str[m] = "aab\n"[(seed >> 16) % 4];
+        }
+
+        b = qw_block_insert_str(b, 0, str, z);
+        memcpy(&flat[size], str, z);
+        size += z;
+    }
+
+    for (n = 0; needles[n] != NULL; n++) {
+        const char *nd = needles[n];
+        int l = strlen(nd);
+
+        for (s = 0; s <= size; s += 7) {
+            /* forward, by brute force */
+            for (q = s; q + l <= size && memcmp(&flat[q], nd, l) != 0; q++);
+
+            r = qw_block_abs_to_rel(b, s, &i);
+            r = qw_block_search(r, &i, nd, l, 1);
+
+            if (q + l > size ? r != NULL : (r == NULL || qw_block_rel_to_abs(r, i) != q))
+                ok_f = 0;
+
+            /* backwards */
+            for (q = s; q >= 0 && (q + l > size || memcmp(&flat[q], nd, l) != 0); q--);
+
+            r = qw_block_abs_to_rel(b, s, &i);
+            r = qw_block_search(r, &i, nd, l, -1);
+
+            if (q < 0 ? r != NULL : (r == NULL || qw_block_rel_to_abs(r, i) != q))
+                ok_b = 0;
+        }
+    }
+
+    do_test("search fwd (straddling blocks)", ok_f);
+    do_test("search bwd (straddling blocks)", ok_b);
+
+    /* line boundaries */
+    for (s = 0; s < size; s += 5) {
+        r = qw_block_abs_to_rel(b, s, &i);
+        r = qw_block_move_bol(r, &i);
+
+        for (q = s; q > 0 && flat[q - 1] != '\n'; q--);
+
+        if (qw_block_rel_to_abs(r, i) != q)
+            ok_b = 0;
+
+        r = qw_block_abs_to_rel(b, s, &i);
+        r = qw_block_move_eol(r, &i);
+
+        for (q = s; q < size && flat[q] != '\n'; q++);
+
+        if (qw_block_rel_to_abs(r, i) != q)
+            ok_f = 0;
+    }
+
+    do_test("search bol", ok_b);
+    do_test("search eol", ok_f);
+
+    qw_block_destroy(qw_block_first(b));
+}
+
+
+void test_lines(void)
+{
+    static char flat[65536];
+    char str[64];
+    qw_block *b, *r;
+    int n, m, i, q, l, size, ok_l = 1, ok_r = 1;
+    unsigned int seed = 7;
+
+    b = qw_block_new(NULL, NULL);
+    size = 0;
+
+    for (n = 0; n < 3000; n++) {
+        int p = size ? (int) (seed % (size + 1)) : 0;
+
+        seed = seed * 1103515245 + 12345;
+
+        r = qw_block_abs_to_rel(b, p, &i);
+
+        if (n % 4 == 3 && p < size) {
+            /* delete */
+            int z = 1 + (seed >> 16) % 9;
+
+            if (p + z > size)
+                z = size - p;
+
+            qw_block_delete(r, i, z);
+            memmove(&flat[p], &flat[p + z], size - p - z);
+            size -= z;
+        }
+        else {
+            /* insert */
+            int z = 1 + (seed >> 16) % 13;
+
+            for (m = 0; m < z; m++) {
+                seed = seed * 1103515245 + 12345;
+                str[m] = "ab\n"[(seed >> 16) % 3];
+            }
+
+            b = qw_block_insert_str(r, i, str, z);
+            memmove(&flat[p + z], &flat[p], size - p);
+            memcpy(&flat[p], str, z);
+            size += z;
+        }
+
+        /* query after some changes (lazy counts) */
+        if (n % 50 == 0) {
+            for (q = 0, l = 0; q <= size; q++) {
+                r = qw_block_abs_to_rel(b, q, &i);
+
+                if (qw_block_line(r, i) != l)
+                    ok_l = 0;
+
+                if (q < size && flat[q] == '\n')
+                    l++;
+            }
+
+            /* every line start */
+            r = qw_block_line_to_rel(b, 0, &i);
+            if (r == NULL || qw_block_rel_to_abs(r, i) != 0)
+                ok_r = 0;
+
+            for (q = 0, l = 1; q < size; q++) {
+                if (flat[q] == '\n') {
+                    r = qw_block_line_to_rel(b, l++, &i);
+
+                    if (r == NULL || qw_block_rel_to_abs(r, i) != q + 1)
+                        ok_r = 0;
+                }
+            }
+
+            if (qw_block_line_to_rel(b, l, &i) != NULL)
+                ok_r = 0;
+        }
+
+        if (n % 700 == 0)
+            while ((b = qw_block_compact(b, 100))->chain->compacting);
+    }
+
+    do_test("lines (line of position)", ok_l);
+    do_test("lines (position of line)", ok_r);
+
+    qw_block_destroy(qw_block_first(b));
+}
+
+
+void bench_block_index(void)
+{
+    struct timeval st, et;
+    int n;
+
+    printf("\nabs_to_rel + rel_to_abs benchmark\n");
+
+    for (n = 1000; n <= 256000; n *= 4) {
+        qw_block *b = build_chain(n);
+        int size = qw_block_rel_to_abs(b, b->used);
+        int m, i = 0;
+        double t;
+
+        diff_time(&st, NULL);
+
+        for (m = 0; m < 1000000; m++) {
+            qw_block *r = qw_block_abs_to_rel(b, (int) ((m * 7919L) % size), &i);
+            i = qw_block_rel_to_abs(r, i);
+        }
+
+        t = diff_time(&st, &et);
+
+        printf("%7d blocks: %.1f ns per lookup\n", n, t * 1000.0);
+
+        qw_block_destroy(qw_block_first(b));
+    }
+}
+
+
 void test_journal(void)
 {
     char str[STRLEN];
@@ -313,26 +759,26 @@ void test_journal(void)
     j = j->prev;
     z = qw_block_get_str(b, 0, str, 7);
     do_test("jrnl 5 (undo 4)", strncmp(str, " string", z) == 0);
-    do_test("jrnl clean 1", j->clean == 1);
+    do_test("jrnl clean 1", qw_journal_is_clean(j));
 
     b = qw_journal_apply(b, j, 0);
     j = j->prev;
     z = qw_block_get_str(b, 0, str, STRLEN);
     do_test("jrnl 6 (undo 3)", strncmp(str, "new string\nmore", z) == 0);
-    do_test("jrnl clean 2", j->clean == 0);
+    do_test("jrnl clean 2", !qw_journal_is_clean(j));
 
     /* redo */
     j = j->next;
     b = qw_journal_apply(b, j, 1);
     z = qw_block_get_str(b, 0, str, 7);
     do_test("jrnl 7 (redo)", strncmp(str, " string", z) == 0);
-    do_test("jrnl clean 3", j->clean == 1);
+    do_test("jrnl clean 3", qw_journal_is_clean(j));
 
     j = j->next;
     b = qw_journal_apply(b, j, 1);
     z = qw_block_get_str(b, 0, str, STRLEN);
     do_test("jrnl 8 (redo)", strncmp(str, "incredible string\nmore", z) == 0);
-    do_test("jrnl clean 4", j->clean == 0);
+    do_test("jrnl clean 4", !qw_journal_is_clean(j));
     qw_journal_mark_clean(j);
 
     /* undo again */
@@ -340,7 +786,7 @@ void test_journal(void)
     j = j->prev;
     z = qw_block_get_str(qw_block_first(b), 0, str, 7);
     do_test("jrnl 9 (undo 4)", strncmp(str, " string", z) == 0);
-    do_test("jrnl clean 5", j->clean == 0);
+    do_test("jrnl clean 5", !qw_journal_is_clean(j));
 
     b = qw_journal_apply(b, j, 0);
     j = j->prev;
@@ -489,116 +935,779 @@ void test_journal(void)
 }
 
 
-void test_utf8(void)
+static qw_block *type_str(qw_block *b, qw_journal **j, int *apos, const char *str)
+/* types a string key by key, as op_char does */
 {
-    char str[STRLEN];
-    qw_block *b;
-    char *ptr;
-    int z, i;
+    int i;
 
-    b = qw_block_new(NULL, NULL);
+    while (*str) {
+        b = qw_block_abs_to_rel(b, *apos, &i);
+        *j = qw_journal_new(1, b, i, str, 1, *j);
+        b = qw_journal_apply(b, *j, 1);
+        *j = qw_journal_merge(*j);
 
-    ptr = "aña—z";
-    b = qw_block_insert_str(b, 0, ptr, strlen(ptr));
-    i = 0;
-    b = qw_utf8_move(b, &i, 1);
-    do_test("utf8 fwd 1", i == 1);
-    b = qw_utf8_move(b, &i, 1);
-    do_test("utf8 fwd 2", i == 3);
-    b = qw_utf8_move(b, &i, 1);
-    do_test("utf8 fwd 3", i == 4);
-    b = qw_utf8_move(b, &i, 1);
-    do_test("utf8 fwd 4", i == 7);
-    do_test("utf8 fwd 5", b->data[i] == 'z');
-    do_test("utf8 fwd NULL on EOF", qw_utf8_move(b, &z, 1) == NULL);
-    b = qw_utf8_move(b, &i, -1);
-    do_test("utf8 bwd 1", i == 4);
-    b = qw_utf8_move(b, &i, -1);
-    do_test("utf8 fwd 2", i == 3);
-    b = qw_utf8_move(b, &i, -1);
-    do_test("utf8 fwd 3", i == 1);
-    b = qw_utf8_move(b, &i, -1);
-    do_test("utf8 fwd 4", i == 0);
-    do_test("utf8 fwd NULL on BOF", qw_utf8_move(b, &z, -1) == NULL);
+        (*apos)++;
+        str++;
+    }
 
-    b = qw_block_new(NULL, NULL);
-    ptr = "\x61\xC3\xB1\x61\xE2\x80\x94\x7A\xEE\x80\x80\x5A\xEF\xBF\xBD\x57";
-    b = qw_block_insert_str(b, 0, ptr, strlen(ptr));
-    i = 0;
+    return b;
+}
 
-    b = qw_utf8_get_char_and_move(b, &i, str, &z);
-    do_test("utf char 1", z == 1 && str[0] == 'a');
-    do_test("utf decode 1", qw_utf8_decode(str, z) == 0x61);
-    b = qw_utf8_get_char_and_move(b, &i, str, &z);
-    do_test("utf char 2", z == 2);
-    do_test("utf decode 2", qw_utf8_decode(str, z) == 0xf1);
-    b = qw_utf8_get_char_and_move(b, &i, str, &z);
-    do_test("utf char 3", z == 1 && str[0] == 'a');
-    b = qw_utf8_get_char_and_move(b, &i, str, &z);
-    do_test("utf char 4", z == 3 && memcmp("\xe2\x80\x94", str, 3) == 0);
-    do_test("utf decode 3", qw_utf8_decode(str, z) == 0x2014);  /* m-dash */
-    b = qw_utf8_get_char_and_move(b, &i, str, &z);
-    do_test("utf char 5", z == 1 && str[0] == 'z');
-    b = qw_utf8_get_char_and_move(b, &i, str, &z);
-    do_test("utf char 6", z == 3 && memcmp("\xee\x80\x80", str, 3) == 0);
-    do_test("utf decode 4", qw_utf8_decode(str, z) == 0xe000);  /* private use */
-    b = qw_utf8_get_char_and_move(b, &i, str, &z);
-    do_test("utf char 7", z == 1 && str[0] == 'Z');
-    b = qw_utf8_get_char_and_move(b, &i, str, &z);
-    do_test("utf char 8", z == 3 && memcmp("\xef\xbf\xbd", str, 3) == 0);
-    do_test("utf decode 5", qw_utf8_decode(str, z) == 0xfffd);  /* replacement char */
-    b = qw_utf8_get_char_and_move(b, &i, str, &z);
-    do_test("utf char 9", z == 1 && str[0] == 'W');
-    do_test("utf char at EOF", qw_utf8_get_char_and_move(b, &i, str, &z) == NULL);
-    b = qw_utf8_move(b, &i, -1);
-    b = qw_utf8_get_char_and_move(b, &i, str, &z);
-    do_test("utf char 10", z == 1 && str[0] == 'W');
-    b = qw_utf8_move(b, &i, -1);
-    b = qw_utf8_move(b, &i, -1);
-    b = qw_utf8_get_char_and_move(b, &i, str, &z);
-    do_test("utf char 11", z == 3 && memcmp("\xef\xbf\xbd", str, 3) == 0);
 
-    ptr = "hello";
-    do_test("utf width 1", qw_utf8_str_width(ptr, strlen(ptr)) == 5);
-    ptr = "ができ"; /* katakana */
-    do_test("utf width 3", qw_utf8_str_width(ptr, strlen(ptr)) == 6);
+static qw_block *delete_keys(qw_block *b, qw_journal **j, int *apos, int n, int inc)
+/* deletes n chars forward (inc 0) or backwards (inc -1), as op_del does */
+{
+    int i;
 
-    z = qw_utf8_encode('a', str);
-    do_test("utf8 encode 1 byte", z == 1 && strncmp(str, "a", z) == 0);
-    z = qw_utf8_encode(0xf1, str);
-    do_test("utf8 encode 2 byte", z == 2 && strncmp(str, "\xc3\xb1", z) == 0);
-    z = qw_utf8_encode(0x2014, str);
-    do_test("utf8 encode 3 byte", z == 3 && strncmp(str, "\xe2\x80\x94", z) == 0);
-    z = qw_utf8_encode(0xe000, str);
-    do_test("utf8 encode 3.2 byte", z == 3 && strncmp(str, "\xee\x80\x80", z) == 0);
+    while (n--) {
+        *apos += inc;
+        b = qw_block_abs_to_rel(b, *apos, &i);
+        *j = qw_journal_new(0, b, i, NULL, 1, *j);
+        b = qw_journal_apply(b, *j, 1);
+        *j = qw_journal_merge(*j);
+    }
+
+    return b;
 }
 
 
-void test_view(void)
+void test_journal_merge(void)
 {
-#if 0
-    qw_block *b, *view;
-    int i;
-    char *ptr;
-    int v = 0, sz;
-    int crlf;
-    int cx, cy;
+    char str[STRLEN];
+    const char *data;
+    qw_block *b;
+    qw_journal *j;
+    int z, n, slot, used, apos = 0;
 
     b = qw_block_new(NULL, NULL);
-    i = 0;
+    j = qw_journal_new(0, b, 0, NULL, 0, NULL);
+    qw_journal_mark_clean(j);
 
-    ptr = "First sentence";
-    b = qw_block_insert_str_and_move(b, &i, ptr, strlen(ptr));
-    sz = qw_view_row_size(b, 0, 20);
-    do_test("row_size 1 (EOF)", sz == 14);
+    b = type_str(b, &j, &apos, "hello world");
+    for (n = 0; j->prev; j = j->prev, n++);
+    do_test("jrnl merge 1 (two words, two entries)", n == 2);
 
-    ptr = "\n";
-    b = qw_block_insert_str_and_move(b, &i, ptr, strlen(ptr));
-    sz = qw_view_row_size(b, v, 20);
-    do_test("row_size 2", sz == 15);
+    for (; j->next; j = j->next);
+    do_test("jrnl merge 2 (second word)", j->size == 5 && memcmp(j->data, "world", 5) == 0);
+    do_test("jrnl merge 3 (first word)", j->prev->size == 6 && memcmp(j->prev->data, "hello ", 6) == 0);
 
-    b = qw_block_new(NULL, NULL);
-    i = 0;
+    /* undo is word-sized */
+    b = qw_journal_apply(b, j, 0);
+    j = j->prev;
+    z = qw_block_get_str(qw_block_first(b), 0, str, STRLEN);
+    do_test("jrnl merge 4 (undo word)", z == 6 && memcmp(str, "hello ", 6) == 0);
+
+    b = qw_journal_apply(b, j->next, 1);
+    j = j->next;
+
+    /* a new branch after undo */
+    b = qw_journal_apply(b, j, 0);
+    j = j->prev;
+    apos = 6;
+    b = type_str(b, &j, &apos, "there");
+    do_test("jrnl merge 5 (new branch)", j->size == 5 && j->prev->size == 6 && j->prev->prev->prev == NULL);
+
+    /* a pause starts a new entry */
+    j->stamp -= 5000;
+    b = type_str(b, &j, &apos, "!!");
+    do_test("jrnl merge 6 (pause)", j->size == 2 && j->prev->size == 5);
+
+    /* backspace run */
+    b = delete_keys(b, &j, &apos, 7, -1);
+    z = qw_block_get_str(qw_block_first(b), 0, str, STRLEN);
+    do_test("jrnl merge 7 (backspaces)", z == 6 && memcmp(str, "hello ", 6) == 0);
+    do_test("jrnl merge 8 (one delete entry)", j->op == 0 && j->size == 7 && memcmp(j->data, "there!!", 7) == 0);
+
+    b = qw_journal_apply(b, j, 0);
+    j = j->prev;
+    z = qw_block_get_str(qw_block_first(b), 0, str, STRLEN);
+    do_test("jrnl merge 9 (undo backspaces)", z == 13 && memcmp(str, "hello there!!", 13) == 0);
+
+    /* delete forward run */
+    apos = 0;
+    b = delete_keys(b, &j, &apos, 5, 0);
+    z = qw_block_get_str(qw_block_first(b), 0, str, STRLEN);
+    do_test("jrnl merge 10 (deletes)", z == 8 && memcmp(str, " there!!", 8) == 0);
+    do_test("jrnl merge 11 (one delete entry)", j->size == 5 && memcmp(j->data, "hello", 5) == 0);
+
+    /* a saved entry is never extended */
+    qw_journal_mark_clean(j);
+    b = delete_keys(b, &j, &apos, 1, 0);
+    do_test("jrnl merge 12 (clean not merged)", j->size == 1 && qw_journal_is_clean(j->prev));
+
+    /* the clean entry lost in a new branch is not found again */
+    b = qw_journal_apply(b, j, 0);
+    j = j->prev;
+    qw_journal_mark_clean(j->next);
+    b = delete_keys(b, &j, &apos, 1, 0);
+    for (; j->prev && !qw_journal_is_clean(j); j = j->prev);
+    do_test("jrnl clean 6 (lost in branch)", !qw_journal_is_clean(j));
+
+    /* block chains keep no dead copies in the add buffers */
+    do_test("jrnl merge 13 (no add buffers)", b->chain->pieces ||
+        (b->chain->add == NULL && b->chain->slots.used > 0));
+
+    /* typing grows the entry in its slot */
+    for (j = qw_journal_first(j); j->next; j = j->next);
+    b = type_str(b, &j, &apos, "a");
+    slot = j->slot;
+    used = b->chain->slots.used;
+    data = j->data;
+    b = type_str(b, &j, &apos, "bcd");
+    do_test("jrnl merge 14 (in place)", b->chain->pieces ||
+        (slot && j->data == data && b->chain->slots.used == used &&
+        j->size == 4 && memcmp(j->data, "abcd", 4) == 0));
+
+    for (; j->prev; j = j->prev)
+        b = qw_journal_apply(b, j, 0);
+    qw_journal_destroy(j->next);
+    j->next = NULL;
+    do_test("jrnl merge 15 (copies freed)", b->chain->undo_mem == 0 && b->chain->slots.used == 0);
+
+    qw_block_destroy(qw_block_first(b));
+}
+
+
+void test_journal_spill(void)
+{
+    char str[STRLEN];
+    char *data;
+    qw_block *b;
+    qw_journal *j;
+    long budget = qw_journal_budget;
+    int n, i, z, ok, spilled = 0;
+
+    qw_journal_budget = 16 * 1024;
+
+    /* 128 KB of numbered lines */
+    data = malloc(128 * 1024);
+    for (n = 0; n < 128 * 1024; n += 16)
+        sprintf(&data[n], "%014d\n", n);
+
+    b = qw_block_new(NULL, NULL);
+    j = qw_journal_new(0, b, 0, NULL, 0, NULL);
+    j = qw_journal_new(1, b, 0, data, 128 * 1024, j);
+    b = qw_journal_apply(b, j, 1);
+
+    /* cut big selections, keeping the undo memory under budget */
+    for (n = 0, ok = 1; n < 8; n++) {
+        b = qw_block_abs_to_rel(b, 1000, &i);
+        j = qw_journal_new(0, b, i, NULL, 12 * 1024, j);
+        b = qw_journal_apply(b, j, 1);
+
+        if (b->chain->undo_mem > qw_journal_budget)
+            ok = 0;
+    }
+
+    do_test("jrnl spill 1 (under budget)", ok);
+
+    for (; j->prev; j = j->prev) {
+        if (j->data == NULL)
+            spilled++;
+    }
+
+    do_test("jrnl spill 2 (some spilled)", spilled > 0 || b->chain->pieces);
+
+    for (; j->next; j = j->next);
+
+    /* undo everything back from the log */
+    for (ok = 1; j->prev->prev; j = j->prev) {
+        b = qw_journal_apply(b, j, 0);
+
+        if (b->chain->undo_mem > qw_journal_budget)
+            ok = 0;
+    }
+
+    do_test("jrnl spill 3 (under budget on undo)", ok);
+
+    for (n = 0, ok = 1; n < 128 * 1024; n += STRLEN) {
+        b = qw_block_abs_to_rel(b, n, &i);
+        z = qw_block_get_str(b, i, str, STRLEN);
+
+        if (z != STRLEN || memcmp(str, &data[n], STRLEN) != 0)
+            ok = 0;
+    }
+
+    do_test("jrnl spill 4 (content back)", ok);
+
+    /* and redo again */
+    for (; j->next; ) {
+        j = j->next;
+        b = qw_journal_apply(b, j, 1);
+    }
+
+    do_test("jrnl spill 5 (redo)", qw_block_rel_to_abs(qw_block_last(b), qw_block_last(b)->used) == 32 * 1024);
+
+    /* a payload that can't be read back changes nothing */
+    for (; j->prev && j->data != NULL; j = j->prev);
+
+    if (j->data == NULL) {
+        fclose(b->chain->undo_log);
+        b->chain->undo_log = tmpfile();
+
+        ok = qw_journal_apply(b, j, 0) == NULL &&
+            qw_block_rel_to_abs(qw_block_last(b), qw_block_last(b)->used) == 32 * 1024;
+    }
+    else
+        ok = b->chain->pieces;
+
+    do_test("jrnl spill 6 (read error)", ok);
+
+    qw_block_destroy(qw_block_first(b));
+    free(data);
+
+    qw_journal_budget = budget;
+}
+
+
+static void doc_type(qw_doc *doc, int apos, const char *str)
+/* inserts a string into a document as one journal entry */
+{
+    qw_block *b;
+    int i;
+
+    b = qw_block_abs_to_rel(doc->b, apos, &i);
+    doc->j = qw_journal_new(1, b, i, str, strlen(str), doc->j);
+    doc->b = qw_journal_apply(b, doc->j, 1);
+}
+
+
+static int doc_undo(qw_doc *doc)
+/* undoes as op_undo does. Returns 0 if there is nothing to undo */
+{
+    if (doc->j->prev == NULL)
+        qw_doc_history(doc);
+
+    if (doc->j->prev == NULL)
+        return 0;
+
+    doc->b = qw_journal_apply(doc->b, doc->j, 0);
+    doc->j = doc->j->prev;
+
+    return 1;
+}
+
+
+void test_undo_file(void)
+{
+    char str[STRLEN];
+    struct utimbuf ut;
+    struct stat st;
+    qw_doc *doc;
+    FILE *f;
+    int z;
+
+    f = fopen("stress-undo.out", "wb");
+    fputs("first\n", f);
+    fclose(f);
+
+    /* first session: two changes */
+    doc = qw_doc_new(NULL, "stress-undo.out");
+    do_test("undo file 1 (no history)", doc->undo == NULL);
+    doc_type(doc, 5, " line");
+    doc_type(doc, 11, "second\n");
+    qw_doc_save(doc);
+    qw_doc_destroy(doc);
+
+    do_test("undo file 2 (sidecar)", stat(".stress-undo.out.qwu", &st) == 0);
+
+    /* second session: one more change, saved before undoing */
+    doc = qw_doc_new(NULL, "stress-undo.out");
+    do_test("undo file 3 (history mapped)", doc->undo != NULL && !doc->undo_loaded);
+    doc_type(doc, 0, "zero\n");
+    qw_doc_save(doc);
+    qw_doc_destroy(doc);
+
+    /* third session: undo everything */
+    doc = qw_doc_new(NULL, "stress-undo.out");
+    do_test("undo file 4 (undo 1)", doc_undo(doc) && doc->undo_loaded);
+    z = qw_block_get_str(qw_block_first(doc->b), 0, str, STRLEN);
+    do_test("undo file 5 (content 1)", z == 18 && memcmp(str, "first line\nsecond\n", z) == 0);
+    do_test("undo file 6 (undo 2)", doc_undo(doc));
+    do_test("undo file 7 (undo 3)", doc_undo(doc));
+    z = qw_block_get_str(qw_block_first(doc->b), 0, str, STRLEN);
+    do_test("undo file 8 (content 3)", z == 6 && memcmp(str, "first\n", z) == 0);
+    do_test("undo file 9 (no more)", !doc_undo(doc));
+    do_test("undo file 10 (dirty)", !qw_journal_is_clean(doc->j));
+
+    /* redo back to the saved state */
+    while (doc->j->next) {
+        doc->j = doc->j->next;
+        doc->b = qw_journal_apply(doc->b, doc->j, 1);
+    }
+
+    do_test("undo file 11 (clean after redo)", qw_journal_is_clean(doc->j));
+    qw_doc_destroy(doc);
+
+    /* changed behind our back (same size and time) */
+    stat("stress-undo.out", &st);
+    f = fopen("stress-undo.out", "r+b");
+    fputs("ZERO", f);
+    fclose(f);
+    ut.actime = ut.modtime = st.st_mtime;
+    utime("stress-undo.out", &ut);
+
+    doc = qw_doc_new(NULL, "stress-undo.out");
+    do_test("undo file 12 (hash mismatch)", doc->undo != NULL && !doc_undo(doc) && doc->undo == NULL);
+    qw_doc_destroy(doc);
+
+    /* changed size */
+    f = fopen("stress-undo.out", "ab");
+    fputs("more\n", f);
+    fclose(f);
+
+    doc = qw_doc_new(NULL, "stress-undo.out");
+    do_test("undo file 13 (stale)", doc->undo == NULL);
+
+    /* saving again only appends the new entries */
+    doc_type(doc, 0, "b");
+    qw_doc_save(doc);
+    stat(".stress-undo.out.qwu", &st);
+    z = st.st_size;
+    doc_type(doc, 0, "c");
+    qw_doc_save(doc);
+    stat(".stress-undo.out.qwu", &st);
+    do_test("undo file 14 (appended)", st.st_size == z + 3 * sizeof(int32_t) + 1);
+
+    qw_doc_destroy(doc);
+
+    doc = qw_doc_new(NULL, "stress-undo.out");
+    do_test("undo file 15 (undo appended)", doc_undo(doc) && doc_undo(doc));
+    z = qw_block_get_str(qw_block_first(doc->b), 0, str, STRLEN);
+    do_test("undo file 16 (content appended)", z == 28 &&
+        memcmp(str, "ZERO\nfirst line\nsecond\nmore\n", z) == 0);
+    do_test("undo file 17 (no more appended)", !doc_undo(doc));
+
+    /* what was written is undone and replaced: written anew */
+    while (doc->j->next) {
+        doc->j = doc->j->next;
+        doc->b = qw_journal_apply(doc->b, doc->j, 1);
+    }
+
+    qw_doc_save(doc);
+    doc_undo(doc);
+    doc_type(doc, 0, "d");
+    qw_doc_save(doc);
+    qw_doc_destroy(doc);
+
+    doc = qw_doc_new(NULL, "stress-undo.out");
+    do_test("undo file 18 (undo rewritten)", doc_undo(doc) && doc_undo(doc) && !doc_undo(doc));
+    z = qw_block_get_str(qw_block_first(doc->b), 0, str, STRLEN);
+    do_test("undo file 19 (content rewritten)", z == 28 && memcmp(str, "ZERO", 4) == 0);
+    qw_doc_destroy(doc);
+
+    /* an entry beyond the end of the document (after the header and the op) */
+    f = fopen(".stress-undo.out.qwu", "r+b");
+    fseek(f, 32 + sizeof(int32_t), SEEK_SET);
+    z = 1000;
+    fwrite(&z, sizeof(z), 1, f);
+    fclose(f);
+
+    doc = qw_doc_new(NULL, "stress-undo.out");
+    do_test("undo file 20 (bad entry)", doc->undo != NULL && !doc_undo(doc) && doc->undo == NULL);
+    do_test("undo file 21 (bad sidecar dropped)", stat(".stress-undo.out.qwu", &st) == -1);
+    qw_doc_destroy(doc);
+
+    unlink("stress-undo.out");
+    unlink(".stress-undo.out.qwu");
+}
+
+
+static void doc_crash(qw_doc *doc)
+/* destroys a document as if the editor crashed (leaving the log) */
+{
+    if (doc->wal.fd != -1)
+        close(doc->wal.fd);
+
+    doc->wal.fd  = -1;
+    doc->recover = 0;
+    qw_doc_destroy(doc);
+}
+
+
+void test_doc_cursor(void)
+{
+    qw_doc *doc;
+    qw_block *b;
+    int i;
+    char buf[8];
+
+    doc = qw_doc_new(NULL, NULL);
+    doc_type(doc, 0, "0123456789abcdefghij");
+
+    doc->cpos = 10;
+    b = qw_doc_cursor(doc, &i);
+    do_test("doc cursor 1 (taken)", qw_block_rel_to_abs(b, i) == 10 && b->data[i] == 'a');
+
+    /* a local move keeps it */
+    qw_doc_set_cursor(doc, b, i + 1, -1);
+    b = qw_doc_cursor(doc, &i);
+    do_test("doc cursor 2 (moved)", doc->cpos == 11 && b->data[i] == 'b' && doc->cur.b == b);
+
+    /* so does an edit after it */
+    doc_type(doc, 15, "XYZ");
+    do_test("doc cursor 3 (edit after)", doc->cur.b != NULL && doc->cur.apos == 11);
+    b = qw_doc_cursor(doc, &i);
+    do_test("doc cursor 4 (still there)", qw_block_rel_to_abs(b, i) == 11 && b->data[i] == 'b');
+    doc->j = doc->j->prev;
+    doc->b = qw_journal_apply(doc->b, doc->j->next, 0);
+
+    /* an edit before it */
+    doc_type(doc, 0, "xyz");
+    doc->cpos += 3;
+    b = qw_doc_cursor(doc, &i);
+    do_test("doc cursor 5 (edit before)", qw_block_rel_to_abs(b, i) == 14 && b->data[i] == 'b');
+
+    /* set from elsewhere */
+    doc->cpos = 2;
+    b = qw_doc_cursor(doc, &i);
+    do_test("doc cursor 6 (set)", qw_block_rel_to_abs(b, i) == 2 && b->data[i] == 'z');
+
+    /* after compacting */
+    while (qw_doc_compact(doc, 1000));
+    b = qw_doc_cursor(doc, &i);
+    do_test("doc cursor 7 (compacted)", qw_block_rel_to_abs(b, i) == 2 && b->data[i] == 'z');
+
+    /* only set from the absolute position */
+    qw_doc_set_cursor(doc, NULL, 0, 4);
+    b = qw_doc_cursor(doc, &i);
+    do_test("doc cursor 8 (absolute)", doc->cpos == 4 && b->data[i] == '1');
+
+    /* an edit before it forgets the block */
+    doc_type(doc, 0, "-");
+    do_test("doc cursor 9 (forgotten)", doc->cur.b == NULL);
+
+    /* applied where the cursor already is */
+    b = qw_doc_cursor(doc, &i);
+    doc->j = qw_journal_new(1, b, i, "QQ", 2, doc->j);
+    b = qw_journal_apply_at(b, i, doc->j, 1);
+    b = qw_block_move(b, i, &i, 2);
+    qw_block_get_str(qw_block_first(doc->b), 0, buf, 7);
+    do_test("doc cursor 10 (apply at)", qw_block_rel_to_abs(b, i) == 6 && b->data[i] == '0' &&
+        memcmp(buf, "-xyzQQ0", 7) == 0);
+
+    qw_doc_destroy(doc);
+}
+
+
+void test_core_view(void)
+{
+    qw_core *core = qw_core_new();
+    qw_view *v = &core->view;
+    int n, cx = -1, cy = -1, allocs, ok = 1;
+    char buf[256];
+
+    core->width  = 20;
+    core->height = 10;
+    core->docs   = qw_doc_new(NULL, NULL);
+
+    doc_type(core->docs, 0, "ab\tc\n0123456789 0123456789 0123456789\nend\n");
+
+    core->docs->cpos   = 2;
+    core->docs->mark_s = 1;
+    core->docs->mark_e = 3;
+
+    qw_core_create_view(core, &cx, &cy);
+    do_test("core view 1 (rows)", v->size == 46 && v->data[v->size] == '\0' &&
+        memcmp(v->data, "ab_c\n0123456789 \r0123456789 \r0123456789\nend\n \r", 46) == 0);
+    do_test("core view 2 (cursor)", cx == 2 && cy == 0);
+    do_test("core view 3 (selection)", v->attr[0] == QW_ATTR_NORMAL && v->attr[1] == QW_ATTR_MARK &&
+        v->attr[2] == QW_ATTR_MARK && v->attr[3] == QW_ATTR_NORMAL);
+
+    /* no more allocations while moving around */
+    allocs = core->view_allocs;
+
+    for (n = 0; n < 20; n++)
+        doc_type(core->docs, 0, "a longer line that wraps, and a tab\t\n");
+
+    for (n = 0; n < 800 && ok; n++) {
+        core->docs->cpos = (n * 7) % 780;
+        qw_core_create_view(core, &cx, &cy);
+
+        ok = v->data[v->size] == '\0' && cy >= 0 && cy < core->height;
+    }
+
+    do_test("core view 4 (frames)", ok);
+    do_test("core view 5 (no allocations)", allocs == 1 && core->view_allocs == allocs);
+
+    /* line and column, kept until the cursor or the text moves */
+    core->docs->cpos = 20 * 37 + 3;
+    qw_core_status_line(core, buf, sizeof(buf));
+    do_test("core view 6 (status)", strstr(buf, " 21:4 ") != NULL);
+
+    doc_type(core->docs, 20 * 37, "xy");
+    core->docs->cpos += 2;
+    qw_core_status_line(core, buf, sizeof(buf));
+    do_test("core view 7 (status after edit)", strstr(buf, " 21:6 ") != NULL);
+
+    qw_doc_destroy(core->docs);
+    free(v->data);
+    free(v->attr);
+    free(core);
+}
+
+
+void test_wal(void)
+{
+    char str[STRLEN];
+    struct stat st;
+    qw_doc *doc;
+    qw_block *b;
+    FILE *f;
+    int z, i;
+
+    f = fopen("stress-wal.out", "wb");
+    fputs("base\n", f);
+    fclose(f);
+
+    /* some changes, an undo and a redo */
+    doc = qw_doc_new(NULL, "stress-wal.out");
+    do_test("wal 1 (nothing to recover)", doc->recover == 0);
+    doc_type(doc, 4, " one");
+    doc_type(doc, 0, "zero ");
+    doc_undo(doc);
+    doc->j = doc->j->next;
+    doc->b = qw_journal_apply(doc->b, doc->j, 1);
+
+    b = qw_block_abs_to_rel(doc->b, 0, &i);
+    doc->j = qw_journal_new(0, b, i, NULL, 2, doc->j);
+    doc->b = qw_journal_apply(b, doc->j, 1);
+
+    do_test("wal 2 (nothing written yet)", stat(".stress-wal.out.qwl", &st) == -1);
+    qw_doc_sync(doc);
+    do_test("wal 3 (log written)", stat(".stress-wal.out.qwl", &st) == 0);
+
+    /* a change not yet synced is lost */
+    doc_type(doc, 0, "lost");
+    doc_crash(doc);
+
+    doc = qw_doc_new(NULL, "stress-wal.out");
+    do_test("wal 4 (something to recover)", doc->recover == 1);
+    do_test("wal 5 (recovered)", qw_doc_recover(doc, 1) == 5);
+    z = qw_block_get_str(qw_block_first(doc->b), 0, str, STRLEN);
+    do_test("wal 6 (content)", z == 12 && memcmp(str, "ro base one\n", z) == 0);
+    do_test("wal 7 (dirty)", !qw_journal_is_clean(doc->j));
+
+    /* undoable */
+    while (doc_undo(doc));
+    z = qw_block_get_str(qw_block_first(doc->b), 0, str, STRLEN);
+    do_test("wal 8 (undone)", z == 5 && memcmp(str, "base\n", z) == 0);
+
+    /* the log goes on after the recovered changes */
+    doc_type(doc, 0, "again ");
+    doc->wal.stamp = 0;
+    qw_doc_sync(doc);
+    doc_crash(doc);
+
+    /* a torn record at the end */
+    f = fopen(".stress-wal.out.qwl", "ab");
+    fwrite("\1\0\0\0\0\0", 6, 1, f);
+    fclose(f);
+
+    doc = qw_doc_new(NULL, "stress-wal.out");
+    do_test("wal 9 (recovered again)", qw_doc_recover(doc, 1) == 11);
+    z = qw_block_get_str(qw_block_first(doc->b), 0, str, STRLEN);
+    do_test("wal 10 (content again)", z == 11 && memcmp(str, "again base\n", z) == 0);
+    doc_crash(doc);
+
+    /* declined */
+    doc = qw_doc_new(NULL, "stress-wal.out");
+    qw_doc_recover(doc, 0);
+    do_test("wal 11 (declined)", stat(".stress-wal.out.qwl", &st) == -1);
+    doc_type(doc, 0, "new ");
+    qw_doc_sync(doc);
+    doc_crash(doc);
+
+    /* the file changed on disk */
+    f = fopen("stress-wal.out", "ab");
+    fputs("more\n", f);
+    fclose(f);
+
+    doc = qw_doc_new(NULL, "stress-wal.out");
+    do_test("wal 12 (stale)", doc->recover == 0);
+
+    /* saving drops the log */
+    doc_type(doc, 0, "saved ");
+    qw_doc_sync(doc);
+    qw_doc_save(doc);
+    do_test("wal 13 (dropped on save)", stat(".stress-wal.out.qwl", &st) == -1);
+    qw_doc_destroy(doc);
+
+    unlink("stress-wal.out");
+    unlink(".stress-wal.out.qwl");
+    unlink(".stress-wal.out.qwu");
+}
+
+
+#ifdef CONFOPT_ANSI
+static int drv_quit(const char *answer)
+/* quits a core with an unsaved document, answering from a pipe.
+   Returns 1 if it's gone, 0 if it's still running */
+{
+    qw_core *core = qw_core_new();
+    int p[2], in, out, ret;
+
+    qw_drv_startup(core);
+    qw_conf_parse_default_cf(core);
+    qw_core_doc_new(core, NULL);
+    doc_type(core->docs, 0, "unsaved");
+
+    /* the answer is all there is to read; the prompt goes nowhere */
+    in  = dup(0);
+    out = dup(1);
+
+    if (pipe(p) == 0) {
+        ret = write(p[1], answer, strlen(answer));
+        close(p[1]);
+        dup2(p[0], 0);
+        close(p[0]);
+    }
+
+    fflush(stdout);
+    if ((ret = open("/dev/null", O_WRONLY)) != -1) {
+        dup2(ret, 1);
+        close(ret);
+    }
+
+    qw_core_key(core, QW_KEY_CTRL_Q);
+
+    dup2(in, 0);
+    dup2(out, 1);
+    close(in);
+    close(out);
+
+    ret = !core->running && core->docs == NULL;
+
+    while (core->docs != NULL)
+        core->docs = qw_doc_destroy(core->docs);
+
+    free(core->drv_data);
+    free(core);
+
+    return ret;
+}
+#endif
+
+
+void test_drv(void)
+{
+#ifdef CONFOPT_ANSI
+    do_test("drv quit 1 (unsaved, don't save)", drv_quit("n") == 1);
+    do_test("drv quit 2 (unsaved, cancel)", drv_quit("\x1b") == 0);
+#endif
+}
+
+
+void test_utf8(void)
+{
+    char str[STRLEN];
+    qw_block *b;
+    char *ptr;
+    int z, i;
+
+    b = qw_block_new(NULL, NULL);
+
+    ptr = "aña—z";
+    b = qw_block_insert_str(b, 0, ptr, strlen(ptr));
+    i = 0;
+    b = qw_utf8_move(b, &i, 1);
+    do_test("utf8 fwd 1", i == 1);
+    b = qw_utf8_move(b, &i, 1);
+    do_test("utf8 fwd 2", i == 3);
+    b = qw_utf8_move(b, &i, 1);
+    do_test("utf8 fwd 3", i == 4);
+    b = qw_utf8_move(b, &i, 1);
+    do_test("utf8 fwd 4", i == 7);
+    do_test("utf8 fwd 5", b->data[i] == 'z');
+    do_test("utf8 fwd NULL on EOF", qw_utf8_move(b, &z, 1) == NULL);
+    b = qw_utf8_move(b, &i, -1);
+    do_test("utf8 bwd 1", i == 4);
+    b = qw_utf8_move(b, &i, -1);
+    do_test("utf8 fwd 2", i == 3);
+    b = qw_utf8_move(b, &i, -1);
+    do_test("utf8 fwd 3", i == 1);
+    b = qw_utf8_move(b, &i, -1);
+    do_test("utf8 fwd 4", i == 0);
+    do_test("utf8 fwd NULL on BOF", qw_utf8_move(b, &z, -1) == NULL);
+
+    b = qw_block_new(NULL, NULL);
+    ptr = "\x61\xC3\xB1\x61\xE2\x80\x94\x7A\xEE\x80\x80\x5A\xEF\xBF\xBD\x57";
+    b = qw_block_insert_str(b, 0, ptr, strlen(ptr));
+    i = 0;
+
+    b = qw_utf8_get_char_and_move(b, &i, str, &z);
+    do_test("utf char 1", z == 1 && str[0] == 'a');
+    do_test("utf decode 1", qw_utf8_decode(str, z) == 0x61);
+    b = qw_utf8_get_char_and_move(b, &i, str, &z);
+    do_test("utf char 2", z == 2);
+    do_test("utf decode 2", qw_utf8_decode(str, z) == 0xf1);
+    b = qw_utf8_get_char_and_move(b, &i, str, &z);
+    do_test("utf char 3", z == 1 && str[0] == 'a');
+    b = qw_utf8_get_char_and_move(b, &i, str, &z);
+    do_test("utf char 4", z == 3 && memcmp("\xe2\x80\x94", str, 3) == 0);
+    do_test("utf decode 3", qw_utf8_decode(str, z) == 0x2014);  /* m-dash */
+    b = qw_utf8_get_char_and_move(b, &i, str, &z);
+    do_test("utf char 5", z == 1 && str[0] == 'z');
+    b = qw_utf8_get_char_and_move(b, &i, str, &z);
+    do_test("utf char 6", z == 3 && memcmp("\xee\x80\x80", str, 3) == 0);
+    do_test("utf decode 4", qw_utf8_decode(str, z) == 0xe000);  /* private use */
+    b = qw_utf8_get_char_and_move(b, &i, str, &z);
+    do_test("utf char 7", z == 1 && str[0] == 'Z');
+    b = qw_utf8_get_char_and_move(b, &i, str, &z);
+    do_test("utf char 8", z == 3 && memcmp("\xef\xbf\xbd", str, 3) == 0);
+    do_test("utf decode 5", qw_utf8_decode(str, z) == 0xfffd);  /* replacement char */
+    b = qw_utf8_get_char_and_move(b, &i, str, &z);
+    do_test("utf char 9", z == 1 && str[0] == 'W');
+    do_test("utf char at EOF", qw_utf8_get_char_and_move(b, &i, str, &z) == NULL);
+    b = qw_utf8_move(b, &i, -1);
+    b = qw_utf8_get_char_and_move(b, &i, str, &z);
+    do_test("utf char 10", z == 1 && str[0] == 'W');
+    b = qw_utf8_move(b, &i, -1);
+    b = qw_utf8_move(b, &i, -1);
+    b = qw_utf8_get_char_and_move(b, &i, str, &z);
+    do_test("utf char 11", z == 3 && memcmp("\xef\xbf\xbd", str, 3) == 0);
+
+    ptr = "hello";
+    do_test("utf width 1", qw_utf8_str_width(ptr, strlen(ptr)) == 5);
+    ptr = "ができ"; /* katakana */
+    do_test("utf width 3", qw_utf8_str_width(ptr, strlen(ptr)) == 6);
+
+    z = qw_utf8_encode('a', str);
+    do_test("utf8 encode 1 byte", z == 1 && strncmp(str, "a", z) == 0);
+    z = qw_utf8_encode(0xf1, str);
+    do_test("utf8 encode 2 byte", z == 2 && strncmp(str, "\xc3\xb1", z) == 0);
+    z = qw_utf8_encode(0x2014, str);
+    do_test("utf8 encode 3 byte", z == 3 && strncmp(str, "\xe2\x80\x94", z) == 0);
+    z = qw_utf8_encode(0xe000, str);
+    do_test("utf8 encode 3.2 byte", z == 3 && strncmp(str, "\xee\x80\x80", z) == 0);
+}
+
+
+void test_view(void)
+{
+#if 0
+    qw_block *b, *view;
+    int i;
+    char *ptr;
+    int v = 0, sz;
+    int crlf;
+    int cx, cy;
+
+    b = qw_block_new(NULL, NULL);
+    i = 0;
+
+    ptr = "First sentence";
+    b = qw_block_insert_str_and_move(b, &i, ptr, strlen(ptr));
+    sz = qw_view_row_size(b, 0, 20);
+    do_test("row_size 1 (EOF)", sz == 14);
+
+    ptr = "\n";
+    b = qw_block_insert_str_and_move(b, &i, ptr, strlen(ptr));
+    sz = qw_view_row_size(b, v, 20);
+    do_test("row_size 2", sz == 15);
+
+    b = qw_block_new(NULL, NULL);
+    i = 0;
     ptr = "First sentence that is long enough to not fit in\nA single row\n"
           "Withaveryveryverylongwordwithnospacesthatwillnotfitanywhere\nYes it does.";
     b = qw_block_insert_str_and_move(b, &i, ptr, strlen(ptr));
@@ -656,15 +1765,166 @@ void test_view(void)
 }
 
 
-void test_synhi(void)
+static int rows_check(qw_block *b, int width)
+/* compares the cached rows of a chain with freshly calculated ones */
 {
-    qw_synhi *sh;
+    char buf[4096];
+    qw_block *f;
+    int z, i, ok = 1;
 
-    sh = qw_synhi_new("sh", NULL);
+    /* a copy, with an empty cache */
+    z = qw_block_get_str(qw_block_first(b), 0, buf, sizeof(buf));
+    f = qw_block_new(NULL, NULL);
+    f = qw_block_insert_str(f, 0, buf, z);
 
-    qw_synhi_add_extension(sh, ".sh");
-    qw_synhi_add_extension(sh, ".bash");
-    do_test("synhi exts 1", sh->n_extensions == 2);
+    for (i = 0; i <= z && ok; i += 3) {
+        int s1, s2;
+        int c1 = qw_view_get_col_0(b, i, width, &s1);
+        int c2 = qw_view_get_col_0(f, i, width, &s2);
+
+        ok = c1 == c2 && s1 == s2;
+    }
+
+    qw_block_destroy(qw_block_first(f));
+
+    return ok;
+}
+
+
+static qw_block *rows_changes(qw_block *b, const char *words[], int nw,
+                               unsigned int seed, int width, int *ok)
+/* does random changes to a chain, checking its cached rows */
+{
+    qw_journal *j;
+    int n, i, z;
+
+    z = b->chain->root->total;
+    j = qw_journal_new(0, b, 0, NULL, 0, NULL);
+    *ok = 1;
+
+    for (n = 0; n < 200 && *ok; n++) {
+        int apos;
+
+        seed = seed * 1103515245 + 12345;
+        apos = (seed >> 8) % (z + 1);
+
+        b = qw_block_abs_to_rel(b, apos, &i);
+
+        if (seed & 0x10000 || z < 20) {
+            const char *w = words[(seed >> 4) % nw];
+
+            j = qw_journal_new(1, b, i, w, strlen(w), j);
+            z += j->size;
+        }
+        else {
+            int size = 1 + (seed >> 4) % 9;
+
+            if (apos + size > z)
+                size = z - apos;
+
+            j = qw_journal_new(0, b, i, NULL, size, j);
+            z -= j->size;
+        }
+
+        b = qw_journal_apply(b, j, 1);
+
+        /* some undos */
+        if (n % 7 == 6) {
+            z += j->op ? -j->size : j->size;
+            b = qw_journal_apply(b, j, 0);
+            j = j->prev;
+        }
+
+        *ok = rows_check(b, width);
+    }
+
+    return b;
+}
+
+
+void test_view_rows(void)
+{
+    const char *words[] = { "lorem ", "dolor ", "sit ", "amet, ", "ipsum\n", "\n",
+                            "consectetur ", "adipiscing ", "elit\n", "x" };
+    const char *utf8[] = { "lorem ", "\xc3\xb1", "\xe2\x80\x94 ", "\x80", "\xe2",
+                           "\n", "sit ", "\xe4\xb8\xad\xe6\x96\x87", "x" };
+    qw_block *b;
+    int n, s, ok;
+
+    b = qw_block_new(NULL, NULL);
+
+    /* a long paragraph */
+    for (n = 0; n < 40; n++)
+        b = qw_block_insert_str(b, b->used, words[n % 4], strlen(words[n % 4]));
+
+    b = qw_block_first(b);
+
+    do_test("view rows 1 (col 0)", qw_view_get_col_0(b, 30, 20, &s) == 16 && s == 18);
+    do_test("view rows 2 (cached)", b->chain->rows != NULL && rows_check(b, 20));
+    do_test("view rows 3 (row size)", qw_view_row_size(b, 16, 20) == 18);
+    do_test("view rows 4 (other width)", rows_check(b, 33) && rows_check(b, 20));
+
+    /* random changes */
+    b = rows_changes(b, words, 10, 1234, 20, &ok);
+    do_test("view rows 5 (changes)", ok);
+
+    /* and with split and stray UTF-8 chars */
+    b = rows_changes(b, utf8, 9, 4321, 7, &ok);
+    do_test("view rows 6 (utf-8 changes)", ok);
+
+    qw_block_destroy(qw_block_first(b));
+
+    /* a change after the known rows, but looked ahead by the last one */
+    b = qw_block_new(NULL, NULL);
+    b = qw_block_insert_str(b, 0, "ab cdefgh\n", 10);
+    qw_view_get_col_0(b, 0, 5, &s);
+    b = qw_block_abs_to_rel(b, 4, &n);
+    b = qw_block_insert_str(b, n, " ", 1);
+    b = qw_block_first(b);
+    do_test("view rows 7 (looked ahead)", qw_view_get_col_0(b, 0, 5, &s) == 0 && s == 5);
+
+    qw_block_destroy(b);
+}
+
+
+void test_view_move(void)
+{
+    const char *str = "abcdefghij\nab\nlorem dolor sit amet, lorem dolor sit amet, \nend";
+    qw_block *b;
+
+    b = qw_block_new(NULL, NULL);
+    b = qw_block_insert_str(b, 0, str, strlen(str));
+
+    do_test("view move 1 (down)", qw_view_move_rows(b, 5, 1, 20) == 13);
+    do_test("view move 2 (column kept)", qw_view_move_rows(b, 5, 2, 20) == 19);
+    do_test("view move 3 (wrapped row)", qw_view_move_rows(b, 5, 3, 20) == 35);
+    do_test("view move 4 (to last row)", qw_view_move_rows(b, 5, 100, 20) == 62);
+    do_test("view move 5 (last row)", qw_view_move_rows(b, 62, 1, 20) == 62);
+    do_test("view move 6 (up)", qw_view_move_rows(b, 35, -1, 20) == 19);
+    do_test("view move 7 (to first row)", qw_view_move_rows(b, 35, -100, 20) == 5);
+    do_test("view move 8 (first row)", qw_view_move_rows(b, 5, -1, 20) == 5);
+
+    do_test("view vpos 1 (visible)", qw_view_fix_vpos(b, 0, 13, 20, 4) == 0);
+    do_test("view vpos 2 (below)", qw_view_fix_vpos(b, 0, 35, 20, 4) == 11);
+    do_test("view vpos 3 (above)", qw_view_fix_vpos(b, 30, 5, 20, 4) == 0);
+    do_test("view vpos 4 (end of row)", qw_view_fix_vpos(b, 0, 11, 20, 3) == 0);
+    do_test("view vpos 5 (far below)", qw_view_fix_vpos(b, 0, 62, 20, 3) == 48);
+
+    qw_block_destroy(qw_block_first(b));
+}
+
+
+void test_synhi(void)
+{
+    qw_synhi *sh;
+    char tk[32];
+    int n, ok = 1;
+
+    sh = qw_synhi_new("sh", NULL);
+
+    qw_synhi_add_extension(sh, ".sh");
+    qw_synhi_add_extension(sh, ".bash");
+    do_test("synhi exts 1", sh->n_extensions == 2);
 
     qw_synhi_add_token(sh, "if", QW_ATTR_WORD1);
     qw_synhi_add_token(sh, "then", QW_ATTR_WORD1);
@@ -688,14 +1948,308 @@ void test_synhi(void)
     do_test("synhi optimize 4", sh->sorted == 1);
     do_test("synhi find token 2", qw_synhi_find_token(sh, "then") == QW_ATTR_WORD1);
     do_test("synhi find token 3", qw_synhi_find_token(sh, "buttface") == QW_ATTR_NONE);
+    do_test("synhi find token 4 (in place)", qw_synhi_find_token_n(sh, "fifo", 2) == QW_ATTR_WORD2);
+    do_test("synhi find token 5 (prefix)", qw_synhi_find_token_n(sh, "elif", 3) == QW_ATTR_NONE);
+
+    /* enough to grow the hash table */
+    for (n = 0; n < 500; n++) {
+        sprintf(tk, "tk%d", n);
+        qw_synhi_add_token(sh, tk, QW_ATTR_WORD3);
+    }
+
+    for (n = 0; n < 1000 && ok; n++) {
+        sprintf(tk, "tk%d", n);
+        ok = qw_synhi_find_token(sh, tk) == (n < 500 ? QW_ATTR_WORD3 : QW_ATTR_NONE);
+    }
+
+    do_test("synhi find token 6 (many)", ok && qw_synhi_find_token(sh, "then") == QW_ATTR_WORD1);
 
     do_test("synhi not repeated", sh == qw_synhi_new("sh", sh));
 }
 
 
+static qw_synhi *lex_synhi(void)
+/* a synhi with all kinds of sections, C-like */
+{
+    qw_synhi *sh = qw_synhi_new("lex", NULL);
+
+    qw_synhi_add_token(sh, "if", QW_ATTR_WORD1);
+    qw_synhi_add_token(sh, "int", QW_ATTR_WORD1);
+    qw_synhi_add_token(sh, "0", QW_ATTR_WORD2);
+    qw_synhi_add_token(sh, "#include", QW_ATTR_WORD3);
+    qw_synhi_add_token(sh, "NULL", QW_ATTR_WORD3);
+
+    qw_synhi_add_section(sh, "#if 0", "#endif", NULL, QW_ATTR_COMMENT);
+    qw_synhi_add_section(sh, "/**", "*/", NULL, QW_ATTR_DOC);
+    qw_synhi_add_section(sh, "/*", "*/", NULL, QW_ATTR_COMMENT);
+    qw_synhi_add_section(sh, "\"", "\"", "\\\"", QW_ATTR_LITERAL);
+    qw_synhi_add_section(sh, "'", "'", NULL, QW_ATTR_LITERAL);
+    qw_synhi_add_section(sh, "\n> ", "\n", NULL, QW_ATTR_DOC);
+    qw_synhi_add_section(sh, "//", "\n", NULL, QW_ATTR_COMMENT);
+    qw_synhi_add_section(sh, "\n=> ", "\n", NULL, QW_ATTR_WORD2);
+
+    return sh;
+}
+
+
+void test_synhi_lex(void)
+{
+    static const char *frags[] = {
+        "if", "int", "x", "NULL", "0", "12", "a_b", " ", " ", "  ", "\n", "\r",
+        "(", ";", "#if 0", "#endif", "#include", "/*", "*/", "/**", "/*/",
+        "\"", "\\\"", "\\", "'", "//", "> ", "=> ", "*", "/", "#", "\xc3\xb1"
+    };
+    qw_synhi *sh = lex_synhi();
+    qw_view v1, v2;
+    unsigned int seed = 1;
+    int n, ok = 1;
+
+    v1.data = malloc(1024);
+    v1.attr = malloc(1024);
+    v2.data = v1.data;
+    v2.attr = malloc(1024);
+
+    strcpy(v1.data, "int x; /* if */ \"a\\\"b\" if");
+    v1.size = strlen(v1.data);
+    memset(v1.attr, QW_ATTR_NORMAL, v1.size);
+    qw_synhi_apply_to_view(&v1, sh);
+    do_test("synhi lex 1 (word)", v1.attr[0] == QW_ATTR_WORD1 && v1.attr[4] == QW_ATTR_NORMAL);
+    do_test("synhi lex 2 (section)", v1.attr[7] == QW_ATTR_COMMENT && v1.attr[10] == QW_ATTR_COMMENT);
+    do_test("synhi lex 3 (escaped)", v1.attr[16] == QW_ATTR_LITERAL && v1.attr[21] == QW_ATTR_LITERAL &&
+        v1.attr[23] == QW_ATTR_WORD1);
+
+    /* random views must be attributed just like the separate passes do */
+    for (n = 0; n < 5000 && ok; n++) {
+        int i;
+
+        v1.size = 0;
+
+        while (v1.size < 900) {
+            const char *f;
+
+            seed = seed * 1103515245 + 12345;
+            f = frags[(seed >> 8) % (sizeof(frags) / sizeof(frags[0]))];
+
+            strcpy(&v1.data[v1.size], f);
+            v1.size += strlen(f);
+
+            if ((seed >> 20) % 40 == 0)
+                break;
+        }
+
+        /* some already attributed (like a matching bracket) */
+        for (i = 0; i < v1.size; i++) {
+            seed = seed * 1103515245 + 12345;
+            v1.attr[i] = (seed >> 8) % 60 == 0 ? QW_ATTR_MATCHING : QW_ATTR_NORMAL;
+        }
+
+        v2.size = v1.size;
+        memcpy(v2.attr, v1.attr, v1.size);
+
+        qw_synhi_apply_passes(&v1, sh);
+        qw_synhi_apply_to_view(&v2, sh);
+
+        ok = memcmp(v1.attr, v2.attr, v1.size) == 0;
+
+        if (!ok && verbose)
+            printf("lex mismatch: [%.*s]\n", v1.size, v1.data);
+    }
+
+    do_test("synhi lex 4 (same as passes)", ok);
+
+    free(v1.data);
+    free(v1.attr);
+    free(v2.attr);
+}
+
+
+static int synhi_doc_check(qw_block *b, qw_synhi *sh, unsigned int *seed)
+/* checks the views of some line starts against the whole document */
+{
+    qw_view d, v;
+    int n, ok = 1;
+
+    /* the whole document, as a view */
+    d.size = qw_block_rel_to_abs(qw_block_last(b), qw_block_last(b)->used);
+    d.data = malloc(d.size + 1);
+    d.attr = malloc(d.size + 1);
+    qw_block_get_str(qw_block_first(b), 0, d.data, d.size);
+    d.data[d.size] = '\0';
+    memset(d.attr, QW_ATTR_NORMAL, d.size);
+    qw_synhi_apply_passes(&d, sh);
+
+    v.attr = malloc(d.size + 1);
+
+    for (n = 0; n < 20 && ok; n++) {
+        int vpos, e;
+
+        /* from a line start to another */
+        *seed = *seed * 1103515245 + 12345;
+        for (vpos = (*seed >> 8) % d.size; vpos > 0 && d.data[vpos - 1] != '\n'; vpos--);
+        for (e = vpos + 2000 < d.size ? vpos + 2000 : d.size; e < d.size && d.data[e - 1] != '\n'; e++);
+
+        v.data = &d.data[vpos];
+        v.size = e - vpos;
+        memset(v.attr, QW_ATTR_NORMAL, v.size);
+
+        /* view data must end with an ASCIIZ */
+        {
+            char c = d.data[e];
+
+            d.data[e] = '\0';
+            ok = qw_synhi_apply_at(&v, sh, b, vpos) == 0 &&
+                memcmp(v.attr, &d.attr[vpos], v.size) == 0;
+            d.data[e] = c;
+        }
+
+        if (!ok && verbose)
+            printf("lex doc mismatch at %d\n", vpos);
+    }
+
+    free(d.data);
+    free(d.attr);
+    free(v.attr);
+
+    return ok;
+}
+
+
+void test_synhi_doc(void)
+{
+    static const char *frags[] = {
+        "if", "int", "x", "NULL", "0", " ", "  ", "\n", "\n", "\n", "(", ";",
+        "#if 0", "#endif", "/*", "*/", "/**", "\"", "\\\"", "'", "//", "> ", "=> "
+    };
+    const char *str = "int a;\n/* a comment\nover some lines\n*/\nint b;\n";
+    qw_synhi *sh = lex_synhi();
+    unsigned int seed = 7;
+    char buf[64 * 1024];
+    qw_block *b;
+    qw_view v;
+    qw_lex *l;
+    int n, z;
+
+    b = qw_block_new(NULL, NULL);
+    b = qw_block_insert_str(b, 0, str, strlen(str));
+
+    /* a view starting inside the comment */
+    v.data = strdup("over some lines\n*/\nint b;\n");
+    v.size = strlen(v.data);
+    v.attr = malloc(v.size);
+    memset(v.attr, QW_ATTR_NORMAL, v.size);
+
+    qw_synhi_apply_at(&v, sh, b, 21);
+    do_test("synhi doc 1 (open section)", v.attr[0] == QW_ATTR_COMMENT && v.attr[17] == QW_ATTR_COMMENT &&
+        v.attr[19] == QW_ATTR_WORD1);
+
+    /* the comment is not open any more */
+    qw_block_delete(b, 7, 2);
+    memset(v.attr, QW_ATTR_NORMAL, v.size);
+    qw_synhi_apply_at(&v, sh, b, 19);
+    do_test("synhi doc 2 (changed)", v.attr[0] == QW_ATTR_NORMAL && v.attr[17] == QW_ATTR_NORMAL &&
+        v.attr[19] == QW_ATTR_WORD1);
+
+    free(v.data);
+    free(v.attr);
+    qw_block_destroy(qw_block_first(b));
+
+    /* a bigger one, of random content */
+    for (z = 0; z < (int) sizeof(buf) - 16; z += strlen(&buf[z])) {
+        seed = seed * 1103515245 + 12345;
+        strcpy(&buf[z], frags[(seed >> 8) % (sizeof(frags) / sizeof(frags[0]))]);
+    }
+
+    b = qw_block_new(NULL, NULL);
+    b = qw_block_insert_str(b, 0, buf, z);
+
+    do_test("synhi doc 3 (views)", synhi_doc_check(b, sh, &seed));
+
+    l = b->chain->lex;
+    do_test("synhi doc 4 (checkpoints)", l != NULL && l->count > 4 && l->valid == l->count);
+
+    /* a line inserted near the start: everything after moves, but
+       the same state is found again right after it */
+    n = l->count;
+    b = qw_block_abs_to_rel(b, l->apos[1] + 5, &z);
+    qw_block_insert_str(b, z, "\nint\n", 5);
+    do_test("synhi doc 5 (unsure)", l->count == n && l->valid == 2);
+
+    synhi_doc_check(b, sh, &seed);
+    do_test("synhi doc 6 (converged)", l->count == n && l->valid == n);
+
+    /* random edits */
+    for (n = 0; n < 20; n++) {
+        int apos;
+
+        seed = seed * 1103515245 + 12345;
+        z = qw_block_rel_to_abs(qw_block_last(b), qw_block_last(b)->used);
+        apos = (seed >> 8) % (z - 4000);
+        b = qw_block_abs_to_rel(b, apos, &z);
+
+        if (n % 2)
+            qw_block_delete(b, z, (seed >> 4) % 3000);
+        else
+            b = qw_block_insert_str(b, z, frags[(seed >> 4) % 16], strlen(frags[(seed >> 4) % 16]));
+    }
+
+    do_test("synhi doc 7 (after changes)", synhi_doc_check(b, sh, &seed));
+
+    qw_block_destroy(qw_block_first(b));
+}
+
+
+void test_synhi_ahead(void)
+{
+    qw_synhi *sh = lex_synhi();
+    qw_block *b;
+    qw_view v;
+    int n, vpos;
+
+    /* 2 MB inside a comment */
+    b = qw_block_new(NULL, NULL);
+    b = qw_block_insert_str(b, 0, "/*\n", 3);
+
+    for (n = 0; n < 2 * 1024 * 1024 / 32; n++)
+        b = qw_block_insert_str(qw_block_last(b), qw_block_last(b)->used,
+            "some text inside a comment int\n", 32);
+
+    vpos = qw_block_rel_to_abs(qw_block_last(b), qw_block_last(b)->used);
+
+    v.data = strdup("int */ int\n");
+    v.size = strlen(v.data);
+    v.attr = malloc(v.size);
+    b = qw_block_insert_str(qw_block_last(b), qw_block_last(b)->used, v.data, v.size);
+
+    /* too far to be lexed while painting */
+    memset(v.attr, QW_ATTR_NORMAL, v.size);
+    do_test("synhi ahead 1 (too far)", qw_synhi_apply_at(&v, sh, b, vpos) == -1 &&
+        v.attr[0] == QW_ATTR_WORD1 && !qw_synhi_ready(sh, b, vpos));
+
+    /* lex it in slices, like the idle loop */
+    for (n = 0; qw_synhi_lex_ahead(sh, b, 256 * 1024); n++);
+    do_test("synhi ahead 2 (slices)", n >= 7 && qw_synhi_ready(sh, b, vpos));
+
+    memset(v.attr, QW_ATTR_NORMAL, v.size);
+    do_test("synhi ahead 3 (ready)", qw_synhi_apply_at(&v, sh, b, vpos) == 0 &&
+        v.attr[0] == QW_ATTR_COMMENT && v.attr[5] == QW_ATTR_COMMENT && v.attr[7] == QW_ATTR_WORD1);
+
+    /* a change at the start: found again in the next slices */
+    b = qw_block_insert_str(qw_block_first(b), 0, "int\n", 4);
+    do_test("synhi ahead 4 (changed)", !qw_synhi_ready(sh, b, vpos + 4));
+
+    for (n = 0; qw_synhi_lex_ahead(sh, b, 256 * 1024); n++);
+    do_test("synhi ahead 5 (converged)", n == 0 && qw_synhi_ready(sh, b, vpos + 4));
+
+    free(v.data);
+    free(v.attr);
+    qw_block_destroy(qw_block_first(b));
+}
+
+
 void test_file(void)
 {
     qw_block *b;
+    FILE *f;
     int crlf;
 
     b = qw_file_load("nonexistent", &crlf);
@@ -706,12 +2260,889 @@ void test_file(void)
     do_test("file save 2", qw_file_save(b, "stress.out", 1) != -1);
     b = qw_file_load("stress.out", &crlf);
     do_test("file load 3", crlf == 1);
+    qw_block_destroy(b);
+
+    /* positions are ints: bigger files are refused, not truncated */
+    if ((f = fopen("stress-huge.out", "wb")) != NULL) {
+        int r = ftruncate(fileno(f), (off_t) INT_MAX + 1);
+        fclose(f);
+
+        if (r != -1) {
+            b = qw_file_load("stress-huge.out", &crlf);
+            do_test("file load 4 (too big)", b == NULL && errno == EFBIG);
+            do_test("file load 5 (too big doc)", qw_doc_new(NULL, "stress-huge.out") == NULL);
+        }
+
+        unlink("stress-huge.out");
+    }
 }
 
 
-int main(int argc, char *argv[])
+static int file_cmp(qw_block *b, const char *fname)
+/* compares the content of a chain with a file */
 {
+    FILE *f;
+    int ret = -1;
+
+    if ((f = fopen(fname, "rb")) != NULL) {
+        char buf1[STRLEN], buf2[STRLEN];
+        int i = 0, z;
+
+        b = qw_block_first(b);
+
+        do {
+            z = fread(buf1, 1, sizeof(buf1), f);
+
+            if (qw_block_get_str(b, i, buf2, z) != z || memcmp(buf1, buf2, z) != 0)
+                break;
+
+            b = qw_block_move(b, i, &i, z);
+        } while (z);
+
+        if (z == 0 && qw_block_get_str(b, i, buf2, 1) == 0)
+            ret = 0;
+
+        fclose(f);
+    }
+
+    return ret;
+}
+
+
+static void file_age(const char *fname)
+/* makes a file look unmodified for a while, so that it's mapped */
+{
+    struct utimbuf ut;
+
+    ut.actime = ut.modtime = time(NULL) - 60;
+    utime(fname, &ut);
+}
+
+
+static int file_raw_blocks(qw_block *b)
+/* counts the blocks of a chain still pointing to CR/LF data */
+{
+    int n = 0;
+
+    for (b = b->chain->first; b; b = b->next)
+        n += b->raw != 0;
+
+    return n;
+}
+
+
+void test_file_map(void)
+{
+    char str[STRLEN];
+    qw_block *b, *t;
+    FILE *f, *f2;
+    int n, i, z, crlf, ro, raw;
+    uint64_t h;
+
+    /* create a file several blocks long */
+    f = fopen("stress-map.out", "wb");
+    for (n = 0; n < 2000; n++)
+        fprintf(f, "line %04d of the mapped file\n", n);
+    fclose(f);
+
+    b = qw_file_load("stress-map.out", &crlf);
+    do_test("file map 1 (loaded)", b != NULL && crlf == 0);
+    do_test("file map 2 (content)", file_cmp(b, "stress-map.out") == 0);
+
+    ro = 1;
+    for (t = qw_block_first(b); t; t = t->next) {
+        if (t->size != 0)
+            ro = 0;
+    }
+    do_test("file map 3 (all blocks read-only)", ro);
+
+    /* home and end across block boundaries don't count the whole file */
+    t = qw_block_abs_to_rel(b, QW_BLOCK_SIZE * 10, &i);
+    t = qw_block_move_bol(t, &i);
+    z = qw_block_rel_to_abs(t, i);
+    t = qw_block_move_eol(t, &i);
+    do_test("file map 4 (home, end)", z == 1412 * 29 && qw_block_rel_to_abs(t, i) == 1413 * 29 - 1 &&
+        b->chain->root->tlines == -1);
+
+    /* edit in the middle of a block */
+    b = qw_block_abs_to_rel(b, 29 * 500 + 5, &i);
+    b = qw_block_insert_str(b, i, "XXXX", 4);
+    b = qw_block_abs_to_rel(b, 29 * 500, &i);
+    z = qw_block_get_str(b, i, str, 14);
+    do_test("file map 5 (insert)", strncmp(str, "line XXXX0500 ", z) == 0);
+    do_test("file map 6 (edited block is writable)", b->size != 0 || b->chain->pieces);
+
+    /* delete across blocks */
+    b = qw_block_abs_to_rel(b, 29 * 1000 + 4, &i);
+    qw_block_delete(b, i, 29 * 200);
+    b = qw_block_abs_to_rel(b, 29 * 1000 + 4, &i);
+    z = qw_block_get_str(b, i, str, 9);
+    do_test("file map 7 (delete)", strncmp(str, "line 1200", z) == 0);
+
+    /* save over the mapped file and check the chain is still valid */
+    do_test("file map 8 (save over)", qw_file_save(b, "stress-map.out", 0) != -1);
+    do_test("file map 9 (content after save)", file_cmp(b, "stress-map.out") == 0);
+
+    qw_block_destroy(qw_block_first(b));
+
+    /* CR/LF file */
+    f = fopen("stress-map.out", "wb");
+    for (n = 0; n < 500; n++)
+        fprintf(f, "crlf line %04d\r\n", n);
+    fclose(f);
+
+    b = qw_file_load("stress-map.out", &crlf);
+    z = qw_block_get_str(qw_block_first(b), 0, str, 30);
+    do_test("file map 10 (CR/LF)", crlf == 1 &&
+        strncmp(str, "crlf line 0000\ncrlf line 0001\n", z) == 0);
+    do_test("file map 11 (CR/LF size)", qw_block_rel_to_abs(qw_block_last(b),
+        qw_block_last(b)->used) == 500 * 15);
+
+    qw_block_destroy(qw_block_first(b));
+
+    /* an old one is mapped, and the CRs are dropped as blocks are touched;
+       the first line is 17 bytes long, so that CR/LF pairs of the next
+       ones fall across the boundaries of both blocks and pieces */
+    f  = fopen("stress-map.out", "wb");
+    f2 = fopen("stress-map2.out", "wb");
+    fprintf(f, "the first line!\r\n");
+    fprintf(f2, "the first line!\n");
+    for (n = 0; n < 5000; n++) {
+        fprintf(f, "crlf line %04d\r\n", n);
+        fprintf(f2, "crlf line %04d\n", n);
+    }
+    fclose(f2);
+    fclose(f);
+    file_age("stress-map.out");
+
+    b = qw_file_load("stress-map.out", &crlf);
+    raw = file_raw_blocks(b);
+#ifdef CONFOPT_MMAP
+    do_test("file map 12 (CR/LF mapped)", crlf == 1 && b->chain->mapped && raw >= 2);
+#endif
+    do_test("file map 13 (CR/LF size, untouched)", qw_block_rel_to_abs(b->chain->last, b->chain->last->used) ==
+        16 + 5000 * 15 && qw_block_line_to_rel(b, 5002, &i) == NULL && file_raw_blocks(b) == raw);
+
+    t = qw_block_line_to_rel(b, 2500, &i);
+    z = qw_block_get_str(t, i, str, 15);
+    do_test("file map 14 (CR/LF line, touched)", strncmp(str, "crlf line 2499\n", z) == 0 &&
+        t->raw == 0 && file_raw_blocks(b) < raw && file_raw_blocks(b) > 0);
+
+    h = qw_block_hash(b);
+    do_test("file map 15 (CR/LF content)", file_cmp(b, "stress-map2.out") == 0 && file_raw_blocks(b) == 0);
+    do_test("file map 16 (CR/LF hash)", qw_block_hash(b) == h);
+
+    qw_block_destroy(qw_block_first(b));
+
+    /* saving untouched blocks writes the file as it was */
+    b = qw_file_load("stress-map.out", &crlf);
+    do_test("file map 17 (CR/LF save untouched)", qw_file_save(b, "stress-map3.out", 1) == 17 + 5000 * 16 &&
+        file_raw_blocks(b) > 0);
+    qw_block_destroy(qw_block_first(b));
+
+    b = qw_file_load("stress-map3.out", &crlf);
+    do_test("file map 18 (CR/LF saved content)", crlf == 1 && file_cmp(b, "stress-map2.out") == 0);
+    qw_block_destroy(qw_block_first(b));
+
+    /* and with LFs, the CRs are dropped */
+    b = qw_file_load("stress-map.out", &crlf);
+    qw_file_save(b, "stress-map3.out", 0);
+    qw_block_destroy(qw_block_first(b));
+
+    b = qw_file_load("stress-map3.out", &crlf);
+    do_test("file map 19 (CR/LF saved as LF)", crlf == 0 && file_cmp(b, "stress-map2.out") == 0);
+    qw_block_destroy(qw_block_first(b));
+
+    /* mixed EOLs: the first line decides. If it's CR/LF, the CRs of
+       CR/LF pairs are dropped, LF-only lines and lone CRs are kept
+       as are, and all lines get a CR/LF on save */
+    f = fopen("stress-map.out", "wb");
+    fprintf(f, "one\r\ntwo\nthree\r\nfour\rfive\r\r\n");
+    fclose(f);
+    file_age("stress-map.out");
+
+    b = qw_file_load("stress-map.out", &crlf);
+    z = qw_block_get_str(qw_block_first(b), 0, str, STRLEN);
+    do_test("file map 20 (mixed, first CR/LF)", crlf == 1 && z == 25 &&
+        memcmp(str, "one\ntwo\nthree\nfour\rfive\r\n", z) == 0);
+
+    qw_file_save(b, "stress-map3.out", crlf);
+    qw_block_destroy(qw_block_first(b));
+
+    f = fopen("stress-map3.out", "rb");
+    z = fread(str, 1, STRLEN, f);
+    fclose(f);
+    do_test("file map 21 (mixed, saved)", z == 29 &&
+        memcmp(str, "one\r\ntwo\r\nthree\r\nfour\rfive\r\r\n", z) == 0);
+
+    /* if the first line is LF-only, everything is kept */
+    f = fopen("stress-map.out", "wb");
+    fprintf(f, "one\ntwo\r\nthree\n");
+    fclose(f);
+    file_age("stress-map.out");
+
+    b = qw_file_load("stress-map.out", &crlf);
+    z = qw_block_get_str(qw_block_first(b), 0, str, STRLEN);
+    do_test("file map 22 (mixed, first LF)", crlf == 0 && z == 15 &&
+        memcmp(str, "one\ntwo\r\nthree\n", z) == 0);
+    qw_block_destroy(qw_block_first(b));
+
+    unlink("stress-map2.out");
+    unlink("stress-map3.out");
+
+    /* empty file */
+    f = fopen("stress-map.out", "wb");
+    fclose(f);
+
+    b = qw_file_load("stress-map.out", &crlf);
+    do_test("file map 23 (empty)", b != NULL && b->used == 0);
+    qw_block_destroy(b);
+
+    unlink("stress-map.out");
+}
+
+
+void test_file_save(void)
+{
+    char str[STRLEN];
+    qw_block *b;
+    qw_doc *doc;
+    FILE *f;
+    int n, z, crlf;
+
+    /* a chain with LFs at block boundaries */
+    b = qw_block_new(NULL, NULL);
+    b = qw_block_insert_str(b, 0, "one\n", 4);
+    b = qw_block_new(b, NULL);
+    b = qw_block_insert_str(b, 0, "\ntwo", 4);
+    b = qw_block_new(b, NULL);
+    b = qw_block_new(b, NULL);
+    b = qw_block_insert_str(b, 0, "\n\nthree", 7);
+
+    z = qw_file_save(b, "stress.out", 1);
+    do_test("file save 3 (size CR/LF)", z == 19);
+
+    f = fopen("stress.out", "rb");
+    n = fread(str, 1, sizeof(str), f);
+    fclose(f);
+    do_test("file save 4 (content CR/LF)",
+        n == 19 && memcmp(str, "one\r\n\r\ntwo\r\n\r\nthree", 19) == 0);
+
+    z = qw_file_save(b, "stress.out", 0);
+    do_test("file save 5 (size LF)", z == 15);
+    do_test("file save 6 (content LF)", file_cmp(b, "stress.out") == 0);
+
+    qw_block_destroy(qw_block_first(b));
+
+    /* more ranges than a single write can take */
+    f = fopen("stress-map.out", "wb");
+    for (n = 0; n < 20000; n++)
+        fprintf(f, "%d\r\n", n);
+    fclose(f);
+
+    b = qw_file_load("stress-map.out", &crlf);
+    do_test("file save 7 (many lines)", qw_file_save(b, "stress.out", crlf) != -1);
+    qw_block_destroy(qw_block_first(b));
+
+    b = qw_file_load("stress.out", &crlf);
+    do_test("file save 8 (many lines reloaded)",
+        crlf == 1 && qw_file_save(b, "stress-map.out", 0) != -1);
+
+    /* the document keeps the throughput */
+    doc = qw_doc_new(NULL, "stress-map.out");
+    doc->new_file = 1;
+    do_test("file save 9 (doc save)", qw_doc_save(doc) == 0 && doc->new_file == 0);
+    do_test("file save 10 (doc content)", file_cmp(doc->b, "stress-map.out") == 0);
+    qw_doc_destroy(doc);
+
+    do_test("file save 11 (bad path)", qw_file_save(b, "/nonexistent/x", 0) == -1);
+
+#ifdef CONFOPT_REALPATH
+    /* saving through a symlink replaces the file it points to */
+    unlink("stress-link.out");
+    if (symlink("stress-map.out", "stress-link.out") != -1) {
+        struct stat st;
+
+        do_test("file save 12 (symlink)", qw_file_save(b, "stress-link.out", 1) != -1 &&
+            lstat("stress-link.out", &st) != -1 && S_ISLNK(st.st_mode));
+
+        f = fopen("stress-map.out", "rb");
+        n = fread(str, 1, sizeof(str), f);
+        fclose(f);
+        do_test("file save 13 (symlink target)", n > 3 && memcmp(str, "0\r\n1", 4) == 0);
+
+        unlink("stress-link.out");
+    }
+#endif
+
+    qw_block_destroy(qw_block_first(b));
+
+    unlink("stress-map.out");
+}
+
+
+static int deep_chains(void)
+/* walks very long chains and lists. Returns the number of failures */
+{
+    char str[STRLEN];
+    qw_doc *doc;
+    qw_journal *j;
+    qw_synhi *sh = NULL, *s;
+    FILE *f;
+    int n, i, err = 0;
+
+    /* a big (sparse) file, 262144 blocks long */
+    f = fopen("stress-big.out", "wb");
+    fseek(f, 1024 * 1024 * 1024 - 1, SEEK_SET);
+    fputc('\n', f);
+    fclose(f);
+    file_age("stress-big.out");
+
+    doc = qw_doc_new(NULL, "stress-big.out");
+    unlink("stress-big.out");
+
+    /* empty all blocks but the last one */
+    qw_block_delete(qw_block_first(doc->b), 0, 1024 * 1024 * 1024 - 3);
+
+    if (qw_block_get_str(qw_block_first(doc->b), 0, str, 10) != 3)
+        err++;
+    if (qw_block_here(qw_block_first(doc->b), 0, "\0\0\n", 3) == NULL)
+        err++;
+
+    /* fill the last block and keep inserting */
+    memset(str, 'x', sizeof(str));
+    doc->b = qw_block_abs_to_rel(doc->b, 3, &i);
+
+    for (n = 0; n < 10; n++)
+        doc->b = qw_block_insert_str(doc->b, i, str, sizeof(str));
+
+    memset(str, 'y', sizeof(str));
+    for (n = 0; n < 64; n++)
+        doc->b = qw_block_insert_str(qw_block_first(doc->b), 0, str, sizeof(str));
+
+    if (qw_block_rel_to_abs(qw_block_last(doc->b), qw_block_last(doc->b)->used) != 3 + 74 * STRLEN)
+        err++;
+
+    /* a long journal */
+    for (n = 0; n < 200000; n++)
+        doc->j = qw_journal_new(1, doc->b, 0, "a", 1, doc->j);
+
+    if (qw_journal_first(doc->j)->prev != NULL)
+        err++;
+
+    /* drop all entries after the second one */
+    j = qw_journal_first(doc->j)->next;
+    qw_journal_destroy(j->next);
+    j->next = NULL;
+    doc->j = j;
+
+    /* a long list of syntax highlight definitions */
+    for (n = 0; n < 200000; n++) {
+        s = calloc(1, sizeof(qw_synhi));
+        s->name = "none";
+        s->next = sh;
+        sh = s;
+    }
+
+    if (qw_synhi_find_by_name("some", sh) != NULL)
+        err++;
+    if (qw_synhi_find_by_extension("file.txt", sh) != NULL)
+        err++;
+
+    qw_doc_destroy(doc);
+
+    return err;
+}
+
+
+void test_pool(void)
+{
+    qw_pool p;
+    qw_block *b;
+    qw_journal *j;
+    char *e1, *e2, *e3;
+    int n;
+
+    qw_pool_init(&p, 10, 2);
+    do_test("pool 1 (element size aligned)", p.size == 16);
+
+    e1 = qw_pool_alloc(&p);
+    e2 = qw_pool_alloc(&p);
+    do_test("pool 2 (contiguous in slab)", e2 == e1 + 16);
+
+    e3 = qw_pool_alloc(&p);
+    do_test("pool 3 (new slab)", e3 != e2 + 16 && p.used == 3);
+
+    qw_pool_free(&p, e2);
+    do_test("pool 4 (reuse freed)", qw_pool_alloc(&p) == e2);
+
+    qw_pool_free(&p, e1);
+    qw_pool_free(&p, e3);
+    do_test("pool 5 (free list order)", qw_pool_alloc(&p) == e3 && qw_pool_alloc(&p) == e1);
+
+    qw_pool_release(&p);
+    do_test("pool 6 (release)", p.slabs == NULL && p.free == NULL && p.used == 0);
+
+    /* blocks and journal entries come from the pools of the chain */
+    b = qw_block_new(NULL, NULL);
+    j = qw_journal_new(0, b, 0, NULL, 0, NULL);
+
+    for (n = 0; n < 1000; n++) {
+        j = qw_journal_new(1, b, 0, "abc", 3, j);
+        b = qw_journal_apply(b, j, 1);
+    }
+
+    do_test("pool 7 (journal entries)", b->chain->journals.used == 1001);
+
+    /* a new branch returns the entries */
+    j = qw_journal_first(j)->next;
+    j = qw_journal_new(0, b, 0, NULL, 3, j);
+    do_test("pool 8 (journal entries returned)", b->chain->journals.used == 3);
+
+    /* delete everything; the emptied blocks go back when compacted */
+    qw_block_delete(qw_block_first(b), 0, 3000);
+    b = qw_block_compact(b, 1000000);
+    do_test("pool 9 (blocks returned)", b->chain->blocks.used + b->chain->headers.used == 1);
+
+    /* everything goes at once */
+    qw_block_destroy(qw_block_first(b));
+}
+
+
+void test_deep_chains(void)
+{
+    pid_t pid;
+    int status = -1;
+
+    /* run in a child with a tiny stack */
+    if ((pid = fork()) == 0) {
+        struct rlimit rl;
+
+        getrlimit(RLIMIT_STACK, &rl);
+        rl.rlim_cur = 256 * 1024;
+        setrlimit(RLIMIT_STACK, &rl);
+
+        qw_block_pieces = 0;
+
+        _exit(deep_chains());
+    }
+
+    waitpid(pid, &status, 0);
+
+    do_test("deep chains (256 KB of stack)", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+
+void bench_search(void)
+{
+    struct timeval st, et;
+    int n, pieces = qw_block_pieces;
+    FILE *f;
+
+    printf("\nsearch benchmark\n");
+
+    /* a big (sparse) file with something at the end */
+    f = fopen("stress-big.out", "wb");
+    fseek(f, 1024 * 1024 * 1024 - 16, SEEK_SET);
+    fprintf(f, "a needle here\n");
+    fclose(f);
+    file_age("stress-big.out");
+
+    for (n = 0; n < 2; n++) {
+        qw_block *b, *r;
+        int crlf, i;
+        double t;
+
+        qw_block_pieces = n;
+        b = qw_file_load("stress-big.out", &crlf);
+
+        /* touch all pages first */
+        i = 0;
+        qw_block_search(b, &i, "x", 1, 1);
+
+        diff_time(&st, NULL);
+        i = 0;
+        r = qw_block_search(b, &i, "needle", 6, 1);
+        t = diff_time(&st, &et);
+
+        printf("%-11s: 1 GB forward in %.3f s (%.1f GB/s)%s\n",
+            n ? "piece table" : "block", t, 1.0 / t, r ? "" : " NOT FOUND");
+
+        diff_time(&st, NULL);
+        r = qw_block_abs_to_rel(b, 1024 * 1024 * 1024 - 20, &i);
+        r = qw_block_search(r, &i, "\n", 1, -1);
+        t = diff_time(&st, &et);
+
+        printf("%-11s: 1 GB backwards in %.3f s (%.1f GB/s)%s\n",
+            "", t, 1.0 / t, r ? " FOUND?" : "");
+
+        qw_block_destroy(qw_block_first(b));
+    }
+
+    qw_block_pieces = pieces;
+
+    unlink("stress-big.out");
+}
+
+
+void bench_lines(void)
+{
+    struct timeval st, et;
+    qw_block *b, *r;
+    FILE *f;
+    int n, i, crlf, lines = 4 * 1024 * 1024;
+    double t;
+
+    printf("\nline index benchmark\n");
+
+    /* 100 MB of lines; the first home and end in the middle
+       of it must not count the newlines of the whole file */
+    f = fopen("stress-big.out", "wb");
+    for (n = 0; ftell(f) < 100 * 1024 * 1024; n++)
+        fprintf(f, "%.*s line %d\n", (n * 37) % 150,
+            "lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+            "eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut enim "
+            "ad minim veniam, quis nostrud", n);
+    fclose(f);
+    file_age("stress-big.out");
+
+    b = qw_file_load("stress-big.out", &crlf);
+    r = qw_block_abs_to_rel(b, 50 * 1024 * 1024, &i);
+
+    diff_time(&st, NULL);
+    r = qw_block_move_bol(r, &i);
+    r = qw_block_move_eol(r, &i);
+    t = diff_time(&st, &et);
+
+    printf("first home and end on a fresh 100 MB load: %.1f us\n", t * 1000000.0);
+
+    diff_time(&st, NULL);
+    r = qw_block_line_to_rel(r, qw_block_line(r, i) + 1, &i);
+    t = diff_time(&st, &et);
+
+    printf("first line down, through the index: %.3f s\n", t);
+
+    qw_block_destroy(qw_block_first(b));
+
+    f = fopen("stress-big.out", "wb");
+    for (n = 0; n < lines; n++)
+        fprintf(f, "line %d\n", n);
+    fclose(f);
+    file_age("stress-big.out");
+
+    b = qw_file_load("stress-big.out", &crlf);
+
+    diff_time(&st, NULL);
+    r = qw_block_line_to_rel(b, lines - 1, &i);
+    t = diff_time(&st, &et);
+
+    printf("go to line %d (first count): %.3f s\n", lines, t);
+
+    diff_time(&st, NULL);
+    for (n = 0; n < 1000000; n++) {
+        r = qw_block_line_to_rel(b, (int) ((n * 7919L) % lines), &i);
+        i = qw_block_line(r, i);
+    }
+    t = diff_time(&st, &et);
+
+    printf("line to position and back: %.1f ns\n", t * 1000.0);
+
+    diff_time(&st, NULL);
+    for (n = 0; n < 100000; n++) {
+        r = qw_block_line_to_rel(b, (int) ((n * 7919L) % lines), &i);
+        r = qw_block_insert_str(r, i, "x", 1);
+        r = qw_block_move_eol(r, &i);
+        i = qw_block_line(r, i);
+    }
+    t = diff_time(&st, &et);
+
+    printf("insert + eol + line after the change: %.1f ns\n", t * 10000.0);
+
+    qw_block_destroy(qw_block_first(b));
+    unlink("stress-big.out");
+}
+
+
+void bench_pgdn(void)
+{
+    struct timeval st, et;
+    qw_block *b;
+    FILE *f;
+    int n, crlf, cpos, pages;
+    double t;
+
+    printf("\npage down benchmark\n");
+
+    /* 100 MB of lines, some of them wrapped */
+    f = fopen("stress-big.out", "wb");
+    for (n = 0; ftell(f) < 100 * 1024 * 1024; n++)
+        fprintf(f, "%.*s line %d\n", (n * 37) % 150,
+            "lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+            "eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut enim "
+            "ad minim veniam, quis nostrud", n);
+    fclose(f);
+    file_age("stress-big.out");
+
+    b = qw_file_load("stress-big.out", &crlf);
+
+    /* hold page down in a 200 row terminal until the end */
+    diff_time(&st, NULL);
+    for (pages = cpos = 0; ; pages++) {
+        int p = qw_view_move_rows(b, cpos, 199, 80);
+
+        if (p == cpos)
+            break;
+
+        cpos = p;
+    }
+    t = diff_time(&st, &et);
+
+    printf("%d pages down to EOF: %.3f s (%.1f us per page)\n", pages, t, t * 1000000.0 / pages);
+
+    /* the same for 1000 pages, a row at a time */
+    diff_time(&st, NULL);
+    for (cpos = n = 0; n < 1000 * 199; n++)
+        cpos = qw_view_move_rows(b, cpos, 1, 80);
+    t = diff_time(&st, &et);
+
+    printf("1000 pages down, row by row: %.3f s (%.1f us per page)\n", t, t * 1000.0);
+
+    qw_block_destroy(qw_block_first(b));
+    unlink("stress-big.out");
+}
+
+
+void bench_synhi(void)
+{
+    struct timeval st, et;
+    qw_synhi *sh = lex_synhi();
+    qw_view v;
+    char *attr;
+    double t1, t2;
     int n;
+    FILE *f;
+
+    printf("\nsyntax highlight benchmark\n");
+
+    /* this very source, as a view */
+    f = fopen("stress.c", "rb");
+    v.data = malloc(1024 * 1024);
+    v.size = f ? fread(v.data, 1, 1024 * 1024 - 1, f) : 0;
+    v.data[v.size] = '\0';
+    v.attr = malloc(v.size + 1);
+    attr = malloc(v.size + 1);
+
+    if (f)
+        fclose(f);
+
+    diff_time(&st, NULL);
+    for (n = 0; n < 100; n++) {
+        memset(v.attr, QW_ATTR_NORMAL, v.size);
+        qw_synhi_apply_passes(&v, sh);
+    }
+    t1 = diff_time(&st, &et);
+
+    memcpy(attr, v.attr, v.size);
+
+    diff_time(&st, NULL);
+    for (n = 0; n < 100; n++) {
+        memset(v.attr, QW_ATTR_NORMAL, v.size);
+        qw_synhi_apply_to_view(&v, sh);
+    }
+    t2 = diff_time(&st, &et);
+
+    printf("passes: %d KB x 100 in %.3f s (%.1f MB/s)\n", v.size / 1024, t1, v.size * 100 / t1 / 1048576);
+    printf("lexer : %d KB x 100 in %.3f s (%.1f MB/s)%s\n", v.size / 1024, t2, v.size * 100 / t2 / 1048576,
+        memcmp(attr, v.attr, v.size) ? " DIFFERENT" : "");
+
+    free(v.data);
+    free(v.attr);
+    free(attr);
+}
+
+
+void bench_file_load(void)
+{
+    struct timeval st, et;
+    qw_block *b;
+    FILE *f;
+    int crlf;
+    double t;
+
+    printf("\nfile load benchmark\n");
+
+    /* create a big (sparse) file */
+    f = fopen("stress-big.out", "wb");
+    fseek(f, 1024 * 1024 * 1024 - 1, SEEK_SET);
+    fputc('\n', f);
+    fclose(f);
+    file_age("stress-big.out");
+
+    diff_time(&st, NULL);
+    b = qw_file_load("stress-big.out", &crlf);
+    t = diff_time(&st, &et);
+
+    printf("1 GB file loaded in %.3f s\n", t);
+
+    diff_time(&st, NULL);
+    qw_block_destroy(qw_block_first(b));
+    t = diff_time(&st, &et);
+
+    printf("1 GB file closed in %.3f s\n", t);
+
+    unlink("stress-big.out");
+}
+
+
+void bench_file_save(void)
+{
+    char line[STRLEN];
+    qw_doc *doc;
+    FILE *f;
+    int n;
+
+    printf("\nfile save benchmark\n");
+
+    /* create a big file with lines */
+    f = fopen("stress-big.out", "wb");
+    for (n = 0; n < 4 * 1024 * 1024; n++) {
+        sprintf(line, "%08d the quick brown fox jumps over the lazy dog, again and again\n", n);
+        fputs(line, f);
+    }
+    fclose(f);
+    file_age("stress-big.out");
+
+    doc = qw_doc_new(NULL, "stress-big.out");
+
+    qw_doc_save(doc);
+    printf("%d MB file saved at %.1f MB/s\n",
+        qw_block_rel_to_abs(qw_block_last(doc->b), qw_block_last(doc->b)->used) / (1024 * 1024),
+        doc->save_bps / (1024.0 * 1024.0));
+
+    doc->crlf = 1;
+    qw_doc_save(doc);
+    printf("same file saved with CR/LF at %.1f MB/s\n",
+        doc->save_bps / (1024.0 * 1024.0));
+
+    qw_doc_destroy(doc);
+
+    unlink("stress-big.out");
+}
+
+
+void bench_doc_close(void)
+{
+    struct timeval st, et;
+    qw_doc *doc;
+    int n, i;
+
+    printf("\ndocument close benchmark\n");
+
+    doc = qw_doc_new(NULL, NULL);
+
+    /* a long typing session, one journal entry per keystroke */
+    diff_time(&st, NULL);
+
+    for (n = 0; n < 1000000; n++) {
+        doc->b = qw_block_abs_to_rel(doc->b, n, &i);
+        doc->j = qw_journal_new(1, doc->b, i, n % 64 ? "x" : "\n", 1, doc->j);
+        doc->b = qw_journal_apply(doc->b, doc->j, 1);
+    }
+
+    printf("%d keystrokes journaled in %f seconds\n", n, diff_time(&st, &et));
+
+    diff_time(&st, NULL);
+    qw_doc_destroy(doc);
+    printf("document closed in %f seconds\n", diff_time(&st, &et));
+}
+
+
+static void chain_mem(qw_block *b, int size)
+/* prints the memory used by a chain */
+{
+    qw_block *t;
+    qw_addbuf *a;
+    int n_blocks = 0;
+    long mem = 0;
+
+    for (t = qw_block_first(b); t; t = t->next) {
+        n_blocks++;
+        mem += sizeof(qw_block) + t->size;
+    }
+
+    for (a = b->chain->add; a; a = a->prev)
+        mem += sizeof(qw_addbuf) + a->size;
+
+    printf(", %d blocks, %ld KB for %d KB of text\n", n_blocks, mem / 1024, size / 1024);
+}
+
+
+void bench_engines(void)
+{
+    struct timeval st, et;
+    int n, pieces = qw_block_pieces;
+
+    printf("\nbuffer engines editing benchmark\n");
+
+    for (n = 0; n < 2; n++) {
+        qw_block *b;
+        int m, i, size;
+        double tm;
+
+        qw_block_pieces = n;
+
+        /* 4 MB of text */
+        b = qw_block_new(NULL, NULL);
+        i = 0;
+        for (m = 0; m < 65536; m++)
+            b = qw_block_insert_str_and_move(b, &i,
+                "the quick brown fox jumps over the lazy dog over and over again\n", 64);
+
+        size = 65536 * 64;
+
+        diff_time(&st, NULL);
+
+        /* random short edits */
+        for (m = 0; m < 200000; m++) {
+            b = qw_block_abs_to_rel(b, (int) ((m * 7919L) % size), &i);
+
+            if (m % 4 == 3) {
+                qw_block_delete(b, i, 2);
+                size -= 2;
+            }
+            else {
+                b = qw_block_insert_str(b, i, "xy", 2);
+                size += 2;
+            }
+        }
+
+        tm = diff_time(&st, &et);
+
+        printf("%-11s: %.3f s", n ? "piece table" : "block", tm);
+        chain_mem(b, size);
+
+        /* full compaction pass */
+        diff_time(&st, NULL);
+
+        do
+            b = qw_block_compact(b, 1024);
+        while (b->chain->compacting);
+
+        tm = diff_time(&st, &et);
+
+        printf("%-11s  compacted in %.3f s", "", tm);
+        chain_mem(b, size);
+
+        qw_block_destroy(qw_block_first(b));
+    }
+
+    qw_block_pieces = pieces;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int n, pieces;
 
     setlocale(LC_ALL, "");
 
@@ -724,12 +3155,57 @@ int main(int argc, char *argv[])
             verbose = 1;
     }
 
-    test_block();
-    test_journal();
-    test_utf8();
-    test_view();
+    /* run everything over both buffer engines */
+    pieces = qw_block_pieces;
+
+    for (n = 0; n < 2; n++) {
+        qw_block_pieces = n;
+
+        if (verbose)
+            printf("\n%s engine\n\n", n ? "piece table" : "block");
+
+        test_block();
+        test_block_index();
+        test_block_compact();
+        test_search();
+        test_lines();
+        test_journal();
+        test_journal_merge();
+        test_journal_spill();
+        test_utf8();
+        test_view();
+        test_view_rows();
+        test_view_move();
+        test_file();
+        test_file_map();
+        test_file_save();
+        test_undo_file();
+        test_doc_cursor();
+        test_synhi_doc();
+        test_synhi_ahead();
+        test_core_view();
+        test_wal();
+    }
+
+    qw_block_pieces = pieces;
+
     test_synhi();
-    test_file();
+    test_synhi_lex();
+    test_pool();
+    test_deep_chains();
+    test_drv();
+
+    if (_do_benchmarks) {
+        bench_block_index();
+        bench_engines();
+        bench_search();
+        bench_lines();
+        bench_pgdn();
+        bench_synhi();
+        bench_file_load();
+        bench_file_save();
+        bench_doc_close();
+    }
 
     return test_summary();
 }